@@ -0,0 +1,66 @@
+#include "hal.h"
+#include "adc.h"
+
+uint16_t ADC_VALS[ADC_CHANNELS];
+
+static _FILTER filters[ADC_CHANNELS];
+static volatile uint16_t settings[ADC_CHANNELS];    // type | param<<8, written whole so it never tears
+static volatile uint16_t pending[ADC_CHANNELS];     // settings not yet switched to
+
+void init_adc(void) {
+    uint16_t n;
+
+    for (n = 0; n<ADC_CHANNELS; n++) {
+        settings[n] = FILTER_NONE;
+        pending[n] = 1;             // seeded from the first set
+    }
+    AD1CON1 = 0x0244;               // off, fractional (left-justified) result, Timer3 starts conversion, auto-sample
+    AD1CON2 = 0x0400|((ADC_CONVERSIONS-1)<<2)|0x0003;   // AVdd/AVss, scan MUX A, split buffer, alternate MUX A/B
+    AD1CON3 = 0x0002;               // Tad = 3 Tcy
+    AD1CHS = 0x0100;                // MUX B is EMF (AN1)
+    AD1CSSL = 0x0005;               // MUX A scans CURRENT (AN0) and FB (AN2)
+    IFS0bits.AD1IF = 0;
+    IEC0bits.AD1IE = 0;
+}
+
+void adc_start(void) {
+    IFS0bits.AD1IF = 0;
+    IEC0bits.AD1IE = 1;
+    AD1CON1bits.ADON = 1;
+}
+
+void adc_stop(void) {
+    AD1CON1bits.ADON = 0;
+    IEC0bits.AD1IE = 0;
+}
+
+void adc_serviceInterrupt(void) {
+    volatile unsigned int *buf = AD1CON2bits.BUFS ? &ADC1BUF0:&ADC1BUF8;   // the half not being filled
+    uint16_t raw[ADC_CHANNELS];
+    uint16_t n;
+
+    IFS0bits.AD1IF = 0;
+    raw[ADC_CURRENT] = (buf[0]>>1)+(buf[4]>>1);
+    raw[ADC_EMF] = (buf[1]>>2)+(buf[3]>>2)+(buf[5]>>2)+(buf[7]>>2);
+    raw[ADC_FB] = (buf[2]>>1)+(buf[6]>>1);
+    for (n = 0; n<ADC_CHANNELS; n++) {
+        if (pending[n]) {
+            filter_init(&filters[n], settings[n]&0xFF, settings[n]>>8, raw[n]);
+            pending[n] = 0;
+        }
+        ADC_VALS[n] = filter_update(&filters[n], raw[n]);
+    }
+}
+
+// From priorities below the ADC interrupt's
+int16_t adc_setFilter(uint16_t channel, uint16_t type, uint16_t param) {
+    if (channel>=ADC_CHANNELS || filter_valid(type, param)<0)
+        return -1;
+    settings[channel] = type|(param<<8);
+    pending[channel] = 1;
+    return 0;
+}
+
+uint16_t adc_filter(uint16_t channel) {
+    return settings[channel];
+}
@@ -0,0 +1,39 @@
+/*
+	PWM-synchronized ADC sampling
+
+	Each Timer3 period match starts one conversion, into the buffer
+	registers without the CPU waiting on it. pwm.c places those matches
+	mid-on and mid-off in every PWM period. The ADC alternates between MUX A,
+	scanning the two current inputs (CURRENT on AN0, FB on AN2), and MUX B,
+	fixed on EMF (AN1), so the currents are always sampled while the bridge
+	drives and the back EMF while it floats. After ADC_CONVERSIONS (four PWM
+	periods) the ADC interrupt fires and adc_serviceInterrupt() averages the
+	set out of the half of the split buffer the module is no longer filling,
+	then runs each channel's filter (filter.h) on it. adc_setFilter() only
+	queues a change; the interrupt switches over on the next set, seeding
+	the new filter with it, so the host can change filters at any time.
+*/
+
+#ifndef _ADC_H_
+#define _ADC_H_
+
+#include <stdint.h>
+#include "filter.h"
+
+#define ADC_CONVERSIONS 8           // per set: CURRENT, EMF, FB, EMF, CURRENT, EMF, FB, EMF
+#define ADC_CHANNELS    3
+
+#define ADC_CURRENT     0           // ADC_VALS index of each input
+#define ADC_EMF         1
+#define ADC_FB          2
+
+extern uint16_t ADC_VALS[ADC_CHANNELS];    // last set filtered, left-justified like pin_read
+
+void init_adc(void);
+void adc_start(void);               // before pwm_start(), so the first conversion is mid-on
+void adc_stop(void);
+void adc_serviceInterrupt(void);
+int16_t adc_setFilter(uint16_t channel, uint16_t type, uint16_t param);    // -1 if not a valid filter
+uint16_t adc_filter(uint16_t channel);  // type | param<<8, as last set
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include "autotune.h"
+#include "pid.h"
+
+#define AUTOTUNE_KU     20861L      // 4/pi << (PID_SHIFT+AUTOTUNE_SHIFT), for Ku from the relay and amplitude
+
+static uint32_t autotune_sqrt(uint32_t x) {
+    uint32_t root = 0, bit = (uint32_t)1<<30;
+
+    while (bit>x)
+        bit >>= 2;
+    while (bit) {
+        if (x>=root+bit) {
+            x -= root+bit;
+            root = (root>>1)+bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+static void autotune_gains(_AUTOTUNE *self) {
+    uint32_t amp = self->swing_sum/(2*AUTOTUNE_CYCLES), ku, kp, kd;
+
+    self->out = 0;
+    if (amp<=(uint32_t)self->hyst) {
+        self->state = AUTOTUNE_FAILED;  // inside its own band: not a relay cycle
+        return;
+    }
+    amp = autotune_sqrt(amp*amp-(uint32_t)self->hyst*self->hyst);
+    ku = (uint32_t)self->relay*AUTOTUNE_KU/amp;
+    kp = ku*3/5;
+    if (kp>32767)
+        kp = 32767;
+    self->tu = self->period_sum/AUTOTUNE_CYCLES;
+    kd = (kp*self->tu)>>(3+PID_SHIFT);
+    self->ku = (ku>0xFFFF) ? 0xFFFF:ku;
+    self->kp = kp;
+    self->kd = (kd>32767) ? 32767:kd;
+    self->state = AUTOTUNE_DONE;
+}
+
+void autotune_init(_AUTOTUNE *self) {
+    self->state = AUTOTUNE_IDLE;
+    self->out = 0;
+    self->cycles = 0;
+    self->ku = 0;
+    self->tu = 0;
+    self->kp = 0;
+    self->kd = 0;
+}
+
+void autotune_start(_AUTOTUNE *self, int32_t pos, int16_t relay, int32_t hyst) {
+    self->state = AUTOTUNE_RUNNING;
+    self->relay = relay;
+    self->hyst = hyst;
+    self->centre = pos;
+    self->out = relay;              // the first cycle is among the settling ones, wherever it starts
+    self->cycles = 0;
+    self->ticks = 0;
+    self->half = 0;
+    self->max = pos;
+    self->min = pos;
+    self->swing_sum = 0;
+    self->period_sum = 0;
+}
+
+int16_t autotune_update(_AUTOTUNE *self, int32_t pos) {
+    if (self->state!=AUTOTUNE_RUNNING)
+        return 0;
+    if (labs(pos-self->centre)>((int32_t)AUTOTUNE_SWING_MAX<<AUTOTUNE_SHIFT) || ++self->half>AUTOTUNE_HALF_MAX) {
+        self->state = AUTOTUNE_FAILED;
+        self->out = 0;
+        return 0;
+    }
+    if (self->ticks<0xFFFF)
+        self->ticks++;
+    if (pos>self->max)
+        self->max = pos;
+    if (pos<self->min)
+        self->min = pos;
+
+    if (self->out>0 && pos>self->centre+self->hyst) {
+        self->out = -self->relay;
+        self->half = 0;
+    } else if (self->out<0 && pos<self->centre-self->hyst) {
+        self->out = self->relay;    // a cycle ends, and the next starts
+        self->half = 0;
+        if (self->cycles>=AUTOTUNE_SETTLE) {
+            self->swing_sum += self->max-self->min;
+            self->period_sum += self->ticks;
+        }
+        self->ticks = 0;
+        self->max = pos;
+        self->min = pos;
+        if (++self->cycles>=AUTOTUNE_SETTLE+AUTOTUNE_CYCLES)
+            autotune_gains(self);
+    }
+    return self->out;
+}
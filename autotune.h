@@ -0,0 +1,67 @@
+/*
+	Relay-feedback autotune of the position loop
+
+	Astrom and Hagglund's experiment: in place of the position loop, a
+	relay drives a fixed current command one way or the other about where
+	the shaft started, switching as the position crosses out of a band of
+	hysteresis either side of it. The knob settles into a limit cycle at
+	the loop's ultimate period Tu, and from the relay d, the band h and the
+	cycle's amplitude a, the describing function gives the ultimate gain,
+	Ku = 4d/(pi*sqrt(a^2-h^2)). The first AUTOTUNE_SETTLE cycles are let
+	go by while the cycle settles and the next AUTOTUNE_CYCLES averaged.
+	The gains are the Ziegler-Nichols PID rule's without the integral,
+	since the servo spring should give: kp = 0.6 Ku, and kd = kp Tu/8.
+
+	The experiment fails, for the caller to take the drive off, if the
+	shaft strays more than AUTOTUNE_SWING_MAX counts from where it started
+	(no limit cycle, or the end stops) or a half cycle takes longer than
+	AUTOTUNE_HALF_MAX ticks (a hand holding the knob, or too little relay
+	to get past friction).
+
+	Positions are counts with AUTOTUNE_SHIFT fractional bits; the relay and
+	gains are in the position loop's units (pid.h), and ticks are its
+	passes.
+*/
+
+#ifndef _AUTOTUNE_H_
+#define _AUTOTUNE_H_
+
+#include <stdint.h>
+
+#define AUTOTUNE_SHIFT      8       // fractional bits of positions
+#define AUTOTUNE_SETTLE     3       // cycles before any are measured
+#define AUTOTUNE_CYCLES     8       // cycles averaged
+#define AUTOTUNE_SWING_MAX  100     // counts from the start before it gives up
+#define AUTOTUNE_HALF_MAX   1000    // ticks without a switch before it gives up
+
+enum {                              // _AUTOTUNE state
+    AUTOTUNE_IDLE,
+    AUTOTUNE_RUNNING,
+    AUTOTUNE_DONE,                  // the gains are in
+    AUTOTUNE_FAILED
+};
+
+typedef struct {
+    uint16_t state;
+    int16_t relay;                  // current command either way
+    int32_t hyst;                   // the band either side of...
+    int32_t centre;                 // ...where the shaft started
+    int16_t out;                    // the relay's side
+    uint16_t cycles;                // completed, settling ones included
+    uint16_t ticks;                 // since the cycle started (the switch to +relay)
+    uint16_t half;                  // since the last switch
+    int32_t max;                    // extremes of the cycle
+    int32_t min;
+    uint32_t swing_sum;             // peak to peak, over the cycles measured
+    uint32_t period_sum;            // ticks, over the cycles measured
+    uint16_t ku;                    // the results: ultimate gain, PID_SHIFT fractional bits...
+    uint16_t tu;                    // ...ultimate period in ticks...
+    int16_t kp;                     // ...and the gains from them
+    int16_t kd;
+} _AUTOTUNE;
+
+void autotune_init(_AUTOTUNE *self);
+void autotune_start(_AUTOTUNE *self, int32_t pos, int16_t relay, int32_t hyst);
+int16_t autotune_update(_AUTOTUNE *self, int32_t pos);    // the current command for this tick
+
+#endif
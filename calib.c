@@ -0,0 +1,72 @@
+#include "hal.h"
+#include "calib.h"
+
+#define CALIB_ADDRESS(n)    (HAL_CALIB_ADDRESS+2UL*(n))     // low word of the nth program word of the page
+
+// The record as words, the same on the PIC and the host
+static void calib_pack(const _CALIB *calib, uint16_t *words) {
+    words[0] = calib->version;
+    words[1] = calib->kp;
+    words[2] = calib->ki;
+    words[3] = calib->kd;
+    words[4] = calib->ikp;
+    words[5] = calib->iki;
+    words[6] = calib->emf_mid;
+    words[7] = calib->emf_dev;
+    words[8] = (uint16_t)calib->obs_gain;
+    words[9] = (uint16_t)((uint32_t)calib->obs_gain>>16);
+    words[10] = calib->ku;
+    words[11] = calib->tu;
+    words[12] = calib->reserved;
+}
+
+static void calib_unpack(_CALIB *calib, const uint16_t *words) {
+    calib->version = words[0];
+    calib->kp = words[1];
+    calib->ki = words[2];
+    calib->kd = words[3];
+    calib->ikp = words[4];
+    calib->iki = words[5];
+    calib->emf_mid = words[6];
+    calib->emf_dev = words[7];
+    calib->obs_gain = (int32_t)((uint32_t)words[9]<<16|words[8]);
+    calib->ku = words[10];
+    calib->tu = words[11];
+    calib->reserved = words[12];
+}
+
+static uint16_t calib_checksum(const uint16_t *words) {
+    uint16_t sum = CALIB_MAGIC, n;
+
+    for (n = 0; n<CALIB_WORDS; n++)
+        sum += words[n];
+    return ~sum;
+}
+
+int calib_load(_CALIB *calib) {
+    uint16_t words[CALIB_WORDS], n;
+
+    if (HAL_FLASH_READ(CALIB_ADDRESS(0))!=CALIB_MAGIC)
+        return -1;                  // erased, or never written
+    for (n = 0; n<CALIB_WORDS; n++)
+        words[n] = HAL_FLASH_READ(CALIB_ADDRESS(n+1));
+    if (HAL_FLASH_READ(CALIB_ADDRESS(CALIB_WORDS+1))!=calib_checksum(words) || words[0]!=CALIB_VERSION)
+        return -1;
+    calib_unpack(calib, words);
+    return 0;
+}
+
+int calib_save(const _CALIB *calib) {
+    uint16_t words[CALIB_WORDS], n;
+
+    calib_pack(calib, words);
+    HAL_FLASH_ERASE(HAL_CALIB_ADDRESS);
+    for (n = 0; n<CALIB_WORDS; n++)
+        HAL_FLASH_WRITE(CALIB_ADDRESS(n+1), words[n]);
+    HAL_FLASH_WRITE(CALIB_ADDRESS(CALIB_WORDS+1), calib_checksum(words));
+    HAL_FLASH_WRITE(CALIB_ADDRESS(0), CALIB_MAGIC);   // last, so a record cut short never looks whole
+    for (n = 0; n<CALIB_WORDS; n++)
+        if (HAL_FLASH_READ(CALIB_ADDRESS(n+1))!=words[n])
+            return -1;
+    return HAL_FLASH_READ(CALIB_ADDRESS(0))==CALIB_MAGIC ? 0:-1;
+}
@@ -0,0 +1,44 @@
+/*
+	Per-unit calibration kept in flash
+
+	What a unit learns about itself, so that it starts up with it instead
+	of the compiled-in defaults and without measuring it again: the loop
+	gains (from the autotune or set by hand), the back-EMF midpoint and its
+	noise, and the observer's back EMF gain. The record sits in the low
+	words of the program words of its own erase page, HAL_CALIB_ADDRESS
+	(reserved in the .gld), as a magic number, CALIB_WORDS of record and a
+	checksum, so an erased or half-written page is told from a good one.
+
+	calib_save() erases the page and programs the record word by word. On
+	the PIC the CPU stalls for the erase, some 20ms, interrupts and all, so
+	the caller must have the drive off first.
+*/
+
+#ifndef _CALIB_H_
+#define _CALIB_H_
+
+#include <stdint.h>
+
+#define CALIB_MAGIC     0xCA1B
+#define CALIB_VERSION   1
+#define CALIB_WORDS     13          // of the record, between the magic number and the checksum
+
+typedef struct {
+    uint16_t version;
+    int16_t kp;                     // position loop
+    int16_t ki;
+    int16_t kd;
+    int16_t ikp;                    // current loop
+    int16_t iki;
+    uint16_t emf_mid;               // EMF reading with the shaft still...
+    uint16_t emf_dev;               // ...and its mean deviation from it
+    int32_t obs_gain;               // velocity per unit back EMF, 0 if it was never learned
+    uint16_t ku;                    // the autotune's ultimate gain and period, 0 if set by hand
+    uint16_t tu;
+    uint16_t reserved;
+} _CALIB;
+
+int calib_load(_CALIB *calib);          // <0 if the page holds no good record
+int calib_save(const _CALIB *calib);    // <0 if it did not read back
+
+#endif
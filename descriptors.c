@@ -1,5 +1,9 @@
-#include <p24FJ128GB206.h>
+#include <stdint.h>
+#include "hal.h"
 #include "usb.h"
+#include "usb_app.h"
+
+#define SERIAL_DIGITS   8   // hex digits of the 32-bit serial number
 
 BYTE __attribute__ ((space(auto_psv))) Device[] = {
     0x12,       // bLength
@@ -18,14 +22,14 @@ BYTE __attribute__ ((space(auto_psv))) Device[] = {
     0x00,       // bcdDevice (high byte)
     0x01,       // iManufacturer
     0x02,       // iProduct
-    0x00,       // iSerialNumber (none)
+    0x03,       // iSerialNumber
     NUM_CONFIGURATIONS    // bNumConfigurations
 };
 
 BYTE __attribute__ ((space(auto_psv))) Configuration1[] = {
     0x09,       // bLength
     CONFIGURATION,    // bDescriptorType
-    0x12,       // wTotalLength (low byte)
+    0x19,       // wTotalLength (low byte)
     0x00,       // wTotalLength (high byte)
     NUM_INTERFACES,   // bNumInterfaces
     0x01,       // bConfigurationValue
@@ -36,11 +40,18 @@ BYTE __attribute__ ((space(auto_psv))) Configuration1[] = {
     INTERFACE,  // bDescriptorType
     0x00,       // bInterfaceNumber
     0x00,       // bAlternateSetting
-    0x00,       // bNumEndpoints (excluding EP0)
+    0x01,       // bNumEndpoints (excluding EP0)
     0xFF,       // bInterfaceClass (vendor specific class code)
     0x00,       // bInterfaceSubClass
     0xFF,       // bInterfaceProtocol (vendor specific protocol used)
-    0x00        // iInterface (none)
+    0x00,       // iInterface (none)
+    0x07,       // bLength (Endpoint1 descriptor starts here)
+    ENDPOINT,   // bDescriptorType
+    0x81,       // bEndpointAddress (EP1 IN)
+    0x02,       // bmAttributes (bulk)
+    MAX_PACKET_SIZE,    // wMaxPacketSize (low byte)
+    0x00,       // wMaxPacketSize (high byte)
+    0x00        // bInterval (ignored for bulk)
 };
 
 BYTE __attribute__ ((space(auto_psv))) String0[] = {
@@ -64,3 +75,28 @@ BYTE __attribute__ ((space(auto_psv))) String2[] = {
     'M', 0x00, 'i', 0x00, 'n', 0x00, 'i', 0x00, 'p', 0x00, 'r', 0x00, 'o', 0x00, 'j', 0x00, 'e', 0x00, 'c', 0x00, 't', 0x00, ' ', 0x00, '2', 0x00, ' ', 0x00, 
     'F', 0x00, 'i', 0x00, 'r', 0x00, 'm', 0x00, 'w', 0x00, 'a', 0x00, 'r', 0x00, 'e', 0x00
 };
+
+// Built by InitSerialNumber() from the two program words at HAL_SERIAL_ADDRESS,
+// so each board carries its own number without a rebuild of the firmware
+BYTE String3[2+2*SERIAL_DIGITS];
+
+#ifdef HAPTIC_SERIAL
+// scons serial=<n> bakes a number in; otherwise the programmer writes it (SQTP)
+const uint16_t __attribute__ ((space(prog), section(".serial"))) SerialNumber[2] = {
+    (uint16_t)((HAPTIC_SERIAL)>>16), (uint16_t)(HAPTIC_SERIAL)
+};
+#endif
+
+void InitSerialNumber(void) {
+    uint32_t serial;
+    BYTE n, digit;
+
+    serial = ((uint32_t)HAL_FLASH_READ(HAL_SERIAL_ADDRESS)<<16)|HAL_FLASH_READ(HAL_SERIAL_ADDRESS+2);
+    String3[0] = sizeof(String3);   // bLength
+    String3[1] = STRING;            // bDescriptorType
+    for (n = 0; n<SERIAL_DIGITS; n++) {
+        digit = (serial>>(4*(SERIAL_DIGITS-1-n)))&0x0F;
+        String3[2+2*n] = digit<10 ? '0'+digit:'A'+digit-10;
+        String3[3+2*n] = 0x00;      // an unprogrammed board reads FFFFFFFF, as erased flash does
+    }
+}
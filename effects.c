@@ -0,0 +1,166 @@
+#include "hal.h"
+#include "usb.h"
+#include "usb_app.h"
+#include "haptic.h"
+#include "effects.h"
+
+#define EFFECT_CELLS    (ENC_COUNT_MAX-ENC_COUNT_MIN+1)
+
+typedef struct {
+    int16_t force;                  // position-dependent force at this count
+    int16_t damping;                // per count/s of velocity, EFFECT_SHIFT fractional bits
+    int16_t friction;               // against the direction of motion
+} _EFFECT_CELL;
+
+static _EFFECT list[EFFECTS_MAX];   // as the host describes it, changed by vendor requests
+static uint16_t count;
+static volatile uint16_t pending;   // list committed but not yet compiled
+
+static _EFFECT_CELL cells[2][EFFECT_CELLS];
+static _EFFECT_CELL *volatile table;    // the one the control loop reads, switched in one write
+
+static int16_t effects_saturate(int32_t val) {
+    if (val>32767)
+        return 32767;
+    if (val<-32767)
+        return -32767;
+    return (int16_t)val;
+}
+
+void init_effects(void) {
+    uint16_t n;
+
+    for (n = 0; n<EFFECT_CELLS; n++) {
+        cells[0][n].force = 0;
+        cells[0][n].damping = 0;
+        cells[0][n].friction = 0;
+    }
+    table = cells[0];
+    count = 0;
+    pending = 0;
+}
+
+void effects_clear(void) {
+    count = 0;
+}
+
+int16_t effects_add(_EFFECT *effect) {
+    if (count==EFFECTS_MAX || effect->type==EFFECT_NONE || effect->type>EFFECT_DAMPER || effect->pos>EFFECT_POS_MAX)
+        return -1;
+    if (effect->type==EFFECT_DETENTS && (effect->width<2 || effect->width>EFFECT_DETENT_MAX))
+        return -1;
+    if ((effect->type==EFFECT_SPRING || effect->type==EFFECT_FRICTION || effect->type==EFFECT_DAMPER) &&
+        effect->width>EFFECT_ZONE_MAX)
+        return -1;
+    list[count++] = *effect;
+    return 0;
+}
+
+void effects_commit(void) {
+    pending = 1;
+}
+
+// Springs, friction and dampers can be limited to a zone; the other widths mean something else
+static int16_t effects_inZone(_EFFECT *effect, int16_t offset) {
+    if (!effect->width || effect->type==EFFECT_DETENTS || effect->type==EFFECT_WALL_LOW ||
+        effect->type==EFFECT_WALL_HIGH)
+        return 1;
+    return offset<=(int16_t)effect->width && offset>=-(int16_t)effect->width;
+}
+
+// Force of one spring-like effect offset counts from its pos, in 32 bits so
+// stacked effects saturate once
+static int32_t effects_force(_EFFECT *effect, int16_t offset) {
+    int16_t period, phase;
+
+    switch (effect->type) {
+        case EFFECT_SPRING:
+            return -(HAL_MULSS(effect->strength, offset)>>EFFECT_SHIFT);
+        case EFFECT_WALL_LOW:
+            return offset<0 ? -(HAL_MULSS(effect->strength, offset)>>EFFECT_SHIFT):0;
+        case EFFECT_WALL_HIGH:
+            return offset>0 ? -(HAL_MULSS(effect->strength, offset)>>EFFECT_SHIFT):0;
+        case EFFECT_DETENTS:
+            // Triangle wave, zero on each detent and peaking a quarter period either side
+            period = effect->width;
+            phase = offset%period;
+            if (phase<0)
+                phase += period;
+            phase <<= 2;
+            if (phase>=3*period)
+                phase -= 4*period;
+            else if (phase>period)
+                phase = 2*period-phase;
+            return -(HAL_MULSS(effect->strength, phase)/period);
+        default:
+            return 0;
+    }
+}
+
+static void effects_compile(_EFFECT *effects, uint16_t num, _EFFECT_CELL *cell) {
+    int32_t force, damping, friction;
+    int16_t pos, offset;
+    uint16_t n;
+
+    for (pos = ENC_COUNT_MIN; pos<=ENC_COUNT_MAX; pos++, cell++) {
+        force = 0;
+        damping = 0;
+        friction = 0;
+        for (n = 0; n<num; n++) {
+            offset = pos-(int16_t)effects[n].pos;
+            if (!effects_inZone(&effects[n], offset))
+                continue;
+            switch (effects[n].type) {
+                case EFFECT_FRICTION:
+                    friction += effects[n].strength;
+                    break;
+                case EFFECT_DAMPER:
+                    damping += effects[n].strength;
+                    break;
+                default:
+                    force += effects_force(&effects[n], offset);
+            }
+        }
+        cell->force = effects_saturate(force);
+        cell->damping = effects_saturate(damping);
+        cell->friction = effects_saturate(friction);
+    }
+}
+
+// Background: compiles a committed list into the table the control loop is
+// not reading, then switches it over. Takes a while, so never from an ISR.
+void effects_service(void) {
+    _EFFECT effects[EFFECTS_MAX];
+    _EFFECT_CELL *next;
+    uint16_t num, n;
+
+    if (!pending)
+        return;
+    USB_DISABLE_INTERRUPT();        // vendor requests change the list
+    num = count;
+    for (n = 0; n<num; n++)
+        effects[n] = list[n];
+    pending = 0;
+    USB_ENABLE_INTERRUPT();
+
+    next = (table==cells[0]) ? cells[1]:cells[0];
+    effects_compile(effects, num, next);
+    table = next;
+}
+
+int16_t effects_render(uint16_t pos, int16_t vel) {
+    _EFFECT_CELL *cell;
+    int32_t force;
+
+    if (pos<ENC_COUNT_MIN)
+        pos = ENC_COUNT_MIN;
+    else if (pos>ENC_COUNT_MAX)
+        pos = ENC_COUNT_MAX;
+    cell = &table[pos-ENC_COUNT_MIN];
+    force = cell->force-(HAL_MULSS(cell->damping, vel)>>EFFECT_SHIFT);
+    if (vel>0)
+        force -= cell->friction;
+    else if (vel<0)
+        force += cell->friction;
+    return effects_saturate(force);
+}
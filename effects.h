@@ -0,0 +1,52 @@
+/*
+	Table-driven haptic effects
+
+	The host describes what the knob should feel like as a short list of
+	effects over the encoder range (ENC_COUNT_MIN..ENC_COUNT_MAX): springs,
+	detents, walls, friction and damping. effects_service() compiles the
+	list in the background into one cell per encoder count holding the
+	position-dependent force and the damping and friction coefficients
+	there, into whichever of two tables the control loop is not reading,
+	and then switches the loop over to it. Rendering is then a single cell
+	lookup and one multiply per tick however many effects are stacked.
+
+	Forces are torque commands in the current loop's units (FB_VAL>>3, about
+	14300 counts per A). Spring and damper strengths have EFFECT_SHIFT
+	fractional bits.
+*/
+
+#ifndef _EFFECTS_H_
+#define _EFFECTS_H_
+
+#include <stdint.h>
+
+#define EFFECTS_MAX     8           // effects in the list
+#define EFFECT_SHIFT    6           // fractional bits of spring and damper strengths
+#define EFFECT_DETENT_MAX   8191    // widest detent spacing, so four periods fit an int16
+#define EFFECT_ZONE_MAX     32767   // widest zone, so -width fits an int16
+#define EFFECT_POS_MAX      32767   // highest pos, 0 up to it, so the offset from any cell fits an int16
+
+// Effect types. A zone is pos +/- width, width 0 meaning the whole range.
+#define EFFECT_NONE         0
+#define EFFECT_SPRING       1       // pulls toward pos within its zone, strength per count
+#define EFFECT_DETENTS      2       // a detent at pos and every width counts, strength at the peak
+#define EFFECT_WALL_LOW     3       // pushes back below pos, strength per count
+#define EFFECT_WALL_HIGH    4       // pushes back above pos, strength per count
+#define EFFECT_FRICTION     5       // opposes motion within its zone with strength
+#define EFFECT_DAMPER       6       // opposes motion within its zone, strength per count/s
+
+typedef struct {
+    uint16_t type;
+    uint16_t pos;                   // encoder count, 0-EFFECT_POS_MAX
+    uint16_t width;                 // counts
+    int16_t strength;
+} _EFFECT;
+
+void init_effects(void);
+void effects_clear(void);
+int16_t effects_add(_EFFECT *effect);   // returns -1 if the list is full or the effect is invalid
+void effects_commit(void);
+void effects_service(void);
+int16_t effects_render(uint16_t pos, int16_t vel);
+
+#endif
@@ -0,0 +1,55 @@
+#include "emf.h"
+
+static void emf_thresholds(_EMF *self) {
+    uint32_t width = (self->dev_acc>>EMF_TRACK_SHIFT)*EMF_DEV_MULT;
+
+    if (width<self->band)
+        width = self->band;
+    self->low = (self->mid>width) ? self->mid-width:0;
+    self->high = (self->mid<0xFFFF-width) ? self->mid+width:0xFFFF;
+}
+
+void emf_init(_EMF *self, uint16_t mid, uint16_t band) {
+    self->mid = mid;
+    self->band = band;
+    self->startup = EMF_STARTUP_SETS;
+    self->sum = 0;
+    self->count = 0;
+    self->mid_acc = (uint32_t)mid<<EMF_TRACK_SHIFT;
+    self->dev_acc = 0;
+    emf_thresholds(self);
+}
+
+void emf_load(_EMF *self, uint16_t mid, uint16_t dev, uint16_t band) {
+    emf_init(self, mid, band);
+    self->startup = 0;
+    self->dev_acc = (uint32_t)dev<<EMF_TRACK_SHIFT;
+    emf_thresholds(self);
+}
+
+void emf_update(_EMF *self, uint16_t emf, uint16_t still) {
+    uint16_t dev, mean;
+
+    if (self->startup) {            // counts down moving or not, so a turning knob cannot hold off the drive
+        if (still && self->count) {  // the first edge lags a knob starting to turn; its EMF does not
+            mean = self->sum/self->count;
+            if ((emf>mean ? emf-mean:mean-emf)>self->band)
+                still = 0;
+        }
+        if (still) {                // the running mean stands in for the guess straight away
+            self->sum += emf;
+            self->count++;
+            self->mid = self->sum/self->count;
+            self->mid_acc = (uint32_t)self->mid<<EMF_TRACK_SHIFT;
+        }
+        self->startup--;            // with no still set at all, tracking starts from the guess
+    } else {
+        if (!still)
+            return;
+        self->mid_acc += (int32_t)emf-(int32_t)(uint16_t)(self->mid_acc>>EMF_TRACK_SHIFT);    // signed, or a fall wraps in a 16-bit int
+        self->mid = self->mid_acc>>EMF_TRACK_SHIFT;
+        dev = (emf>self->mid) ? emf-self->mid:self->mid-emf;
+        self->dev_acc += (int32_t)dev-(int32_t)(uint16_t)(self->dev_acc>>EMF_TRACK_SHIFT);
+    }
+    emf_thresholds(self);
+}
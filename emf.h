@@ -0,0 +1,45 @@
+/*
+	Back-EMF midpoint calibration
+
+	The EMF input reads a per-unit offset with the shaft still (measured
+	anywhere from 33536 to 33664 on the bench), and the encoder's direction
+	thresholds have to sit either side of it. For the first
+	EMF_STARTUP_SETS sets after power-up the caller holds the drive off and
+	the midpoint is the running mean of the sets taken with the shaft
+	still, leaving out any that stray more than the band from it, since a
+	knob starting to turn shows in the EMF well before its first edge.
+	From then on emf_update() tracks the midpoint with a slow low-pass, fed only with sets taken while
+	the shaft is still and little current is being driven. It also tracks
+	the mean deviation of those sets from the midpoint. The thresholds are
+	the midpoint plus and minus the larger of the minimum band and
+	EMF_DEV_MULT mean deviations, so a noisier unit gets a wider dead band
+	instead of chatter. A midpoint and deviation kept from an earlier run
+	(calib.h) go in with emf_load(), which skips the startup sets.
+*/
+
+#ifndef _EMF_H_
+#define _EMF_H_
+
+#include <stdint.h>
+
+#define EMF_STARTUP_SETS    256     // floating sets averaged at power-up
+#define EMF_TRACK_SHIFT     10      // each still set moves the midpoint by 1/1024 of its offset
+#define EMF_DEV_MULT        3       // thresholds stay this many mean deviations from the midpoint
+
+typedef struct {
+    uint16_t mid;                   // EMF reading with the shaft still
+    uint16_t low;                   // below this the shaft turns one way...
+    uint16_t high;                  // ...above this the other
+    uint16_t band;                  // least distance of the thresholds from mid
+    uint16_t startup;               // startup sets still to take, 0 once tracking
+    uint32_t sum;                   // of the startup sets
+    uint16_t count;
+    uint32_t mid_acc;               // mid << EMF_TRACK_SHIFT
+    uint32_t dev_acc;               // mean |EMF-mid| << EMF_TRACK_SHIFT
+} _EMF;
+
+void emf_init(_EMF *self, uint16_t mid, uint16_t band);    // guesses, until the startup sets are in
+void emf_load(_EMF *self, uint16_t mid, uint16_t dev, uint16_t band);  // a stored calibration, tracking from the start
+void emf_update(_EMF *self, uint16_t emf, uint16_t still);  // still: no motion and no drive to speak of
+
+#endif
@@ -0,0 +1,65 @@
+#include "filter.h"
+
+int16_t filter_valid(uint16_t type, uint16_t param) {
+    switch (type) {
+        case FILTER_NONE:
+            return 0;
+        case FILTER_IIR:
+            return (param>=1 && param<=6) ? 0:-1;
+        case FILTER_MEAN:
+            return (param>=1 && (1<<param)<=FILTER_TAPS) ? 0:-1;
+        case FILTER_MEDIAN:
+            return (param>=3 && param<FILTER_TAPS && (param&1)) ? 0:-1;
+        default:
+            return -1;
+    }
+}
+
+void filter_init(_FILTER *self, uint16_t type, uint16_t param, uint16_t seed) {
+    uint16_t n;
+
+    self->type = type;
+    self->param = param;
+    for (n = 0; n<FILTER_TAPS; n++)
+        self->ring[n] = seed;
+    self->head = 0;
+    if (type==FILTER_IIR || type==FILTER_MEAN)
+        self->acc = (uint32_t)seed<<param;
+    else
+        self->acc = 0;
+}
+
+// Insertion sort of at most FILTER_TAPS-1 values, cheaper than anything cleverer at this size
+static uint16_t filter_median(_FILTER *self) {
+    uint16_t sorted[FILTER_TAPS];
+    uint16_t num = self->param;
+    uint16_t n, m, val;
+
+    for (n = 0; n<num; n++) {
+        val = self->ring[(self->head-1-n)&(FILTER_TAPS-1)];
+        for (m = n; m>0 && sorted[m-1]>val; m--)
+            sorted[m] = sorted[m-1];
+        sorted[m] = val;
+    }
+    return sorted[num>>1];
+}
+
+uint16_t filter_update(_FILTER *self, uint16_t in) {
+    uint16_t old;
+
+    switch (self->type) {
+        case FILTER_IIR:
+            self->acc += (int32_t)in-(int32_t)(uint16_t)(self->acc>>self->param);  // signed, or a fall wraps in a 16-bit int
+            return self->acc>>self->param;
+        case FILTER_MEAN:
+            old = self->ring[(self->head-(1<<self->param))&(FILTER_TAPS-1)];   // falls out of the window
+            self->ring[(self->head++)&(FILTER_TAPS-1)] = in;
+            self->acc += (int32_t)in-(int32_t)old;
+            return self->acc>>self->param;
+        case FILTER_MEDIAN:
+            self->ring[(self->head++)&(FILTER_TAPS-1)] = in;
+            return filter_median(self);
+        default:
+            return in;
+    }
+}
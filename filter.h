@@ -0,0 +1,48 @@
+/*
+	Fixed-point sample filters
+
+	One _FILTER per ADC channel, run on every sample set in the ADC
+	interrupt. Values are left-justified like ADC_VALS, so the bits below
+	the 10-bit conversion are free to carry the extra resolution averaging
+	adds. The mean and median keep the last FILTER_TAPS inputs in a ring
+	buffer:
+
+	  FILTER_NONE     the set as converted
+	  FILTER_IIR      first-order low-pass, each set weighted 1/2^param
+	                  (1-6), the state kept with param extra bits so small
+	                  steps are not lost to truncation
+	  FILTER_MEAN     oversample and decimate: mean of the last 2^param sets
+	                  (1-3) from a running sum, one add and one subtract a set
+	  FILTER_MEDIAN   median of the last param sets (3, 5 or 7), which throws
+	                  out single-set spikes without smearing edges
+
+	Every filter but FILTER_NONE delays the signal: about 2^param-1 sets for
+	the IIR, (2^param-1)/2 for the mean and (param-1)/2 for the median, at
+	one set per control tick.
+*/
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <stdint.h>
+
+#define FILTER_NONE     0
+#define FILTER_IIR      1
+#define FILTER_MEAN     2
+#define FILTER_MEDIAN   3
+
+#define FILTER_TAPS     8           // power of 2
+
+typedef struct {
+    uint16_t type;
+    uint16_t param;
+    uint16_t ring[FILTER_TAPS];     // last inputs
+    uint16_t head;
+    uint32_t acc;                   // IIR state << param, or the running sum of the mean
+} _FILTER;
+
+int16_t filter_valid(uint16_t type, uint16_t param);   // 0 if filter_init() would take it
+void filter_init(_FILTER *self, uint16_t type, uint16_t param, uint16_t seed);  // as if fed seed forever
+uint16_t filter_update(_FILTER *self, uint16_t in);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+	Hardware abstraction layer for the haptic firmware
+
+	The firmware talks to the PIC24FJ128GB206 through the pin/timer/oc/ui/uart
+	library calls and a handful of SFRs. On the target those come straight from
+	the device header and ../lib. When built with HAPTIC_SIM the same names are
+	provided by sim/, which models the peripherals and a DC motor + encoder
+	plant so the control code can be run and profiled natively on Linux.
+*/
+
+#ifndef _HAL_H_
+#define _HAL_H_
+
+#ifdef HAPTIC_SIM
+
+#include "sim.h"                // simulated SFRs, peripherals and motor plant
+
+#define HAL_ISR                 // simulated ISRs are plain functions called by the scheduler
+#define HAL_MULSS(a, b)         ((int32_t)(int16_t)(a)*(int16_t)(b))    // 16x16->32 signed multiply
+#define HAL_DISABLE_INTERRUPTS()    do {} while (0)     // simulated ISRs never preempt the caller
+#define HAL_ENABLE_INTERRUPTS()     do {} while (0)
+#define HAL_FLASH_READ(addr)    sim_flash_read(addr)
+#define HAL_FLASH_ERASE(addr)   sim_flash_erase(addr)
+#define HAL_FLASH_WRITE(addr, word) sim_flash_write(addr, word)
+
+#else
+
+#include <p24FJ128GB206.h>      // PIC
+#include "common.h"
+#include "oc.h"                 // output compare
+#include "pin.h"
+#include "timer.h"
+#include "uart.h"
+#include "ui.h"
+
+#define HAL_ISR __attribute__((interrupt, auto_psv))
+#define HAL_MULSS(a, b)         ((int32_t)__builtin_mulss((a), (b)))    // single-cycle MUL.SS
+#define HAL_DISABLE_INTERRUPTS()    __builtin_disi(0x3FFF)  // priorities 1-6, for short critical sections
+#define HAL_ENABLE_INTERRUPTS()     (DISICNT = 0)
+#define HAL_FLASH_READ(addr)    (TBLPAG = (uint16_t)((addr)>>16), __builtin_tblrdl((uint16_t)(addr)))  // low word of a program word
+#define HAL_FLASH_ERASE(addr)   do {                \
+        NVMCON = 0x4042;    /* page erase */        \
+        TBLPAG = (uint16_t)((addr)>>16);            \
+        __builtin_tblwtl((uint16_t)(addr), 0xFFFF); \
+        __builtin_write_NVM();                      \
+        while (NVMCONbits.WR);                      \
+    } while (0)                                     // the page addr is in; the CPU stalls until it is done
+#define HAL_FLASH_WRITE(addr, word) do {            \
+        NVMCON = 0x4003;    /* word program */      \
+        TBLPAG = (uint16_t)((addr)>>16);            \
+        __builtin_tblwtl((uint16_t)(addr), (word)); \
+        __builtin_tblwth((uint16_t)(addr), 0xFF);   \
+        __builtin_write_NVM();                      \
+        while (NVMCONbits.WR);                      \
+    } while (0)                                     // low word of an erased program word
+
+#endif
+
+#define HAL_SERIAL_ADDRESS      0x157F0UL   // the serial number's two program words, high half first (see the .gld)
+#define HAL_CALIB_ADDRESS       0x15000UL   // the erase page kept for calib.c's record (see the .gld)
+#define HAL_FLASH_PAGE          0x400UL     // program addresses per erase page, 512 program words
+
+#endif
@@ -12,22 +12,54 @@
 **************************************************** */
 
 // Include files
-#include <p24FJ128GB206.h> // PIC
+#include "hal.h"		   // PIC or simulated hardware
+#ifndef HAPTIC_SIM
 #include "config.h"
-#include "common.h"
-#include "oc.h"			   // output compare
-#include "pin.h"
-#include "timer.h"
-#include "uart.h"
-#include "ui.h"
+#endif
+#include "haptic.h"
+#include "adc.h"
+#include "autotune.h"
+#include "calib.h"
+#include "effects.h"
+#include "emf.h"
+#include "observer.h"
+#include "pid.h"
+#include "prof.h"
+#include "pwm.h"
+#include "snapshot.h"
+#include "sof.h"
+#include "trajectory.h"
+#include "telemetry.h"
 #include "usb.h"
+#include "usb_app.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 // Define vendor requests
 #define SET_VALS            1   // Vendor request that receives 2 unsigned integer values
 #define GET_VALS            2   // Vendor request that returns  2 unsigned integer values
 #define PRINT_VALS          3   // Vendor request that prints   2 unsigned integer values 
 #define PING_ULTRASONIC     4   // Vendor request that prints 	1 unsigned integer value
+#define SET_GAIN            5   // Vendor request that sets gain wIndex (0-2 position kp, ki, kd, 3-4 current kp, ki) to wValue
+#define GET_GAINS           6   // Vendor request that returns  the five gains
+#define CLEAR_EFFECTS       7   // Vendor request that empties the effect list
+#define ADD_EFFECT          8   // Vendor request that appends the effect in its 8-byte data stage
+#define COMMIT_EFFECTS      9   // Vendor request that has the effect list compiled and rendered
+#define SET_TRAJECTORY      10  // Vendor request that plays the points in its data stage, repeating if wValue is 1
+#define GET_PROF            11  // Vendor request that returns the timing of section wValue, clearing it if wIndex is 1
+#define SET_FILTER          12  // Vendor request that filters ADC channel wIndex with type wValue&0xFF, parameter wValue>>8
+#define GET_FILTERS         13  // Vendor request that returns  each channel's filter type and parameter
+#define GET_EMF             14  // Vendor request that returns  the calibrated EMF midpoint and direction thresholds
+#define SET_LIMITS          15  // Vendor request that sets the soft limits on ENC_COUNT_VAL to wValue..wIndex, up to 32767
+#define GET_LIMITS          16  // Vendor request that returns  the soft limits
+#define SET_TELEMETRY       17  // Vendor request that streams channel mask wValue, sending a packet every wIndex ticks (0 for the default)
+#define GET_TELEMETRY       18  // Vendor request that returns  the packet version, channel mask and ticks per packet
+#define GET_CLOCK           19  // Vendor request that returns  the last SOF's frame and device time, the time now, and the last request's
+#define GET_STATE           20  // Vendor request that returns  the encoder, EMF calibration and observer state after a tick (control_getState)
+#define AUTOTUNE            21  // Vendor request that tunes the position loop with relay current wValue and hysteresis wIndex (1/256 counts), 0 for the defaults, storing the gains found
+#define GET_AUTOTUNE        22  // Vendor request that returns  the autotune's state and cycles, the calibration's, and Ku, Tu, kp and kd
+#define STORE_CALIB         23  // Vendor request that stores the gains in use and the EMF and observer calibration in flash
 
 // Define names for pins
 #define ENCODER         &D[0] // Encoder pin
@@ -46,30 +78,64 @@
 
 // Define names for timers
 #define BLINKY_TIMER	&timer1 // blinky light
-#define PWM_TIMER		&timer2 // motor
+                                // timer2/timer3 run the PWM and ADC triggers, see pwm.h
 
-// Define motor constants
-#define freq		  250 // run the motor at 250Hz
-#define duty_init	  0
+// Define control loop constants
+#define CONTROL_FREQ	  (PWM_FREQ*2/ADC_CONVERSIONS) // one pass per ADC set, 5kHz
+#define CONTROL_PERIOD	  (PWM_PERIOD*ADC_CONVERSIONS/2) // in instruction cycles
+#define CONTROL_PRIORITY  5
+#define ENCODER_PRIORITY  6    // edge capture only queues a timestamp, so it may preempt the loop
+
+#if CONTROL_FREQ < 1000 || CONTROL_FREQ > 10000
+#error "CONTROL_FREQ must be between 1kHz and 10kHz"
+#endif
 
 // Define encoder direction constants
-#define emf_val_l	  32768 // the middle value for EMF_VAL
-#define emf_val_r	  32832 // the chatter value for EMF_VAL
-#define ENC_COUNT_MIN 865   // rails for encoder value
-#define ENC_COUNT_MAX 1138
+#define emf_mid_init  32800 // EMF_VAL with the shaft still, until the startup calibration is in
+#define emf_band	  32    // least distance of the direction thresholds from the midpoint
+#define emf_still_ticks	  (CONTROL_FREQ/50) // 20ms without an edge, and...
+#define emf_still_current 1000  // ...under 70mA, and the EMF reading tracks the midpoint
+#define emf_filter	  FILTER_NONE   // EMF filter and its parameter, see filter.h (lag miscounts reversals)
+#define emf_filter_n  0
+#define current_filter	  FILTER_NONE   // CURRENT filter, for reporting only
+#define current_filter_n  0
+#define fb_filter	  FILTER_NONE   // FB filter (lag is phase lost in the current loop)
+#define fb_filter_n	  0
+
+// Define encoder edge capture constants
+#define ENCODER_RP		  20     // D[0] is RP20
+#define CAPTURE_FREQ	  250000 // IC1 timestamp clock, Fcy/64 from timer5
+#define ENC_EDGES		  16     // edges queued between capture and control loop (power of 2)
+#define ENC_STALE_TICKS	  (CONTROL_FREQ/4) // edge intervals past this wrap the 16-bit capture timer
+#define enc_origin		  1000   // ENC_POS_VAL at power-up
+
+// Define observer constants (see observer.h)
+#define obs_alpha	  OBSERVER_GAIN(1)   // an edge puts the position on the boundary it crossed
+#define obs_beta	  OBSERVER_GAIN(1)   // and the velocity on its distance over time, until the back EMF gain is learned
 
-// Define PID constants
-#define setpoint 1000
-#define kp		 485
+// Define position loop constants (current command per count, see pid.h)
+#define POSITION_FREQ	  1000 // run the outer position loop at 1kHz
+#define POSITION_TICKS	  (CONTROL_FREQ/POSITION_FREQ)
+#define setpoint 1000           // until the host uploads a trajectory
+#define kp_init  PID_GAIN(282)	// 20mA per count, the stiffness of the old 485 duty counts per count at stall
+#define ki_init  PID_GAIN(0)		// a virtual spring should give, so no integral by default
+#define kd_init  1600			// per count/tick at 1kHz
+
+// Define current loop constants (Q15 effort per current count)
+#define fb_shift	  3     // FB_VAL>>fb_shift is the current, 14300 counts per A
+#define current_max	  7000  // torque command limit, 0.49A; FB reads up to 0.57A
+#define ikp_init PID_GAIN(0.36)	// crossover around 300Hz with the zero on the
+#define iki_init PID_GAIN(0.32)	// motor's R/L pole
+#define tune_relay	  1000  // autotune current command either way, 70mA, four times what stiction holds
+#define tune_hyst	  (1<<AUTOTUNE_SHIFT)   // and a count either side of where it started
+#define calib_hold_ticks  3     // ticks from taking the drive off to drive() having written it
 
 /***************************************************** 
 		Function Prototypes & Variables
 **************************************************** */ 
 
-void initChip(void);
-void initInt(void);
-
-void __attribute__((interrupt)) _CNInterrupt(void); 
+void HAL_ISR _IC1Interrupt(void); 
+void HAL_ISR _ADC1Interrupt(void); 
 
 uint16_t LOW  = 0;
 uint16_t HIGH = 1;
@@ -77,12 +143,46 @@ uint16_t HIGH = 1;
 uint16_t CURRENT_VAL;
 uint16_t EMF_VAL;
 uint16_t FB_VAL;
-uint16_t ENC_COUNT_VAL = 1000;
+int32_t  ENC_POS_VAL = enc_origin;  // edges counted since power-up, unclamped
+uint16_t ENC_COUNT_VAL = enc_origin;  // ENC_POS_VAL held to the soft limits, what the loop controls
+uint16_t ENC_LIMIT_MIN = ENC_COUNT_MIN;  // soft limits
+uint16_t ENC_LIMIT_MAX = ENC_COUNT_MAX;
+uint16_t ENC_LIMIT_NEXT[2];   // SET_LIMITS hands these to the control loop...
+volatile uint16_t ENC_LIMIT_PENDING;  // ...when this is set
+uint16_t TICK_VAL;            // control loop ticks since start
+uint16_t SETPOINT_VAL = setpoint;  // position the servo spring pulls toward
+int16_t  ENC_DIR_VAL;         // direction encoder edges count in, from the back EMF
+uint16_t ENC_PERIOD_VAL;      // last edge interval in CAPTURE_FREQ ticks, 0 if unknown
+int16_t  ENC_VEL_VAL;         // encoder rate from edge intervals (counts/s)
+_OBSERVER OBS;                // position, velocity and acceleration between edges
+int16_t  OBS_VEL_VAL;         // observed velocity (counts/s)
+int16_t  OBS_ACC_VAL;         // observed acceleration (16 counts/s^2)
 
-uint16_t DUTY_VAL = 65536*2/5; // 40% duty cycle
-uint16_t EMF_MID = 32768;     // middle point for EMF ADC
+uint16_t DUTY_VAL = 0;         // off until the first pass of the loop
+uint16_t INV_VAL;             // direction to drive DUTY_VAL in
+_EMF     EMF_CAL;             // EMF midpoint and the direction thresholds around it
 
-int16_t  error;
+_PID     PID;                 // position loop, outputs CURRENT_CMD_VAL
+_PID     CURRENT_PID;         // current loop, outputs the effort for DUTY_VAL
+int16_t  CURRENT_CMD_VAL;     // torque command, as signed FB current
+int16_t  CURRENT_MEAS_VAL;    // FB current signed by the direction it was driven in
+uint16_t POSITION_TICK_VAL;   // control ticks since the last position loop pass
+_AUTOTUNE TUNE;               // relay experiment in place of the position loop, when the host asks
+uint16_t TUNE_NEXT[2];        // AUTOTUNE hands its relay and hysteresis to the control loop...
+volatile uint16_t TUNE_PENDING;  // ...when this is set
+volatile uint16_t CALIB_STATUS = CALIB_DEFAULTS;  // where the gains and calibration came from, or storing them
+uint16_t CALIB_TICK;          // TICK_VAL when the drive was taken off to store them
+
+uint16_t ENC_EDGE_BUF[ENC_EDGES];  // IC1 timestamps
+volatile uint16_t ENC_EDGE_HEAD;  // advanced only by the capture interrupt
+volatile uint16_t ENC_EDGE_TAIL;  // advanced only by the control loop
+uint16_t ENC_EDGE_TIME;       // timestamp of the last edge seen by the control loop
+uint16_t ENC_EDGE_TICKS = ENC_STALE_TICKS;  // control ticks since then
+int16_t  ENC_EDGE_DIR;        // direction of the last counted edge
+
+SOF_TIME REQUEST_TIME;        // when the last vendor request but GET_CLOCK was handled...
+uint16_t REQUEST_VAL = NO_REQUEST;  // ...which one it was...
+uint16_t REQUEST_COUNT;       // ...and how many there have been, for GET_CLOCK to acknowledge
 
 /*************************************************
 			Initialize the PIC24F
@@ -111,8 +211,9 @@ void initChip(){
     pin_analogIn(CURRENT);      // configure analog inputs
     pin_analogIn(EMF); 
     pin_analogIn(FB); 
+    init_adc();                 // scan them in the background
 
-	oc_pwm  (&oc1, nD2, PWM_TIMER, freq, duty_init);	// configure motor PWM
+	init_pwm(nD2);				// configure motor PWM
 
 }
 
@@ -122,13 +223,70 @@ void initChip(){
 
 void initInt(void) {
 
-	// Enable encoder change interrupt
-	CNEN1bits.CN14IE = 1; 	// configure change notification interrupt D[0]
-	IFS1bits.CNIF = 0;		// clear change notification flag D[0]	
-	IEC1bits.CNIE = 1;		// enable notification interrupt D[0]
+	// Capture encoder edges with IC1, timestamped at CAPTURE_FREQ
+	T5CON = 0x8020;			// timer5 on, Fcy/64 clocks the capture timer
+	PR5 = 0xFFFF;
+	__builtin_write_OSCCONL(OSCCON&0xBF);	// unlock peripheral pin select
+	RPINR7bits.IC1R = ENCODER_RP;			// IC1 input is D[0]
+	__builtin_write_OSCCONL(OSCCON|0x40);	// lock peripheral pin select
+	IC1CON2 = 0x0000;		// capture timer free-runs, not synchronized
+	IC1CON1 = 0x0C01;		// clock from timer5, interrupt on every capture, capture every edge
+	IFS0bits.IC1IF = 0;		// clear input capture flag
+	IEC0bits.IC1IE = 1;		// enable input capture interrupt
+	IPC0bits.IC1IP = ENCODER_PRIORITY;
+
+	IPC3bits.AD1IP = CONTROL_PRIORITY;	// control loop runs when a sample set is in
+
+    init_prof(CONTROL_PERIOD);	// timer4 times the hot paths
 
 }
 
+/*************************************************
+            Initialize Control Loop
+**************************************************/
+
+void initControl(void) {
+
+    init_sof();                 // device time, for the host to line up with USB frames
+    init_effects();             // nothing but the servo spring until the host adds effects
+    init_trajectory();
+    pid_init(&PID, kp_init, ki_init, kd_init, -current_max, current_max);
+    pid_reset(&PID, ENC_COUNT_VAL);
+    pid_init(&CURRENT_PID, ikp_init, iki_init, 0, -32767, 32767);
+    pid_reset(&CURRENT_PID, 0);
+    CURRENT_CMD_VAL = 0;
+    POSITION_TICK_VAL = POSITION_TICKS-1;   // first pass of the loop runs both
+    emf_init(&EMF_CAL, emf_mid_init, emf_band);    // holds the drive off for its first sets
+    observer_init(&OBS, obs_alpha, obs_beta, CONTROL_FREQ);
+    autotune_init(&TUNE);
+    TUNE_PENDING = 0;
+    initCalib();                // this unit's own gains and calibration, if it has stored them
+    adc_setFilter(ADC_CURRENT, current_filter, current_filter_n);
+    adc_setFilter(ADC_EMF, emf_filter, emf_filter_n);
+    adc_setFilter(ADC_FB, fb_filter, fb_filter_n);
+    adc_start();				// one sample set, and one pass of the control loop, per 4 PWM periods
+    pwm_start();				// ADC triggers run in step with the PWM from here
+
+}
+
+void initCalib(void) {
+    _CALIB calib;
+
+    CALIB_STATUS = CALIB_DEFAULTS;
+    if (calib_load(&calib)<0){
+        return;                 // the defaults, and the EMF startup sets
+    }
+    pid_setGains(&PID, calib.kp, calib.ki, calib.kd);
+    pid_setGains(&CURRENT_PID, calib.ikp, calib.iki, 0);
+    emf_load(&EMF_CAL, calib.emf_mid, calib.emf_dev, emf_band);
+    observer_setGain(&OBS, calib.obs_gain);
+    TUNE.ku = calib.ku;         // for GET_AUTOTUNE
+    TUNE.tu = calib.tu;
+    TUNE.kp = calib.kp;
+    TUNE.kd = calib.kd;
+    CALIB_STATUS = CALIB_LOADED;
+}
+
 /*************************************************
             Initialize Motor 
 **************************************************/
@@ -139,7 +297,10 @@ void initMotor(void) {
     pin_write(SLEW, HIGH); // slew rate is fast
     pin_write(INV, LOW);   // invert    OFF
     pin_write(D1, LOW);    // disable D1 OFF
-    pin_write(nD2, HIGH);  // disable D2 OFF
+    pwm_write(0);          // disable D2 ON until the loop drives
+
+    pin_write(IN1, HIGH);  // keep one input high
+    pin_write(IN2, LOW);   // keep one input low
     
 }
 
@@ -147,29 +308,170 @@ void initMotor(void) {
             Interrupt Declarations
 **************************************************/
 
-void __attribute__((interrupt, auto_psv)) _CNInterrupt(void) {
+void HAL_ISR _IC1Interrupt(void) {
+    PROF_DECLARE(t);
+
+    PROF_START(t);
     encoder_serviceInterrupt();
+    PROF_END(PROF_ENCODER, t);
 }                   
 
+void HAL_ISR _ADC1Interrupt(void) {
+    PROF_DECLARE(t);
+    PROF_DECLARE(t_adc);
+
+    prof_period(PROF_PERIOD);
+    PROF_START(t);
+    PROF_START(t_adc);
+    adc_serviceInterrupt();
+    PROF_END(PROF_ADC, t_adc);
+    control_serviceInterrupt();
+    PROF_END(PROF_CONTROL, t);
+}
+
 /*************************************************
             Interrupt Service Routines
 **************************************************/
 
 void encoder_serviceInterrupt() {
-    IFS1bits.CNIF = 0; // clear change notification flag D[0]	
-	EMF_VAL = pin_read(EMF);
-	if (EMF_VAL > emf_val_r){
-		ENC_COUNT_VAL ++; // increment the encoder
-	}
-	if (EMF_VAL < emf_val_l){
-		ENC_COUNT_VAL --; // decrement the encoder
+    uint16_t head = ENC_EDGE_HEAD;
+    uint16_t time;
+
+    IFS0bits.IC1IF = 0; // clear input capture flag
+    while (IC1CON1bits.ICBNE) {
+        time = IC1BUF;
+        if ((uint16_t)(head-ENC_EDGE_TAIL)<ENC_EDGES)
+            ENC_EDGE_BUF[(head++)&(ENC_EDGES-1)] = time;  // otherwise the control loop is behind
+    }
+    ENC_EDGE_HEAD = head;
+}
+
+void control_serviceInterrupt(void) {
+    SAMPLE sample;
+    PROF_DECLARE(t);
+
+    sof_tick(TICK_VAL);         // the time samples and requests are stamped with
+    drive();                    // last tick's output, early in the PWM period
+    readSensors();
+    encoder_service();
+    PROF_START(t);
+    pid();
+    PROF_END(PROF_PID, t);
+
+    sample.time = TICK_VAL++;
+    sample.current = CURRENT_VAL;
+    sample.emf = EMF_VAL;
+    sample.fb = FB_VAL;
+    sample.enc = ENC_COUNT_VAL;
+    sample.pos = (uint16_t)ENC_POS_VAL;     // the host unwraps it
+    sample.vel = OBS_VEL_VAL;
+    sample.acc = OBS_ACC_VAL;
+    sample.edges = ENC_EDGE_TAIL;   // every edge moves it on, direction or not
+    snapshot_publish(&sample);  // for GET_VALS
+    telemetry_record(&sample);  // stream every tick to the host
+}
+
+/*************************************************
+            Sensors
+**************************************************/
+
+void readSensors(void) {
+    CURRENT_VAL = ADC_VALS[ADC_CURRENT];    // latest set, no conversion here
+    EMF_VAL = ADC_VALS[ADC_EMF];
+    FB_VAL = ADC_VALS[ADC_FB];
+
+    // FB only reads the magnitude; the set was taken while driving INV_VAL's way
+    CURRENT_MEAS_VAL = FB_VAL>>fb_shift;
+    if (INV_VAL == HIGH){
+        CURRENT_MEAS_VAL = -CURRENT_MEAS_VAL;
+    }
+}
+
+/*************************************************
+            Encoder
+**************************************************/
+
+void encoder_service(void) {
+    uint16_t tail = ENC_EDGE_TAIL;
+    uint16_t elapsed, time;
+    uint32_t speed;
+    int16_t delta = 0;
+    int32_t emf;
+
+    // Keep the thresholds centred on what EMF reads with the shaft still
+    emf_update(&EMF_CAL, EMF_VAL, ENC_EDGE_TICKS >= emf_still_ticks &&
+               (EMF_CAL.startup || abs(CURRENT_MEAS_VAL) < emf_still_current));
+
+    // Direction of the edges since the last tick, from the (filtered) back EMF
+    if (EMF_VAL > EMF_CAL.high){
+        ENC_DIR_VAL = 1;
+    }
+    else if (EMF_VAL < EMF_CAL.low){
+        ENC_DIR_VAL = -1;
+    }
+    else{
+        ENC_DIR_VAL = 0;
+    }
+
+    // Count the captured edges and take their intervals
+    if (ENC_EDGE_TICKS < ENC_STALE_TICKS){
+        ENC_EDGE_TICKS++;
+    }
+    while (tail != ENC_EDGE_HEAD) {
+        time = ENC_EDGE_BUF[tail&(ENC_EDGES-1)];
+        ENC_PERIOD_VAL = (ENC_EDGE_TICKS < ENC_STALE_TICKS) ? time-ENC_EDGE_TIME:0;
+        ENC_EDGE_TIME = time;
+        ENC_EDGE_TICKS = 0;
+        delta += ENC_DIR_VAL;
+        if (ENC_DIR_VAL){
+            ENC_EDGE_DIR = ENC_DIR_VAL;
+        }
+        tail++;
+    }
+    ENC_EDGE_TAIL = tail;
+
+    // Position, unclamped, and as the loop sees it inside the soft limits
+    if (ENC_LIMIT_PENDING){
+        ENC_LIMIT_MIN = ENC_LIMIT_NEXT[0];
+        ENC_LIMIT_MAX = ENC_LIMIT_NEXT[1];
+        ENC_LIMIT_PENDING = 0;
+    }
+    ENC_POS_VAL += delta;
+	if (ENC_POS_VAL > ENC_LIMIT_MAX){
+		ENC_COUNT_VAL = ENC_LIMIT_MAX;
 	}
-	if (ENC_COUNT_VAL > ENC_COUNT_MAX){
-		ENC_COUNT_VAL = ENC_COUNT_MAX;
+	else if (ENC_POS_VAL < ENC_LIMIT_MIN){
+		ENC_COUNT_VAL = ENC_LIMIT_MIN;
 	}
-	if (ENC_COUNT_VAL < ENC_COUNT_MIN){
-		ENC_COUNT_VAL = ENC_COUNT_MIN;
+	else{
+		ENC_COUNT_VAL = (uint16_t)ENC_POS_VAL;
 	}
+    emf = (int32_t)EMF_VAL-EMF_CAL.mid;
+    if (emf > 32767){
+        emf = 32767;
+    }
+    else if (emf < -32767){
+        emf = -32767;
+    }
+    observer_update(&OBS, delta, (int16_t)emf);
+    OBS_VEL_VAL = observer_vel(&OBS);
+    OBS_ACC_VAL = observer_acc(&OBS);
+
+    // Rate is one count per interval, bounded by the time since the last edge
+    elapsed = ENC_EDGE_TICKS*(CAPTURE_FREQ/CONTROL_FREQ);
+    if (!ENC_PERIOD_VAL || ENC_EDGE_TICKS >= ENC_STALE_TICKS){
+        speed = 0;
+    }
+    else if (elapsed > ENC_PERIOD_VAL){
+        speed = CAPTURE_FREQ/elapsed;
+    }
+    else{
+        speed = CAPTURE_FREQ/ENC_PERIOD_VAL;
+    }
+    if (speed > 32767){
+        speed = 32767;
+    }
+    ENC_VEL_VAL = (ENC_EDGE_DIR < 0) ? -(int16_t)speed:(int16_t)speed;
 }
 
 /*************************************************
@@ -177,31 +479,210 @@ void encoder_serviceInterrupt() {
 **************************************************/
 
 void pid() {
-	
-    error = ENC_COUNT_VAL - setpoint;
-    
-    if (error < 0){
+    int32_t torque;
+    int16_t effort;
+
+    if (EMF_CAL.startup || CALIB_STATUS==CALIB_PENDING){  // drive off while the EMF midpoint is measured, or flash written
+        DUTY_VAL = 0;
+        pid_reset(&PID, ENC_COUNT_VAL);
+        pid_reset(&CURRENT_PID, 0);
+        return;
+    }
+
+    // Outer loop: the servo spring plus the effects, as a torque, i.e. current, command
+    if (++POSITION_TICK_VAL >= POSITION_TICKS){
+        POSITION_TICK_VAL = 0;
+        SETPOINT_VAL = trajectory_update(SETPOINT_VAL);
+        if (TUNE_PENDING){
+            autotune_start(&TUNE, tunePosition(), TUNE_NEXT[0], TUNE_NEXT[1]);
+            TUNE_PENDING = 0;
+        }
+        if (TUNE.state == AUTOTUNE_RUNNING){
+            torque = autotune_update(&TUNE, tunePosition());
+            if (TUNE.state != AUTOTUNE_RUNNING){
+                tuned();
+            }
+        }
+        else{
+            torque = (int32_t)pid_update(&PID, SETPOINT_VAL, ENC_COUNT_VAL)+effects_render(ENC_COUNT_VAL, OBS_VEL_VAL);
+        }
+        if (torque > current_max){
+            torque = current_max;
+        }
+        else if (torque < -current_max){
+            torque = -current_max;
+        }
+        CURRENT_CMD_VAL = (int16_t)torque;
+    }
+
+    // Inner loop, every tick: current error to effort
+    effort = pid_update(&CURRENT_PID, CURRENT_CMD_VAL, CURRENT_MEAS_VAL);
+
+    if (effort >= 0){
 		//set direction here
-	    pin_write(INV, LOW);   // invert    OFF
+	    INV_VAL = LOW;    // invert    OFF
+	    DUTY_VAL = (uint16_t)effort<<1;
 	}
 	else{
 		//set other direction here
-	    pin_write(INV, HIGH);   // invert    ON
-
+	    INV_VAL = HIGH;   // invert    ON
+	    DUTY_VAL = (uint16_t)(-effort)<<1;
 	}
-	
-	DUTY_VAL = kp*abs(error);
-	
-	pin_write(nD2, DUTY_VAL);  // disable D2 ON using dutycycle
+
+}
+
+void drive(void) {
+
+    pin_write(INV, INV_VAL);
+	pwm_write(DUTY_VAL);  // disable D2 ON using dutycycle
 
 }
 
+/*************************************************
+			Autotune and Calibration
+**************************************************/
+
+// The position the relay switches on: the count, and the observer's estimate within it
+int32_t tunePosition(void) {
+    return ((int32_t)ENC_POS_VAL<<AUTOTUNE_SHIFT)+(OBS.pos>>(OBSERVER_SHIFT-AUTOTUNE_SHIFT));
+}
+
+// The experiment is over: the spring takes the knob back, with the gains
+// found if it worked, and they are stored once the drive is off
+void tuned(void) {
+    if (TUNE.state == AUTOTUNE_DONE){
+        pid_setGains(&PID, TUNE.kp, PID.ki, TUNE.kd);
+        CALIB_TICK = TICK_VAL;
+        CALIB_STATUS = CALIB_PENDING;
+    }
+    pid_reset(&PID, ENC_COUNT_VAL);
+}
+
+// Background: the erase stalls the CPU, so only once the drive is off
+void control_storeCalib(void) {
+    _CALIB calib;
+
+    if (CALIB_STATUS != CALIB_PENDING || (uint16_t)(TICK_VAL-CALIB_TICK) < calib_hold_ticks){
+        return;
+    }
+    HAL_DISABLE_INTERRUPTS();   // the loop still tracks the EMF and the observer
+    calib.version = CALIB_VERSION;
+    calib.kp = PID.kp;
+    calib.ki = PID.ki;
+    calib.kd = PID.kd;
+    calib.ikp = CURRENT_PID.kp;
+    calib.iki = CURRENT_PID.ki;
+    calib.emf_mid = EMF_CAL.mid;
+    calib.emf_dev = EMF_CAL.dev_acc>>EMF_TRACK_SHIFT;
+    calib.obs_gain = (OBS.gain_n >= OBSERVER_GAIN_WINDOWS) ? OBS.gain:0;
+    calib.ku = (TUNE.kp == PID.kp && TUNE.kd == PID.kd) ? TUNE.ku:0;    // the autotune's gains, not ones set by hand
+    calib.tu = calib.ku ? TUNE.tu:0;
+    calib.reserved = 0;
+    HAL_ENABLE_INTERRUPTS();
+    CALIB_STATUS = (calib_save(&calib) < 0) ? CALIB_FAILED:CALIB_STORED;
+}
+
+/*************************************************
+			Control State
+**************************************************/
+
+// What the loop carries from one tick to the next that the samples do not
+// show, as words so the layout is the same on any host. Taken between
+// ticks: the loop outranks the caller, so a tick that lands in the copy
+// has it taken again.
+void control_getState(uint16_t *state) {
+    uint16_t tick;
+
+    do {
+        tick = TICK_VAL;
+        state[0] = tick-1;                  // the last sample's time
+        state[1] = (uint32_t)ENC_POS_VAL;
+        state[2] = (uint32_t)ENC_POS_VAL>>16;
+        state[3] = ENC_EDGE_TICKS;
+        state[4] = ENC_EDGE_DIR;
+        state[5] = EMF_CAL.mid;
+        state[6] = EMF_CAL.low;
+        state[7] = EMF_CAL.high;
+        state[8] = EMF_CAL.startup;
+        state[9] = EMF_CAL.sum;
+        state[10] = EMF_CAL.sum>>16;
+        state[11] = EMF_CAL.count;
+        state[12] = EMF_CAL.mid_acc;
+        state[13] = EMF_CAL.mid_acc>>16;
+        state[14] = EMF_CAL.dev_acc;
+        state[15] = EMF_CAL.dev_acc>>16;
+        state[16] = OBS.pos;
+        state[17] = (uint32_t)OBS.pos>>16;
+        state[18] = OBS.vel;
+        state[19] = (uint32_t)OBS.vel>>16;
+        state[20] = OBS.acc;
+        state[21] = (uint32_t)OBS.acc>>16;
+        state[22] = OBS.dir;
+        state[23] = OBS.ticks;
+        state[24] = OBS.window_ticks;
+        state[25] = OBS.window_counts;
+        state[26] = OBS.emf_sum;
+        state[27] = (uint32_t)OBS.emf_sum>>16;
+        state[28] = OBS.gain;
+        state[29] = (uint32_t)OBS.gain>>16;
+        state[30] = OBS.gain_n;
+        state[31] = ENC_EDGE_TAIL;
+    } while (tick!=TICK_VAL);
+}
+
+#ifdef HAPTIC_SIM
+// The other way, for sim/replay.c to pick a capture up from
+void control_setState(const uint16_t *state) {
+    TICK_VAL = state[0]+1;
+    ENC_POS_VAL = (int32_t)(state[1]|(uint32_t)state[2]<<16);
+    ENC_COUNT_VAL = (ENC_POS_VAL > ENC_LIMIT_MAX) ? ENC_LIMIT_MAX:
+                    (ENC_POS_VAL < ENC_LIMIT_MIN) ? ENC_LIMIT_MIN:(uint16_t)ENC_POS_VAL;
+    ENC_EDGE_TICKS = state[3];
+    ENC_EDGE_DIR = (int16_t)state[4];
+    EMF_CAL.mid = state[5];
+    EMF_CAL.low = state[6];
+    EMF_CAL.high = state[7];
+    EMF_CAL.startup = state[8];
+    EMF_CAL.sum = state[9]|(uint32_t)state[10]<<16;
+    EMF_CAL.count = state[11];
+    EMF_CAL.mid_acc = state[12]|(uint32_t)state[13]<<16;
+    EMF_CAL.dev_acc = state[14]|(uint32_t)state[15]<<16;
+    OBS.pos = (int32_t)(state[16]|(uint32_t)state[17]<<16);
+    OBS.vel = (int32_t)(state[18]|(uint32_t)state[19]<<16);
+    OBS.acc = (int32_t)(state[20]|(uint32_t)state[21]<<16);
+    OBS.dir = (int16_t)state[22];
+    OBS.ticks = state[23];
+    OBS.window_ticks = state[24];
+    OBS.window_counts = (int16_t)state[25];
+    OBS.emf_sum = (int32_t)(state[26]|(uint32_t)state[27]<<16);
+    OBS.gain = (int32_t)(state[28]|(uint32_t)state[29]<<16);
+    OBS.gain_n = state[30];
+    ENC_EDGE_TAIL = state[31];
+    ENC_EDGE_HEAD = state[31];          // edges the board had queued come in with the next sample
+}
+#endif
+
 /*************************************************
 			Vendor Requests
 **************************************************/
 
+// Stamps a vendor request for GET_CLOCK to acknowledge, once it has been
+// acted on; the control loop takes most of them up on the next tick
+static void stampRequest(uint16_t request, SOF_TIME *time) {
+    REQUEST_TIME = *time;
+    REQUEST_VAL = request;
+    REQUEST_COUNT++;
+}
+
 void VendorRequests(void) {
     WORD temp;
+    SAMPLE sample;
+    SOF_TIME now, sof;
+    uint16_t clock[10];
+    uint16_t state[CONTROL_STATE_WORDS];
+    uint16_t n;
+
+    sof_now(&now);
 
     switch (USB_setup.bRequest) {
         // case SET_VALS:
@@ -211,24 +692,214 @@ void VendorRequests(void) {
         //     BD[EP0IN].status = 0xC8;    // send packet as DATA1, set UOWN bit
         //     break;
         case GET_VALS:
-            temp.w = CURRENT_VAL;
-            BD[EP0IN].address[0] = temp.b[0];
-            BD[EP0IN].address[1] = temp.b[1];
-            temp.w = EMF_VAL;
-            BD[EP0IN].address[2] = temp.b[0];
-            BD[EP0IN].address[3] = temp.b[1];
-            temp.w = FB_VAL;
-            BD[EP0IN].address[4] = temp.b[0];
-            BD[EP0IN].address[5] = temp.b[1];
-            temp.w = ENC_COUNT_VAL;
-            BD[EP0IN].address[6] = temp.b[0];
-            BD[EP0IN].address[7] = temp.b[1];
-
-            BD[EP0IN].bytecount = 8;    // set EP0 IN byte count to 4
-            BD[EP0IN].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            snapshot_read(&sample);     // all four from the same control tick
+            // current, emf, fb and enc are the reply in order, little-endian like the PIC24
+            memcpy(BD[EP0IN_NEXT].address, &sample.current, 8);
+
+            BD[EP0IN_NEXT].bytecount = 8;    // set EP0 IN byte count to 8
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
             break;            
+        case SET_GAIN:
+            switch (USB_setup.wIndex.w) {
+                case 0: pid_setGains(&PID, USB_setup.wValue.w, PID.ki, PID.kd); break;
+                case 1: pid_setGains(&PID, PID.kp, USB_setup.wValue.w, PID.kd); break;
+                case 2: pid_setGains(&PID, PID.kp, PID.ki, USB_setup.wValue.w); break;
+                case 3: pid_setGains(&CURRENT_PID, USB_setup.wValue.w, CURRENT_PID.ki, 0); break;
+                case 4: pid_setGains(&CURRENT_PID, CURRENT_PID.kp, USB_setup.wValue.w, 0); break;
+                default:
+                    USB_error_flags |= 0x01;    // set Request Error Flag
+                    return;
+            }
+            BD[EP0IN_NEXT].bytecount = 0;    // set EP0 IN byte count to 0 
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case SET_FILTER:
+            if (adc_setFilter(USB_setup.wIndex.w, USB_setup.wValue.b[0], USB_setup.wValue.b[1])<0){
+                USB_error_flags |= 0x01;    // set Request Error Flag
+                return;
+            }
+            BD[EP0IN_NEXT].bytecount = 0;    // set EP0 IN byte count to 0
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case GET_FILTERS:
+            for (n = 0; n<ADC_CHANNELS; n++) {
+                temp.w = adc_filter(n);
+                BD[EP0IN_NEXT].address[2*n] = temp.b[0];     // type
+                BD[EP0IN_NEXT].address[2*n+1] = temp.b[1];   // parameter
+            }
+            BD[EP0IN_NEXT].bytecount = 2*ADC_CHANNELS;
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case GET_EMF:
+            temp.w = EMF_CAL.mid;
+            BD[EP0IN_NEXT].address[0] = temp.b[0];
+            BD[EP0IN_NEXT].address[1] = temp.b[1];
+            temp.w = EMF_CAL.low;
+            BD[EP0IN_NEXT].address[2] = temp.b[0];
+            BD[EP0IN_NEXT].address[3] = temp.b[1];
+            temp.w = EMF_CAL.high;
+            BD[EP0IN_NEXT].address[4] = temp.b[0];
+            BD[EP0IN_NEXT].address[5] = temp.b[1];
+
+            BD[EP0IN_NEXT].bytecount = 6;    // set EP0 IN byte count to 6
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case SET_LIMITS:
+            if (USB_setup.wValue.w > USB_setup.wIndex.w || USB_setup.wIndex.w > 0x7FFF || ENC_LIMIT_PENDING){   // the loops take the count as an int16
+                USB_error_flags |= 0x01;    // set Request Error Flag
+                return;
+            }
+            ENC_LIMIT_NEXT[0] = USB_setup.wValue.w;
+            ENC_LIMIT_NEXT[1] = USB_setup.wIndex.w;
+            ENC_LIMIT_PENDING = 1;          // taken up on the next control tick
+            BD[EP0IN_NEXT].bytecount = 0;    // set EP0 IN byte count to 0
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case GET_LIMITS:
+            temp.w = ENC_LIMIT_MIN;
+            BD[EP0IN_NEXT].address[0] = temp.b[0];
+            BD[EP0IN_NEXT].address[1] = temp.b[1];
+            temp.w = ENC_LIMIT_MAX;
+            BD[EP0IN_NEXT].address[2] = temp.b[0];
+            BD[EP0IN_NEXT].address[3] = temp.b[1];
+
+            BD[EP0IN_NEXT].bytecount = 4;    // set EP0 IN byte count to 4
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case SET_TELEMETRY:
+            if (telemetry_setFormat(USB_setup.wValue.w, USB_setup.wIndex.w)<0) {
+                USB_error_flags |= 0x01;    // set Request Error Flag
+                return;
+            }
+            BD[EP0IN_NEXT].bytecount = 0;    // set EP0 IN byte count to 0
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case GET_TELEMETRY:
+            BD[EP0IN_NEXT].address[0] = TELEMETRY_VERSION;
+            BD[EP0IN_NEXT].address[1] = telemetry_mask();
+            BD[EP0IN_NEXT].address[2] = telemetry_hold();
+            BD[EP0IN_NEXT].bytecount = 3;    // set EP0 IN byte count to 3
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case GET_CLOCK:
+            clock[0] = sof_read(&sof);
+            clock[1] = sof.tick;
+            clock[2] = sof.phase;
+            clock[3] = now.tick;
+            clock[4] = now.phase;
+            clock[5] = REQUEST_TIME.tick;
+            clock[6] = REQUEST_TIME.phase;
+            clock[7] = (REQUEST_COUNT<<8)|(REQUEST_VAL&0xFF);
+            clock[8] = CAPTURE_FREQ/CONTROL_FREQ;   // phase counts per tick
+            clock[9] = CONTROL_FREQ;
+            memcpy(BD[EP0IN_NEXT].address, clock, 20);  // little-endian like the PIC24
+
+            BD[EP0IN_NEXT].bytecount = 20;   // set EP0 IN byte count to 20
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            return;
+        case CLEAR_EFFECTS:
+            effects_clear();
+            BD[EP0IN_NEXT].bytecount = 0;    // set EP0 IN byte count to 0 
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case ADD_EFFECT:
+            if ((USB_setup.bmRequestType&0x80) || USB_setup.wLength.w!=8){  // no OUT data stage of one effect to wait for
+                USB_error_flags |= 0x01;    // set Request Error Flag
+                return;
+            }
+            USB_request.setup.bmRequestType = USB_setup.bmRequestType;  // the effect arrives in the data stage
+            USB_request.setup.bRequest = USB_setup.bRequest;
+            break;
+        case COMMIT_EFFECTS:
+            effects_commit();
+            BD[EP0IN_NEXT].bytecount = 0;    // set EP0 IN byte count to 0 
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case SET_TRAJECTORY:
+            if (trajectory_begin(USB_setup.wLength.w, USB_setup.wValue.w&1)<0){
+                USB_error_flags |= 0x01;    // set Request Error Flag
+                return;
+            }
+            USB_request.setup.bmRequestType = USB_setup.bmRequestType;  // the points arrive over the data stage
+            USB_request.setup.bRequest = USB_setup.bRequest;
+            break;
+#ifdef HAPTIC_PROF
+        case GET_PROF:
+            if (!prof_read(USB_setup.wValue.w, BD[EP0IN_NEXT].address, USB_setup.wIndex.w==1)){
+                USB_error_flags |= 0x01;    // set Request Error Flag
+                return;
+            }
+            BD[EP0IN_NEXT].bytecount = PROF_REPORT;
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+#endif
+        case GET_GAINS:
+            temp.w = PID.kp;
+            BD[EP0IN_NEXT].address[0] = temp.b[0];
+            BD[EP0IN_NEXT].address[1] = temp.b[1];
+            temp.w = PID.ki;
+            BD[EP0IN_NEXT].address[2] = temp.b[0];
+            BD[EP0IN_NEXT].address[3] = temp.b[1];
+            temp.w = PID.kd;
+            BD[EP0IN_NEXT].address[4] = temp.b[0];
+            BD[EP0IN_NEXT].address[5] = temp.b[1];
+            temp.w = CURRENT_PID.kp;
+            BD[EP0IN_NEXT].address[6] = temp.b[0];
+            BD[EP0IN_NEXT].address[7] = temp.b[1];
+            temp.w = CURRENT_PID.ki;
+            BD[EP0IN_NEXT].address[8] = temp.b[0];
+            BD[EP0IN_NEXT].address[9] = temp.b[1];
+
+            BD[EP0IN_NEXT].bytecount = 10;   // set EP0 IN byte count to 10
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case AUTOTUNE:
+            if (TUNE_PENDING || TUNE.state == AUTOTUNE_RUNNING || USB_setup.wValue.w > current_max){
+                USB_error_flags |= 0x01;    // set Request Error Flag
+                return;
+            }
+            TUNE_NEXT[0] = USB_setup.wValue.w ? USB_setup.wValue.w:tune_relay;
+            TUNE_NEXT[1] = USB_setup.wIndex.w ? USB_setup.wIndex.w:tune_hyst;
+            TUNE_PENDING = 1;               // taken up on the next position loop pass
+            BD[EP0IN_NEXT].bytecount = 0;    // set EP0 IN byte count to 0
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case GET_AUTOTUNE:
+            state[0] = TUNE_PENDING ? AUTOTUNE_RUNNING:TUNE.state;
+            state[1] = TUNE.cycles;
+            state[2] = CALIB_STATUS;
+            state[3] = TUNE.ku;
+            state[4] = TUNE.tu;
+            state[5] = TUNE.kp;
+            state[6] = TUNE.kd;
+            memcpy(BD[EP0IN_NEXT].address, state, 14);
+
+            BD[EP0IN_NEXT].bytecount = 14;   // set EP0 IN byte count to 14
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case STORE_CALIB:
+            if (EMF_CAL.startup || TUNE_PENDING || TUNE.state == AUTOTUNE_RUNNING || CALIB_STATUS == CALIB_PENDING){
+                USB_error_flags |= 0x01;    // set Request Error Flag
+                return;
+            }
+            CALIB_TICK = TICK_VAL;
+            CALIB_STATUS = CALIB_PENDING;   // the control loop takes the drive off, and the main loop writes
+            BD[EP0IN_NEXT].bytecount = 0;    // set EP0 IN byte count to 0
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
+        case GET_STATE:
+            control_getState(state);
+            memcpy(BD[EP0IN_NEXT].address, state, 2*CONTROL_STATE_WORDS);  // little-endian like the PIC24
+
+            BD[EP0IN_NEXT].bytecount = 2*CONTROL_STATE_WORDS;
+            BD[EP0IN_NEXT].status = 0xC8;    // send packet as DATA1, set UOWN bit
+            break;
         default:
             USB_error_flags |= 0x01;    // set Request Error Flag
+            return;
+    }
+    if (USB_request.setup.bRequest==NO_REQUEST){
+        stampRequest(USB_setup.bRequest, &now);     // ones with a data stage are stamped once it is in
     }
 }
 
@@ -240,51 +911,119 @@ void VendorRequestsIn(void) {
 }
 
 void VendorRequestsOut(void) {
+    BYTE *buf = USB_buffer_desc.address;
+    _EFFECT effect;
+    SOF_TIME now;
+
     switch (USB_request.setup.bRequest) {
+        case ADD_EFFECT:
+            if (USB_buffer_desc.bytecount<8){
+                USB_error_flags |= 0x01;                // set Request Error Flag
+                USB_request.setup.bmRequestType = NO_REQUEST;
+                USB_request.setup.bRequest = NO_REQUEST;
+                break;
+            }
+            effect.type = buf[0]|(buf[1]<<8);
+            effect.pos = buf[2]|(buf[3]<<8);
+            effect.width = buf[4]|(buf[5]<<8);
+            effect.strength = buf[6]|(buf[7]<<8);
+            if (effects_add(&effect)<0){
+                USB_error_flags |= 0x01;                // set Request Error Flag
+            }
+            else{
+                sof_now(&now);
+                stampRequest(ADD_EFFECT, &now);
+            }
+            USB_request.setup.bmRequestType = NO_REQUEST;   // the status stage needs nothing more
+            USB_request.setup.bRequest = NO_REQUEST;
+            break;
+        case SET_TRAJECTORY:
+            if (USB_buffer_desc.bytecount<MAX_PACKET_SIZE && USB_request.bytes_left.w){
+                USB_error_flags |= 0x01;                // a short packet ended the data stage before wLength: stall, not success
+            }
+            else if (trajectory_load(buf, USB_buffer_desc.bytecount)<0){
+                USB_error_flags |= 0x01;                // set Request Error Flag
+            }
+            else if (!USB_request.bytes_left.w && trajectory_end()<0){     // last packet of the data stage
+                USB_error_flags |= 0x01;
+            }
+            else if (!USB_request.bytes_left.w){
+                sof_now(&now);
+                stampRequest(SET_TRAJECTORY, &now);
+            }
+            if (USB_error_flags || !USB_request.bytes_left.w){
+                USB_request.setup.bmRequestType = NO_REQUEST;
+                USB_request.setup.bRequest = NO_REQUEST;
+            }
+            break;
         default:
             USB_error_flags |= 0x01;                    // set Request Error Flag
     }
 }
 
+/*************************************************
+			Data Endpoints
+**************************************************/
+
+void InitEndpoints(void) {
+    telemetry_configure();          // EP1 IN streams telemetry
+}
+
+void EndpointInToken(void) {
+    switch (USB_USTAT&0xF0) {       // extract the EP bits
+        case EP1:
+            telemetry_serviceIn();
+            break;
+    }
+}
+
+void EndpointOutToken(void) {
+}
+
+void EndpointHaltCleared(BYTE endpoint) {
+    if (endpoint==(0x80|1))
+        telemetry_clearHalt();      // the stream starts over from DATA0
+}
+
+void EndpointsReset(void) {
+    telemetry_busReset();
+}
+
 /******************************************************************************/
 /* Main Program                                                               */
 /******************************************************************************/
 
 int16_t main(void) {
+#ifndef USB_INTERRUPT
+    PROF_DECLARE(t);
+#endif
 	
 	initChip();						// initialize the PIC pins etc.
-    InitUSB();                      // initialize the USB registers and serial interface engine
     initInt();						// initialize the interrupt pins
     initMotor();					// initialize the motor pins
+    init_telemetry();				// initialize the telemetry stream, idle until configured
+    initControl();                  // start the control loop, with or without a host
+    InitUSB();                      // initialize the USB registers and serial interface engine
 
     led_on(&led1);					// initial state for BLINKY LIGHT
     timer_setPeriod(BLINKY_TIMER, 1);	// timer for BLINKY LIGHT
     timer_start(BLINKY_TIMER);
-	
-	// Motor commands
-    pin_write(IN1, HIGH);  // keep one input high
-    pin_write(IN2, LOW);   // keep one input low
-
-    while (USB_USWSTAT!=CONFIG_STATE) {     // while the peripheral is not configured...
-        
-        ServiceUSB();                       // ...service USB requests
-        
-    }
 
-    while (1) {
+    while (1) {                     // background work, preempted by the control loop; enumeration happens here too
 
+#ifndef USB_INTERRUPT
+        PROF_START(t);
         ServiceUSB(); 
+        PROF_END(PROF_USB, t);
+#endif
+        telemetry_service();        // queue streamed samples on EP1 IN
+        effects_service();          // compile a committed effect list
+        control_storeCalib();       // write the calibration to flash once the drive is off
 
         if (timer_flag(BLINKY_TIMER)) {	// when the timer trips
             timer_lower(BLINKY_TIMER);
             led_toggle(&led1);			// toggle the BLINKY LIGHT
         }
-			
-        CURRENT_VAL = pin_read(CURRENT);
-        EMF_VAL = pin_read(EMF);
-        FB_VAL = pin_read(FB);
-        
-        pid();
                 
     }
 }
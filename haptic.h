@@ -0,0 +1,68 @@
+/*
+	Elecanisms Mini-Project IV using a PIC24F
+
+	Firmware entry points and shared state, for the modules and host-side
+	harnesses that drive the haptic control code.
+*/
+
+#ifndef _HAPTIC_H_
+#define _HAPTIC_H_
+
+#include "hal.h"
+#include "autotune.h"
+#include "emf.h"
+#include "observer.h"
+#include "pid.h"
+
+#define ENC_COUNT_MIN   865     // default soft limits on the encoder value, and the span effects cover
+#define ENC_COUNT_MAX   1138
+#define CONTROL_STATE_WORDS 32  // control_getState(), what GET_STATE returns
+
+enum {                          // CALIB_STATUS, as GET_AUTOTUNE reports it
+    CALIB_DEFAULTS,             // compiled in, nothing stored
+    CALIB_LOADED,               // from flash at startup
+    CALIB_PENDING,              // the drive is off until the main loop has stored them
+    CALIB_STORED,
+    CALIB_FAILED                // the flash did not read back
+};
+
+extern uint16_t CURRENT_VAL;
+extern uint16_t EMF_VAL;
+extern uint16_t FB_VAL;
+extern int32_t ENC_POS_VAL;
+extern uint16_t ENC_COUNT_VAL;
+extern uint16_t ENC_LIMIT_MIN;
+extern uint16_t ENC_LIMIT_MAX;
+extern uint16_t DUTY_VAL;
+extern uint16_t TICK_VAL;
+extern uint16_t SETPOINT_VAL;
+extern int16_t ENC_VEL_VAL;
+extern int16_t OBS_VEL_VAL;
+extern int16_t OBS_ACC_VAL;
+extern int16_t CURRENT_CMD_VAL;
+extern int16_t CURRENT_MEAS_VAL;
+extern _PID PID;
+extern _PID CURRENT_PID;
+extern _EMF EMF_CAL;
+extern _OBSERVER OBS;
+extern _AUTOTUNE TUNE;
+extern volatile uint16_t CALIB_STATUS;
+
+void initChip(void);
+void initInt(void);
+void initMotor(void);
+void initControl(void);
+void initCalib(void);
+void readSensors(void);
+void encoder_serviceInterrupt(void);
+void encoder_service(void);
+void control_serviceInterrupt(void);
+void pid(void);
+void drive(void);
+int32_t tunePosition(void);
+void tuned(void);
+void control_storeCalib(void);              // from the main loop
+void control_getState(uint16_t *state);     // from anything the control loop outranks
+void control_setState(const uint16_t *state);   // HAPTIC_SIM builds only, between ticks
+
+#endif
@@ -9,13 +9,13 @@ def main():
 	
 	while(1):
 		
-		[current_val, emf_val, fb_val, enc_count_val] = husb.get_vals()
-		if emf_val > MID_R:
-			print [current_val, 1, fb_val, enc_count_val]
-		elif emf_val < MID_L:
-			print [current_val, -1, fb_val, enc_count_val]
-		else:
-			print [current_val, 0, fb_val, enc_count_val]
+		for [time, current_val, emf_val, fb_val, enc_count_val, enc_pos, vel, acc] in husb.get_samples():
+			if emf_val > MID_R:
+				print [time, current_val, 1, fb_val, enc_count_val]
+			elif emf_val < MID_L:
+				print [time, current_val, -1, fb_val, enc_count_val]
+			else:
+				print [time, current_val, 0, fb_val, enc_count_val]
 		#t.sleep(0.5)
 		#print husb.get_vals()
 
@@ -0,0 +1,265 @@
+/*
+	Host-side benchmark of the device protocol
+
+	Measures, through libhaptic_host, what a host program actually gets out
+	of the knob, against the hardware or the simulated board (-s), which
+	runs the firmware's own VendorRequests() behind the simulated host:
+
+	  stream      sample and packet rate of the EP1 IN telemetry, packets
+	              lost (sequence gaps), samples the device dropped, samples
+	              lost to host overruns and to tick gaps, and packet
+	              inter-arrival times
+	  round trip  wall time of control transfers issued back to back with
+	              the stream running: GET_VALS (8 byte IN), SET_GAIN (no
+	              data stage) and a 128-point SET_TRAJECTORY (8 packet OUT)
+	  latency     from issuing a one-point SET_TRAJECTORY that steps the
+	              setpoint to the first streamed sample whose FB shows the
+	              loop pushing, which is the control transfer, the next
+	              position-loop pass, the current loop and the trip back up
+	              the stream together
+
+	Times are reported in us as min/p50/p90/p99/p99.9/max. Built by the host
+	target in SConstruct:
+
+		scons host && host/haptic_bench -s
+
+	-s  use the simulated board instead of hardware
+	-S  speed of the simulated board, 1 = real time (default 1)
+	-t  seconds of streaming to measure (default 5)
+	-n  round trips per request (default 2000)
+	-l  setpoint steps for the latency (default 50)
+	-d  setpoint step in counts (default 30)
+	-f  FB reading that counts as the loop pushing (default 16384)
+	-x  EP1 IN transfers kept in flight (default 8)
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
+#include "haptic_host.h"
+
+#define GET_VALS        2
+#define SET_GAIN        5
+#define GET_GAINS       6
+#define SET_TRAJECTORY  10
+#define TIMEOUT_MS      1000
+#define SETPOINT        1000            // setpoint the firmware starts with
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double bench_us(bench_clock::time_point from, bench_clock::time_point to) {
+    return std::chrono::duration<double, std::micro>(to-from).count();
+}
+
+static double bench_percentile(const std::vector<double> &sorted, double p) {
+    size_t n = (size_t)(p/100.*(sorted.size()-1)+.5);
+
+    return sorted[n];
+}
+
+static void bench_report(const char *name, std::vector<double> &us, long failed) {
+    if (us.empty()) {
+        printf("  %-22s no samples, %ld failed\n", name, failed);
+        return;
+    }
+    std::sort(us.begin(), us.end());
+    printf("  %-22s n %-6zu min %8.1f  p50 %8.1f  p90 %8.1f  p99 %8.1f  p99.9 %8.1f  max %8.1f", name, us.size(),
+           us.front(), bench_percentile(us, 50.), bench_percentile(us, 90.), bench_percentile(us, 99.),
+           bench_percentile(us, 99.9), us.back());
+    if (failed)
+        printf("  (%ld failed)", failed);
+    printf("\n");
+}
+
+// Everything the stream callback touches, written only on the event thread
+// except for the latency trigger the main thread arms
+static struct {
+    std::atomic<bool> timing;           // the main thread owns arrivals and gaps while clear
+    std::vector<double> arrivals;       // us between packets
+    bench_clock::time_point last;
+    bool started;
+    uint16_t time;                      // tick stamp of the last sample
+    long gaps;
+
+    uint16_t threshold;
+    std::atomic<uint16_t> fb;           // latest FB
+    std::atomic<bool> armed;
+    std::atomic<bool> seen;
+    bench_clock::time_point when;
+} stream;
+
+static void bench_stream(void *ctx, const HAPTIC_SAMPLE *samples, size_t count) {
+    bench_clock::time_point now = bench_clock::now();
+    size_t n;
+
+    (void)ctx;
+    if (stream.timing && stream.started && stream.arrivals.size()<stream.arrivals.capacity())
+        stream.arrivals.push_back(bench_us(stream.last, now));
+    stream.last = now;
+    for (n = 0; n<count; n++) {
+        if (stream.timing && stream.started)
+            stream.gaps += (uint16_t)(samples[n].time-stream.time-1);
+        stream.time = samples[n].time;
+        stream.started = true;
+        if (stream.armed && samples[n].fb>=stream.threshold) {
+            stream.when = now;
+            stream.armed = false;
+            stream.seen = true;
+        }
+    }
+    if (count)
+        stream.fb = samples[count-1].fb;
+}
+
+static int bench_trajectory(haptic::Client &client, uint16_t pos, uint16_t points) {
+    uint8_t data[128*4];
+    uint16_t n;
+
+    for (n = 0; n<points; n++) {        // hold pos, a point per position-loop tick
+        data[n*4] = n&0xFF;
+        data[n*4+1] = n>>8;
+        data[n*4+2] = pos&0xFF;
+        data[n*4+3] = pos>>8;
+    }
+    return client.control(0x40, SET_TRAJECTORY, 0, 0, data, points*4, TIMEOUT_MS);
+}
+
+int main(int argc, char **argv) {
+    double seconds = 5., speed = 1.;
+    long trips = 2000, steps = 50, failed, n;
+    int opt, sim = 0, delta = 30;
+    unsigned transfers = 8;
+    std::unique_ptr<haptic::Transport> transport;
+    std::vector<haptic::Sample> drain(4096);
+    std::vector<double> us;
+    haptic::Stats before, after;
+    bench_clock::time_point t0, t1;
+    uint8_t data[16];
+    int16_t kd;
+
+    stream.threshold = 16384;
+    while ((opt = getopt(argc, argv, "sS:t:n:l:d:f:x:"))!=-1) {
+        switch (opt) {
+            case 's': sim = 1; break;
+            case 'S': speed = atof(optarg); break;
+            case 't': seconds = atof(optarg); break;
+            case 'n': trips = atol(optarg); break;
+            case 'l': steps = atol(optarg); break;
+            case 'd': delta = atoi(optarg); break;
+            case 'f': stream.threshold = (uint16_t)atoi(optarg); break;
+            case 'x': transfers = (unsigned)atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s] [-S speed] [-t seconds] [-n trips] [-l steps] [-d counts] [-f fb] [-x transfers]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    transport = sim ? haptic::open_sim(speed):haptic::open_libusb();
+    if (!transport) {
+        fprintf(stderr, "%s\n", sim ? "could not start the simulated board":"no device 6666:0003, or built without libusb");
+        return 1;
+    }
+    haptic::Client client(std::move(transport), 1<<16);
+    stream.arrivals.reserve(1<<20);     // so the callback never allocates
+    client.set_callback(bench_stream, nullptr);
+    if (client.start(transfers)<0) {
+        fprintf(stderr, "could not start the telemetry stream\n");
+        return 1;
+    }
+    printf("%s, %u stream transfers in flight\n", sim ? "simulated board":"hardware", transfers);
+
+    // Stream: drain the ring as a reader would for the whole stretch
+    client.read(drain.data(), drain.size(), 100);   // skip what queued up before start
+    before = client.stats();
+    stream.timing = true;
+    t0 = bench_clock::now();
+    do {
+        client.read(drain.data(), drain.size(), 10);
+        t1 = bench_clock::now();
+    } while (bench_us(t0, t1)<seconds*1e6);
+    stream.timing = false;
+    after = client.stats();
+    printf("stream over %.1f s:\n", bench_us(t0, t1)*1e-6);
+    printf("  %.0f samples/s, %.0f packets/s\n", (after.samples-before.samples)/(bench_us(t0, t1)*1e-6),
+           (after.packets-before.packets)/(bench_us(t0, t1)*1e-6));
+    printf("  %llu packets missed, %llu malformed, %u samples dropped on the device, %llu host overruns, %ld tick gaps\n",
+           (unsigned long long)(after.missed-before.missed), (unsigned long long)(after.malformed-before.malformed),
+           (uint16_t)(after.dropped-before.dropped), (unsigned long long)(after.overruns-before.overruns), stream.gaps);
+    bench_report("packet inter-arrival", stream.arrivals, 0);
+
+    // Round trips, with the stream still running and drained by a reader
+    std::atomic<bool> reading(true);
+    std::thread reader([&] {
+        std::vector<haptic::Sample> buf(4096);
+        while (reading)
+            client.read(buf.data(), buf.size(), 10);
+    });
+    printf("round trip:\n");
+    us.reserve(trips);
+    for (failed = 0, n = 0; n<trips; n++) {
+        t0 = bench_clock::now();
+        if (client.control(0xC0, GET_VALS, 0, 0, data, 8, TIMEOUT_MS)!=8)
+            failed++;
+        else
+            us.push_back(bench_us(t0, bench_clock::now()));
+    }
+    bench_report("GET_VALS", us, failed);
+
+    if (client.control(0xC0, GET_GAINS, 0, 0, data, 10, TIMEOUT_MS)==10) {
+        kd = (int16_t)(data[4]|(data[5]<<8));
+        us.clear();
+        for (failed = 0, n = 0; n<trips; n++) {
+            t0 = bench_clock::now();
+            if (client.control(0x40, SET_GAIN, (uint16_t)kd, 2, nullptr, 0, TIMEOUT_MS)<0)     // kd, unchanged
+                failed++;
+            else
+                us.push_back(bench_us(t0, bench_clock::now()));
+        }
+        bench_report("SET_GAIN", us, failed);
+    }
+
+    us.clear();
+    for (failed = 0, n = 0; n<trips; n++) {
+        t0 = bench_clock::now();
+        if (bench_trajectory(client, SETPOINT, 128)!=128*4)
+            failed++;
+        else
+            us.push_back(bench_us(t0, bench_clock::now()));
+    }
+    bench_report("SET_TRAJECTORY x128", us, failed);
+
+    // Command to effect: step the setpoint from rest and wait for FB to show it
+    printf("command to effect, %d count steps, FB >= %u:\n", delta, stream.threshold);
+    us.clear();
+    for (failed = 0, n = 0; n<steps; n++) {
+        t0 = bench_clock::now();
+        while (stream.fb>=stream.threshold/2 && bench_us(t0, bench_clock::now())<TIMEOUT_MS*1e3)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));     // settled
+        stream.seen = false;
+        stream.armed = true;
+        t0 = bench_clock::now();
+        if (bench_trajectory(client, (n&1) ? SETPOINT:SETPOINT+delta, 1)<0) {
+            stream.armed = false;
+            failed++;
+            continue;
+        }
+        while (!stream.seen && bench_us(t0, bench_clock::now())<TIMEOUT_MS*1e3)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        stream.armed = false;
+        if (stream.seen)
+            us.push_back(bench_us(t0, stream.when));
+        else
+            failed++;
+    }
+    bench_report("SET_TRAJECTORY to FB", us, failed);
+    bench_trajectory(client, SETPOINT, 1);
+
+    reading = false;
+    reader.join();
+    client.stop();
+    return 0;
+}
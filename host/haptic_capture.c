@@ -0,0 +1,164 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "haptic_capture.h"
+
+#define CAPTURE_PAD(n)  (((n)+HAPTIC_CAPTURE_ALIGN-1)&~(size_t)(HAPTIC_CAPTURE_ALIGN-1))
+
+struct haptic_capture {
+    FILE *file;
+    int failed;
+};
+
+/*************************************************
+			Writing
+**************************************************/
+
+static void capture_write(haptic_capture *capture, const void *data, size_t length) {
+    static const uint8_t zeros[HAPTIC_CAPTURE_ALIGN];
+
+    if (fwrite(data, 1, length, capture->file)!=length)
+        capture->failed = 1;
+    length = CAPTURE_PAD(length)-length;
+    if (length && fwrite(zeros, 1, length, capture->file)!=length)
+        capture->failed = 1;
+}
+
+haptic_capture *haptic_capture_create(const char *path, const char *serial, uint32_t rate, int64_t start_ns) {
+    HAPTIC_CAPTURE_HEADER header;
+    haptic_capture *capture = calloc(1, sizeof(haptic_capture));
+
+    if (!capture)
+        return NULL;
+    capture->file = fopen(path, "wb");
+    if (!capture->file) {
+        free(capture);
+        return NULL;
+    }
+    setvbuf(capture->file, NULL, _IOFBF, 1<<16);
+    memset(&header, 0, sizeof(header));
+    header.magic = HAPTIC_CAPTURE_MAGIC;
+    header.version = HAPTIC_CAPTURE_VERSION;
+    header.size = sizeof(header);
+    header.rate = rate;
+    header.start_ns = start_ns;
+    if (serial)
+        strncpy(header.serial, serial, HAPTIC_SERIAL_MAX-1);
+    capture_write(capture, &header, sizeof(header));
+    return capture;
+}
+
+int haptic_capture_samples(haptic_capture *capture, const HAPTIC_SAMPLE *samples, uint16_t count, uint8_t channels,
+                           uint16_t missed, int64_t host_ns) {
+    HAPTIC_CAPTURE_BLOCK block;
+
+    if (!count)
+        return 0;
+    memset(&block, 0, sizeof(block));
+    block.type = HAPTIC_CAPTURE_SAMPLES;
+    block.channels = channels;
+    block.count = count;
+    block.tick = samples[0].time;
+    block.missed = missed;
+    block.host_ns = host_ns;
+    capture_write(capture, &block, sizeof(block));
+    capture_write(capture, samples, count*sizeof(HAPTIC_SAMPLE));
+    return capture->failed ? -1:0;
+}
+
+int haptic_capture_request(haptic_capture *capture, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                           uint16_t wIndex, uint16_t wLength, const uint8_t *data, int32_t result, uint16_t tick,
+                           int64_t host_ns) {
+    HAPTIC_CAPTURE_BLOCK block;
+
+    memset(&block, 0, sizeof(block));
+    block.type = HAPTIC_CAPTURE_REQUEST;
+    block.bmRequestType = bmRequestType;
+    block.bRequest = bRequest;
+    block.wValue = wValue;
+    block.wIndex = wIndex;
+    block.wLength = wLength;
+    block.result = result;
+    block.tick = tick;
+    block.host_ns = host_ns;
+    if (data && result>=0)              // what went out, or what came back
+        block.count = (bmRequestType&0x80) ? (uint16_t)result:wLength;
+    capture_write(capture, &block, sizeof(block));
+    if (block.count)
+        capture_write(capture, data, block.count);
+    return capture->failed ? -1:0;
+}
+
+int haptic_capture_close(haptic_capture *capture) {
+    int failed;
+
+    if (!capture)
+        return 0;
+    failed = capture->failed;
+    if (fclose(capture->file))
+        failed = 1;
+    free(capture);
+    return failed ? -1:0;
+}
+
+/*************************************************
+			Reading
+**************************************************/
+
+int haptic_capture_map(HAPTIC_CAPTURE_MAP *map, const char *path) {
+    struct stat st;
+    void *base;
+    int fd;
+
+    memset(map, 0, sizeof(*map));
+    fd = open(path, O_RDONLY);
+    if (fd<0)
+        return -1;
+    if (fstat(fd, &st)<0 || (size_t)st.st_size<sizeof(HAPTIC_CAPTURE_HEADER)) {
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);                          // the mapping holds the file
+    if (base==MAP_FAILED)
+        return -1;
+    map->base = base;
+    map->size = st.st_size;
+    map->header = base;
+    if (map->header->magic!=HAPTIC_CAPTURE_MAGIC || map->header->version!=HAPTIC_CAPTURE_VERSION ||
+        map->header->size<sizeof(HAPTIC_CAPTURE_HEADER) || map->header->size%HAPTIC_CAPTURE_ALIGN) {
+        haptic_capture_unmap(map);
+        return -1;
+    }
+    return 0;
+}
+
+void haptic_capture_unmap(HAPTIC_CAPTURE_MAP *map) {
+    if (map->base)
+        munmap((void *)map->base, map->size);
+    memset(map, 0, sizeof(*map));
+}
+
+static size_t capture_payload(const HAPTIC_CAPTURE_BLOCK *block) {
+    return CAPTURE_PAD(block->type==HAPTIC_CAPTURE_SAMPLES ? block->count*sizeof(HAPTIC_SAMPLE):block->count);
+}
+
+const HAPTIC_CAPTURE_BLOCK *haptic_capture_next(const HAPTIC_CAPTURE_MAP *map, const HAPTIC_CAPTURE_BLOCK *block) {
+    size_t offset = block ? (size_t)((const uint8_t *)block-map->base)+sizeof(*block)+capture_payload(block):
+                            map->header->size;
+
+    if (offset+sizeof(*block)>map->size)
+        return NULL;
+    block = (const HAPTIC_CAPTURE_BLOCK *)(map->base+offset);
+    if (offset+sizeof(*block)+capture_payload(block)>map->size)
+        return NULL;                    // cut short as it was written
+    return block;
+}
+
+const void *haptic_capture_payload(const HAPTIC_CAPTURE_BLOCK *block) {
+    return block+1;
+}
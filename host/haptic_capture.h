@@ -0,0 +1,107 @@
+/*
+	Binary capture of a board's stream and requests
+
+	What a host saw of a board, kept so it can be looked at later, and fed
+	back through the firmware by sim/replay.c. A capture file is a
+	HAPTIC_CAPTURE_HEADER, then blocks in the order they were written, each
+	a HAPTIC_CAPTURE_BLOCK followed by its payload padded out to
+	HAPTIC_CAPTURE_ALIGN bytes:
+
+	  samples   one stream packet, decoded: count HAPTIC_SAMPLEs from tick
+	            on, carrying the channels in the packet's mask (the rest
+	            are 0), with the packets lost just before it
+	  request   one vendor request, as the host issued it: the setup
+	            packet, the result, and count bytes of data stage that
+	            moved, sent or received
+
+	Everything is little-endian and sits at its natural alignment, so a
+	capture can be mapped and walked in place (haptic_capture_map() and
+	haptic_capture_next()), from numpy as readily as from C. A block is
+	written whole or the file ends inside it; a reader stops at a block
+	that does not fit, so a capture cut short by a crash reads up to there.
+
+	A request's tick is the control tick the board handled it in, as near
+	as the host can tell: from the clock estimate (Client::sync()) at the
+	middle of the transfer when there is one, or else the last tick the
+	stream had delivered. The firmware takes most requests up on the next
+	tick. Blocks are written as things happen on the host, so a request can
+	come before samples for ticks ahead of it, the stream running a packet
+	or so behind.
+
+	Client::record() (haptic_record() in C) captures a client's traffic;
+	host/haptic_record.cpp is the tool that does only that.
+*/
+
+#ifndef _HAPTIC_CAPTURE_H_
+#define _HAPTIC_CAPTURE_H_
+
+#include "haptic_host.h"
+
+#define HAPTIC_CAPTURE_MAGIC    0x50414348  // "HCAP"
+#define HAPTIC_CAPTURE_VERSION  1
+#define HAPTIC_CAPTURE_ALIGN    16          // of every block and payload
+
+enum {                                      // HAPTIC_CAPTURE_BLOCK type
+    HAPTIC_CAPTURE_SAMPLES = 1,
+    HAPTIC_CAPTURE_REQUEST
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {                            // 64 bytes
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;                          // of this header, where the first block starts
+    uint32_t rate;                          // control ticks per second, 0 if the board was not asked
+    uint32_t reserved;
+    int64_t start_ns;                       // steady_clock (CLOCK_MONOTONIC) when the capture started
+    char serial[HAPTIC_SERIAL_MAX];         // the board's, empty if it would not say
+    uint64_t reserved2;
+} HAPTIC_CAPTURE_HEADER;
+
+typedef struct {                            // 32 bytes
+    uint8_t type;
+    uint8_t channels;                       // samples: the packet's channel mask
+    uint8_t bmRequestType;                  // request: its setup packet...
+    uint8_t bRequest;
+    uint16_t count;                         // samples in the block, or bytes of data stage
+    uint16_t tick;                          // first sample's tick, or the tick a request was handled in
+    uint16_t wValue;                        // ...
+    uint16_t wIndex;
+    uint16_t wLength;
+    uint16_t missed;                        // samples: packets lost just before this one
+    int32_t result;                         // request: bytes moved, <0 on failure
+    uint32_t reserved;
+    int64_t host_ns;                        // steady_clock when the packet came in or the request returned
+} HAPTIC_CAPTURE_BLOCK;
+
+typedef struct haptic_capture haptic_capture;
+
+typedef struct {
+    const uint8_t *base;                    // the whole file, mapped
+    size_t size;
+    const HAPTIC_CAPTURE_HEADER *header;
+} HAPTIC_CAPTURE_MAP;
+
+// Writing, buffered: one writer at a time (Client::record() serializes them)
+haptic_capture *haptic_capture_create(const char *path, const char *serial, uint32_t rate, int64_t start_ns);
+int haptic_capture_samples(haptic_capture *capture, const HAPTIC_SAMPLE *samples, uint16_t count, uint8_t channels,
+                           uint16_t missed, int64_t host_ns);
+int haptic_capture_request(haptic_capture *capture, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                           uint16_t wIndex, uint16_t wLength, const uint8_t *data, int32_t result, uint16_t tick,
+                           int64_t host_ns);
+int haptic_capture_close(haptic_capture *capture);  // <0 if anything could not be written
+
+// Reading in place
+int haptic_capture_map(HAPTIC_CAPTURE_MAP *map, const char *path);     // <0 if it is not a capture it can read
+void haptic_capture_unmap(HAPTIC_CAPTURE_MAP *map);
+const HAPTIC_CAPTURE_BLOCK *haptic_capture_next(const HAPTIC_CAPTURE_MAP *map, const HAPTIC_CAPTURE_BLOCK *block);  // the first if NULL, NULL at the end
+const void *haptic_capture_payload(const HAPTIC_CAPTURE_BLOCK *block);  // its samples or data stage
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,561 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <new>
+#include "haptic_capture.h"
+#include "haptic_host.h"
+
+#define GET_DESCRIPTOR      6
+#define DESCRIPTOR_DEVICE   0x0100
+#define DESCRIPTOR_STRING   0x0300
+#define LANGID_EN_US        0x0409
+#define DESCRIPTOR_MS       1000
+#define GET_CLOCK           19          // in haptic.c
+#define CLOCK_LENGTH        20
+#define CLOCK_MS            100
+
+namespace haptic {
+
+static int64_t clock_ns(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+/*************************************************
+			Sample ring
+**************************************************/
+
+SampleRing::SampleRing(size_t capacity) : head(0), tail(0) {
+    size_t size = 1;
+
+    while (size<capacity)
+        size <<= 1;
+    ring.resize(size);
+    mask = size-1;
+}
+
+size_t SampleRing::push(const Sample *samples, size_t count) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t space = ring.size()-(h-tail.load(std::memory_order_acquire));
+    size_t n;
+
+    if (count>space)
+        count = space;
+    for (n = 0; n<count; n++)
+        ring[(h+n)&mask] = samples[n];
+    head.store(h+count, std::memory_order_release);    // publish after the copies
+    return count;
+}
+
+size_t SampleRing::pop(Sample *samples, size_t max) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t count = head.load(std::memory_order_acquire)-t;
+    size_t n;
+
+    if (count>max)
+        count = max;
+    for (n = 0; n<count; n++)
+        samples[n] = ring[(t+n)&mask];
+    tail.store(t+count, std::memory_order_release);    // hand the slots back after the copies
+    return count;
+}
+
+size_t SampleRing::size() const {
+    return head.load(std::memory_order_acquire)-tail.load(std::memory_order_acquire);
+}
+
+/*************************************************
+			Client
+**************************************************/
+
+Client::Client(std::unique_ptr<Transport> transport, size_t ring)
+    : transport(std::move(transport)), samples(ring), callback(nullptr), callback_ctx(nullptr),
+      streaming(false), packets(0), count(0), missed(0), overruns(0), malformed(0), dropped(0), last_tick(0),
+      sequence(-1), estimate(), ticks_per_ns(0.), ticks_per_frame(0.), capturing(nullptr) {
+}
+
+Client::~Client() {
+    stop();
+    record(nullptr);
+}
+
+void Client::set_callback(haptic_callback callback, void *ctx) {
+    this->callback = callback;
+    callback_ctx = ctx;
+}
+
+int Client::start(unsigned transfers) {
+    int ret;
+
+    if (streaming)
+        return 0;
+    ret = transport->start(transfers ? transfers:1, deliver, this);
+    streaming = ret>=0;
+    return ret;
+}
+
+void Client::stop() {
+    if (!streaming)
+        return;
+    transport->stop();
+    streaming = false;
+}
+
+void Client::deliver(void *ctx, const uint8_t *data, size_t length) {
+    static_cast<Client *>(ctx)->decode(data, length);
+}
+
+// A varint of a zig-zagged change, false if the packet ends inside it
+static bool decode_varint(const uint8_t *&ptr, const uint8_t *end, uint16_t &delta) {
+    uint16_t val = 0;
+    unsigned shift = 0;
+
+    do {
+        if (ptr>=end || shift>14)
+            return false;
+        val |= (uint16_t)(*ptr&0x7F)<<shift;
+        shift += 7;
+    } while (*ptr++&0x80);
+    delta = (val>>1)^(uint16_t)-(val&1);
+    return true;
+}
+
+// Event thread: one EP1 IN packet, laid out as telemetry_pack() writes it.
+// Channels the packet does not carry come out as 0.
+void Client::decode(const uint8_t *data, size_t length) {
+    Sample decoded[HAPTIC_PACKET_SAMPLES];
+    const uint8_t *ptr = data+HAPTIC_HEADER, *end = data+length;
+    uint16_t vals[HAPTIC_CHANNELS] = {0}, delta;
+    size_t num, n, pushed;
+    uint8_t gap = 0;
+    unsigned c;
+
+    if (length<HAPTIC_HEADER || data[0]!=HAPTIC_VERSION) {
+        malformed++;
+        return;
+    }
+    num = data[2];
+    if (num>HAPTIC_PACKET_SAMPLES)
+        num = HAPTIC_PACKET_SAMPLES;
+    if (sequence>=0)
+        gap = data[1]-sequence-1;
+    missed += gap;
+    sequence = data[1];
+    dropped = data[6]|(data[7]<<8);
+
+    for (n = 0; n<num; n++) {
+        for (c = 0; c<HAPTIC_CHANNELS; c++) {
+            if (!(data[3]&(1<<c)))
+                continue;
+            if (!decode_varint(ptr, end, delta))
+                break;
+            vals[c] += delta;
+        }
+        if (c<HAPTIC_CHANNELS) {
+            malformed++;                // cut short: keep the samples before
+            break;
+        }
+        decoded[n].time = (data[4]|(data[5]<<8))+n;
+        decoded[n].current = vals[0];
+        decoded[n].emf = vals[1];
+        decoded[n].fb = vals[2];
+        decoded[n].enc = vals[3];
+        decoded[n].pos = vals[4];
+        decoded[n].vel = (int16_t)vals[5];
+        decoded[n].acc = (int16_t)vals[6];
+        decoded[n].edges = vals[7];
+    }
+    num = n;
+    if (num)
+        last_tick = decoded[num-1].time;
+    {
+        std::lock_guard<std::mutex> lock(capture_lock);
+        if (capturing)
+            haptic_capture_samples(capturing, decoded, (uint16_t)num, data[3], gap,
+                                   clock_ns(std::chrono::steady_clock::now()));
+    }
+    pushed = samples.push(decoded, num);
+    overruns += num-pushed;
+    count += num;
+    packets++;
+    if (callback)
+        callback(callback_ctx, decoded, num);
+
+    if (pushed) {
+        std::lock_guard<std::mutex> lock(wait_lock);    // so a reader about to sleep cannot miss it
+        arrived.notify_one();
+    }
+}
+
+size_t Client::read(Sample *samples, size_t max, int timeout_ms) {
+    size_t num;
+
+    transport->recover();
+    num = this->samples.pop(samples, max);
+
+    if (num || timeout_ms<=0)
+        return num;
+    {
+        std::unique_lock<std::mutex> lock(wait_lock);
+        arrived.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return this->samples.size()>0; });
+    }
+    return this->samples.pop(samples, max);
+}
+
+int Client::control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                    uint8_t *data, uint16_t wLength, unsigned timeout_ms) {
+    int64_t t0;
+    int ret;
+
+    transport->recover();
+    t0 = clock_ns(std::chrono::steady_clock::now());
+    ret = transport->control(bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout_ms);
+
+    if ((bmRequestType&0x60)==0x40)     // vendor requests only, to the capture
+        record_request(bmRequestType, bRequest, wValue, wIndex, data, wLength, ret,
+                       t0+(clock_ns(std::chrono::steady_clock::now())-t0)/2);
+    return ret;
+}
+
+Stats Client::stats() const {
+    Stats stats;
+
+    stats.packets = packets;
+    stats.samples = count;
+    stats.missed = missed;
+    stats.overruns = overruns;
+    stats.malformed = malformed;
+    stats.dropped = dropped;
+    return stats;
+}
+
+// Standard requests, so it reads the same through any transport
+std::string Client::serial() {
+    uint8_t buffer[2+2*HAPTIC_SERIAL_MAX];
+    std::string serial;
+    int ret, n;
+
+    ret = control(0x80, GET_DESCRIPTOR, DESCRIPTOR_DEVICE, 0, buffer, 18, DESCRIPTOR_MS);
+    if (ret<18 || !buffer[16])
+        return serial;
+    ret = control(0x80, GET_DESCRIPTOR, DESCRIPTOR_STRING|buffer[16], LANGID_EN_US, buffer, sizeof(buffer), DESCRIPTOR_MS);
+    if (ret>buffer[0])
+        ret = buffer[0];
+    for (n = 2; n+1<ret && serial.size()<HAPTIC_SERIAL_MAX-1; n += 2)
+        serial += buffer[n+1] ? '?':(char)buffer[n];   // UTF-16LE, ASCII digits in practice
+    return serial;
+}
+
+
+/*************************************************
+			Clock sync
+**************************************************/
+
+// Least squares y = a+b*x over the points taken; false without two distinct x
+static bool clock_line(const std::vector<double> &x, const std::vector<double> &y, double &a, double &b) {
+    double mx = 0., my = 0., sxx = 0., sxy = 0.;
+    size_t n, num = x.size();
+
+    if (num<2)
+        return false;
+    for (n = 0; n<num; n++) {
+        mx += x[n];
+        my += y[n];
+    }
+    mx /= num;
+    my /= num;
+    for (n = 0; n<num; n++) {
+        sxx += (x[n]-mx)*(x[n]-mx);
+        sxy += (x[n]-mx)*(y[n]-my);
+    }
+    if (sxx<=0.)
+        return false;
+    b = sxy/sxx;
+    a = my-b*mx;
+    return true;
+}
+
+int Client::sync() {
+    uint8_t buf[CLOCK_LENGTH];
+    std::chrono::steady_clock::time_point t0, t1;
+    uint16_t word[CLOCK_LENGTH/2];
+    ClockPoint point;
+    int64_t tick, predicted;
+    double per_tick, frame;
+    int ret, n, diff;
+
+    t0 = std::chrono::steady_clock::now();
+    ret = control(0xC0, GET_CLOCK, 0, 0, buf, CLOCK_LENGTH, CLOCK_MS);
+    t1 = std::chrono::steady_clock::now();
+    if (ret<CLOCK_LENGTH)
+        return -1;
+    for (n = 0; n<CLOCK_LENGTH/2; n++)
+        word[n] = buf[2*n]|(buf[2*n+1]<<8);
+    if (!word[8] || !word[9])
+        return -1;
+    per_tick = word[8];
+    point.mid = clock_ns(t0)+(clock_ns(t1)-clock_ns(t0))/2;
+    point.rtt = clock_ns(t1)-clock_ns(t0);
+
+    std::lock_guard<std::mutex> guard(clock_lock);
+    if (!ticks_per_ns) {
+        estimate.rate = word[9];
+        ticks_per_ns = word[9]*1e-9;
+        ticks_per_frame = word[9]*1e-3;
+    }
+    // The device counts 16 bits of ticks and 11 of frames; extend them from
+    // where the last sync and the fits put them, so a long gap does no harm
+    if (clock_points.empty()) {
+        tick = word[3];
+    } else {
+        predicted = (int64_t)floor(clock_points.back().now+(point.mid-clock_points.back().mid)*ticks_per_ns);
+        tick = predicted+(int16_t)(word[3]-(uint16_t)predicted);
+    }
+    point.now = tick+word[4]/per_tick;
+    point.sof = tick+(int16_t)(word[1]-word[3])+word[2]/per_tick;
+    if (clock_points.empty()) {
+        point.frame = word[0];
+    } else {
+        frame = floor(clock_points.back().frame+(point.sof-clock_points.back().sof)/ticks_per_frame+.5);
+        diff = (word[0]-(int64_t)frame)&0x7FF;
+        point.frame = frame+(diff>=0x400 ? diff-0x800:diff);
+    }
+    clock_points.push_back(point);
+    if (clock_points.size()>HAPTIC_CLOCK_WINDOW)
+        clock_points.pop_front();
+    estimate.syncs++;
+    estimate.tick = (uint64_t)tick;
+    fit_clock();
+
+    estimate.request_tick = (uint64_t)(tick+(int16_t)(word[5]-word[3]));
+    estimate.request_ns = estimate.host_ns+
+        (int64_t)(((int64_t)(estimate.request_tick-estimate.tick)+word[6]/per_tick)/ticks_per_ns);
+    estimate.request = buf[14];
+    estimate.request_count = buf[15];
+    return 0;
+}
+
+// The median of the values, reordering them
+static double clock_median(std::vector<double> &vals) {
+    std::nth_element(vals.begin(), vals.begin()+vals.size()/2, vals.end());
+    return vals[vals.size()/2];
+}
+
+// Device time against the host's clock over the quicker half of the round
+// trips, whose midpoints are the truest, and against frame time over the
+// SOFs latched sooner than the median: a latch is only ever late
+void Client::fit_clock() {
+    const ClockPoint &last = clock_points.back();
+    std::vector<double> x, y, residuals;
+    double a, b, sum = 0., median;
+    size_t n;
+
+    for (const ClockPoint &point : clock_points)
+        residuals.push_back((double)point.rtt);
+    estimate.rtt_ns = (int64_t)*std::min_element(residuals.begin(), residuals.end());
+    median = clock_median(residuals);
+    for (const ClockPoint &point : clock_points) {
+        if (point.rtt>median)
+            continue;
+        x.push_back((double)(point.mid-last.mid));
+        y.push_back(point.now-estimate.tick);
+    }
+    if (clock_line(x, y, a, b) && b>0.) {
+        ticks_per_ns = b;
+    } else {
+        b = ticks_per_ns;
+        a = y.back()-b*x.back();
+    }
+    for (n = 0; n<x.size(); n++)
+        sum += (y[n]-a-b*x[n])*(y[n]-a-b*x[n]);
+    estimate.points = (uint32_t)x.size();
+    estimate.host_ns = last.mid+(int64_t)(-a/b);
+    estimate.host_ppm = (b*1e9/estimate.rate-1.)*1e6;
+    estimate.jitter_ns = (int64_t)(sqrt(sum/x.size())/b);
+
+    x.clear();
+    y.clear();
+    residuals.clear();
+    for (const ClockPoint &point : clock_points) {
+        x.push_back(point.frame-last.frame);
+        y.push_back(point.sof-estimate.tick);
+    }
+    if (clock_line(x, y, a, b)) {
+        for (n = 0; n<x.size(); n++)
+            residuals.push_back(y[n]-a-b*x[n]);
+        std::vector<double> sorted(residuals);
+        median = clock_median(sorted);
+        for (n = x.size(); n-->0; ) {
+            if (residuals[n]>median) {
+                x.erase(x.begin()+n);
+                y.erase(y.begin()+n);
+            }
+        }
+        if (clock_line(x, y, a, b) && b>0.)
+            ticks_per_frame = b;
+    }
+    b = ticks_per_frame;
+    a = 0.;
+    for (n = 0; n<x.size(); n++)
+        a += y[n]-b*x[n];
+    a /= x.size();
+    estimate.frame = last.frame-a/b;
+    estimate.frame_ppm = (b*1e3/estimate.rate-1.)*1e6;
+}
+
+Clock Client::clock() const {
+    std::lock_guard<std::mutex> guard(clock_lock);
+
+    return estimate;
+}
+
+/*************************************************
+			Capture
+**************************************************/
+
+// Syncs first if nothing has, so requests are placed by the clock from the start
+int Client::record(const char *path) {
+    haptic_capture *capture = nullptr;
+    int ret;
+
+    if (path) {
+        if (!clock().syncs)
+            sync();
+        capture = haptic_capture_create(path, serial().c_str(), clock().rate,
+                                        clock_ns(std::chrono::steady_clock::now()));
+        if (!capture)
+            return -1;
+    }
+    std::lock_guard<std::mutex> guard(capture_lock);
+    ret = haptic_capture_close(capturing);
+    capturing = capture;
+    return ret;
+}
+
+// The tick the board handled a request in: where the clock puts the middle
+// of the transfer, or without one, the last tick the stream brought
+void Client::record_request(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                            const uint8_t *data, uint16_t wLength, int result, int64_t mid) {
+    std::lock_guard<std::mutex> guard(capture_lock);
+    Clock clock;
+    uint16_t tick = last_tick;
+
+    if (!capturing)
+        return;
+    clock = this->clock();
+    if (clock.syncs)
+        tick = (uint16_t)(int64_t)floor(clock.tick+(mid-clock.host_ns)*clock.rate*1e-9*(1.+clock.host_ppm*1e-6));
+    haptic_capture_request(capturing, bmRequestType, bRequest, wValue, wIndex, wLength, data, result, tick,
+                           clock_ns(std::chrono::steady_clock::now()));
+}
+}
+
+/*************************************************
+			C interface
+**************************************************/
+
+struct haptic_client {
+    haptic::Client client;
+
+    haptic_client(std::unique_ptr<haptic::Transport> transport, size_t ring) : client(std::move(transport), ring) {}
+};
+
+static haptic_client *haptic_wrap(std::unique_ptr<haptic::Transport> transport, size_t ring) {
+    if (!transport)
+        return nullptr;
+    return new (std::nothrow) haptic_client(std::move(transport), ring ? ring:4096);
+}
+
+size_t haptic_list(char (*serials)[HAPTIC_SERIAL_MAX], size_t max) {
+    std::vector<std::string> found = haptic::list_libusb();
+    size_t n;
+
+    for (n = 0; n<found.size() && n<max; n++) {
+        strncpy(serials[n], found[n].c_str(), HAPTIC_SERIAL_MAX-1);
+        serials[n][HAPTIC_SERIAL_MAX-1] = '\0';
+    }
+    return n;
+}
+
+haptic_client *haptic_open(size_t ring) {
+    return haptic_wrap(haptic::open_libusb(), ring);
+}
+
+haptic_client *haptic_open_serial(const char *serial, size_t ring) {
+    return haptic_wrap(haptic::open_libusb(serial), ring);
+}
+
+haptic_client *haptic_open_sim(size_t ring, double speed) {
+    return haptic_wrap(haptic::open_sim(speed), ring);
+}
+
+void haptic_close(haptic_client *client) {
+    delete client;
+}
+
+void haptic_set_callback(haptic_client *client, haptic_callback callback, void *ctx) {
+    client->client.set_callback(callback, ctx);
+}
+
+int haptic_start(haptic_client *client, unsigned transfers) {
+    return client->client.start(transfers);
+}
+
+void haptic_stop(haptic_client *client) {
+    client->client.stop();
+}
+
+size_t haptic_read(haptic_client *client, HAPTIC_SAMPLE *samples, size_t max, int timeout_ms) {
+    return client->client.read(samples, max, timeout_ms);
+}
+
+int haptic_control(haptic_client *client, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                   uint16_t wIndex, uint8_t *data, uint16_t wLength, unsigned timeout_ms) {
+    return client->client.control(bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout_ms);
+}
+
+void haptic_stats(haptic_client *client, HAPTIC_STATS *stats) {
+    *stats = client->client.stats();
+}
+
+int haptic_serial(haptic_client *client, char *serial, size_t size) {
+    std::string found = client->client.serial();
+
+    if (found.empty() || !size)
+        return -1;
+    strncpy(serial, found.c_str(), size-1);
+    serial[size-1] = '\0';
+    return (int)found.size();
+}
+
+int haptic_attached(haptic_client *client) {
+    return client->client.attached();
+}
+
+int haptic_sync(haptic_client *client) {
+    return client->client.sync();
+}
+
+void haptic_clock(haptic_client *client, HAPTIC_CLOCK *clock) {
+    *clock = client->client.clock();
+}
+
+int64_t haptic_clock_ns(const HAPTIC_CLOCK *clock, uint16_t time) {
+    int16_t ticks = (int16_t)(time-(uint16_t)clock->tick);
+
+    if (!clock->syncs)
+        return 0;
+    return clock->host_ns+(int64_t)(ticks*1e9/clock->rate/(1.+clock->host_ppm*1e-6));
+}
+
+double haptic_clock_frame(const HAPTIC_CLOCK *clock, uint16_t time) {
+    int16_t ticks = (int16_t)(time-(uint16_t)clock->tick);
+
+    if (!clock->syncs)
+        return 0.;
+    return clock->frame+ticks*1e3/clock->rate/(1.+clock->frame_ppm*1e-6);
+}
+
+int haptic_record(haptic_client *client, const char *path) {
+    return client->client.record(path);
+}
@@ -0,0 +1,230 @@
+/*
+	Host-side client for the haptic knob
+
+	Talks to the device (VID 0x6666, PID 0x0003) through a transport: libusb,
+	when the library is built with HAPTIC_LIBUSB, or the simulated board in
+	sim/ for running with no hardware present. The EP1 IN telemetry stream
+	is read with several transfers kept in flight; each packet is decoded in
+	place into a ring of samples allocated once when the client is opened,
+	and handed to an optional callback on the transport's event thread. The
+	ring is drained with read() from one consumer thread. Vendor requests
+	go over EP0 with control(), which blocks until the transfer completes.
+
+	sync() takes one GET_CLOCK round trip, in which the device reports the
+	frame number of the last USB SOF with the device time it came in at,
+	the device time then, and when it handled the last vendor request.
+	Over the last HAPTIC_CLOCK_WINDOW of them, device time is fitted to the
+	host's steady_clock (CLOCK_MONOTONIC) over the quicker half of the
+	round trips, and to USB frame time over the SOFs latched soonest, each
+	for offset and drift. clock() returns the estimate, which places a
+	sample's tick, or the handling of a request, on either timeline; call
+	sync() every 100 ms or so, and at least every few seconds.
+
+	record() captures the client's stream and vendor requests to a file
+	(haptic_capture.h) until it is called again, for sim/replay.c to feed
+	back through the firmware.
+
+	Boards are told apart by the serial number string descriptor; every
+	libusb transport in a process shares one context and one event thread,
+	so a process serving several boards runs a single event loop.
+
+	The C interface below is what the ctypes binding in haptic_host.py
+	loads; C++ code can use haptic::Client directly.
+*/
+
+#ifndef _HAPTIC_HOST_H_
+#define _HAPTIC_HOST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HAPTIC_VID          0x6666
+#define HAPTIC_PID          0x0003
+#define HAPTIC_STREAM_EP    0x81
+#define HAPTIC_PACKET       64          // MAX_PACKET_SIZE on the device
+#define HAPTIC_VERSION      2           // TELEMETRY_VERSION, the packet layout this decodes
+#define HAPTIC_HEADER       8           // TELEMETRY_HEADER: version, sequence, samples, channels, tick, dropped
+#define HAPTIC_PACKET_SAMPLES   56      // TELEMETRY_MAX
+#define HAPTIC_CHANNELS     8           // TELEMETRY_CHANNELS, current, emf, fb, enc, pos, vel, acc, edges in mask bit order
+#define HAPTIC_SERIAL_MAX   32          // serial number string, with its terminator
+#define HAPTIC_CLOCK_WINDOW 64          // syncs the clock estimate is fitted over
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {                        // SAMPLE in telemetry.h
+    uint16_t time;                      // control tick
+    uint16_t current;
+    uint16_t emf;
+    uint16_t fb;
+    uint16_t enc;
+    uint16_t pos;                       // low 16 bits of the unclamped position
+    int16_t vel;                        // observer, counts/s
+    int16_t acc;                        // observer, 16 counts/s^2
+    uint16_t edges;                     // from input capture, counted or not; streamed only when asked for
+} HAPTIC_SAMPLE;
+
+typedef struct {
+    uint64_t packets;
+    uint64_t samples;
+    uint64_t missed;                    // packets lost between the device and us, from sequence gaps
+    uint64_t overruns;                  // samples lost because read() fell behind and the ring filled
+    uint64_t malformed;                 // packets of another layout, or cut short
+    uint16_t dropped;                   // the device's own count of samples it could not queue
+} HAPTIC_STATS;
+
+typedef struct {                        // sync()'s estimate; ticks and frames extended to 64 bits
+    uint64_t syncs;                     // GET_CLOCK round trips taken
+    uint32_t points;                    // of the window, the ones the host fit is taken over
+    uint32_t rate;                      // device ticks per second, CONTROL_FREQ
+    uint64_t tick;                      // device tick of the latest sync...
+    int64_t host_ns;                    // ...on the host's steady_clock...
+    double frame;                       // ...and in USB frames, whose low 11 bits are the frame number on the bus
+    double host_ppm;                    // how much faster the device's clock runs than the host's...
+    double frame_ppm;                   // ...and than the USB frame clock
+    int64_t rtt_ns;                     // quickest GET_CLOCK round trip in the window, which bounds host_ns
+    int64_t jitter_ns;                  // rms residual of the host fit
+    uint64_t request_tick;              // when the device handled the last vendor request but GET_CLOCK...
+    int64_t request_ns;                 // ...on the host's clock...
+    uint8_t request;                    // ...which request it was...
+    uint8_t request_count;              // ...and how many the device has handled, mod 256
+} HAPTIC_CLOCK;
+
+typedef struct haptic_client haptic_client;
+typedef void (*haptic_callback)(void *ctx, const HAPTIC_SAMPLE *samples, size_t count);
+
+size_t haptic_list(char (*serials)[HAPTIC_SERIAL_MAX], size_t max);   // boards attached, up to max
+haptic_client *haptic_open(size_t ring);                    // NULL if no device or no libusb
+haptic_client *haptic_open_serial(const char *serial, size_t ring);    // that board, or the first if NULL
+haptic_client *haptic_open_sim(size_t ring, double speed);  // speed 1 runs the board in real time, 0 flat out
+void haptic_close(haptic_client *client);
+void haptic_set_callback(haptic_client *client, haptic_callback callback, void *ctx);
+int haptic_start(haptic_client *client, unsigned transfers);
+void haptic_stop(haptic_client *client);
+size_t haptic_read(haptic_client *client, HAPTIC_SAMPLE *samples, size_t max, int timeout_ms);
+int haptic_control(haptic_client *client, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                   uint16_t wIndex, uint8_t *data, uint16_t wLength, unsigned timeout_ms);
+void haptic_stats(haptic_client *client, HAPTIC_STATS *stats);
+int haptic_serial(haptic_client *client, char *serial, size_t size);    // <0 if the board would not say
+int haptic_attached(haptic_client *client);                 // 0 once the board has gone from the bus
+int haptic_sync(haptic_client *client);                     // <0 if GET_CLOCK failed
+void haptic_clock(haptic_client *client, HAPTIC_CLOCK *clock);
+int64_t haptic_clock_ns(const HAPTIC_CLOCK *clock, uint16_t time);  // host time of a sample's tick, within 6 s of the sync
+double haptic_clock_frame(const HAPTIC_CLOCK *clock, uint16_t time);    // USB frame time of it
+int haptic_record(haptic_client *client, const char *path);    // NULL stops; <0 if a capture could not be written
+
+#ifdef __cplusplus
+}
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+typedef struct haptic_capture haptic_capture;
+
+namespace haptic {
+
+typedef HAPTIC_SAMPLE Sample;
+typedef HAPTIC_STATS Stats;
+typedef HAPTIC_CLOCK Clock;
+
+// How the client reaches the device. Stream packets are passed to the
+// deliver function from the transport's own event thread.
+class Transport {
+public:
+    typedef void (*Deliver)(void *ctx, const uint8_t *data, size_t length);
+
+    virtual ~Transport() {}
+    virtual int control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                        uint8_t *data, uint16_t wLength, unsigned timeout_ms) = 0;   // bytes moved, <0 on failure
+    virtual int start(unsigned transfers, Deliver deliver, void *ctx) = 0;
+    virtual void stop() = 0;
+    virtual bool attached() const { return true; }
+    virtual void recover() {}               // from the caller's thread, what the event thread must not do itself
+};
+
+std::vector<std::string> list_libusb();             // serial numbers of the boards on the bus
+std::unique_ptr<Transport> open_libusb(const char *serial = nullptr);   // nullptr if there is no such board
+std::unique_ptr<Transport> open_sim(double speed);
+
+// Single producer (the event thread), single consumer ring of samples
+class SampleRing {
+public:
+    explicit SampleRing(size_t capacity);           // rounded up to a power of 2
+    size_t push(const Sample *samples, size_t count);
+    size_t pop(Sample *samples, size_t max);
+    size_t size() const;
+
+private:
+    std::vector<Sample> ring;
+    size_t mask;
+    std::atomic<size_t> head;                       // advanced only by push()
+    std::atomic<size_t> tail;                       // advanced only by pop()
+};
+
+class Client {
+public:
+    Client(std::unique_ptr<Transport> transport, size_t ring);
+    ~Client();
+
+    void set_callback(haptic_callback callback, void *ctx);    // before start()
+    int start(unsigned transfers);
+    void stop();
+    size_t read(Sample *samples, size_t max, int timeout_ms);
+    int control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                uint8_t *data, uint16_t wLength, unsigned timeout_ms);
+    Stats stats() const;
+    std::string serial();                           // from the string descriptor, empty if the board would not say
+    bool attached() const { return transport->attached(); }
+    int sync();                                     // <0 if GET_CLOCK failed
+    Clock clock() const;
+    int record(const char *path);                   // capture to path, nullptr to stop
+
+private:
+    struct ClockPoint {                             // one sync, device times in ticks
+        double now;                                 // when the device handled GET_CLOCK...
+        int64_t mid, rtt;                           // ...and the round trip's midpoint and length on the host
+        double sof;                                 // when the device latched the last SOF...
+        double frame;                               // ...and its frame number
+    };
+
+    static void deliver(void *ctx, const uint8_t *data, size_t length);
+    void decode(const uint8_t *data, size_t length);
+    void fit_clock();
+    void record_request(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, const uint8_t *data,
+                        uint16_t wLength, int result, int64_t mid);
+
+    std::unique_ptr<Transport> transport;
+    SampleRing samples;
+    haptic_callback callback;
+    void *callback_ctx;
+    bool streaming;
+
+    // Written by the event thread only
+    std::atomic<uint64_t> packets, count, missed, overruns, malformed;
+    std::atomic<uint16_t> dropped;
+    std::atomic<uint16_t> last_tick;                // of the last sample delivered
+    int sequence;                                   // last packet's, -1 before the first
+
+    std::mutex wait_lock;                           // only for read() to sleep on
+    std::condition_variable arrived;
+
+    mutable std::mutex clock_lock;                  // sync() may run beside clock()
+    std::deque<ClockPoint> clock_points;            // the last HAPTIC_CLOCK_WINDOW syncs
+    Clock estimate;
+    double ticks_per_ns, ticks_per_frame;           // the fits' slopes
+
+    std::mutex capture_lock;                        // the event thread and control() both write
+    haptic_capture *capturing;                      // nullptr unless record() is on
+};
+
+}
+
+#endif
+
+#endif
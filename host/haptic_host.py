@@ -0,0 +1,219 @@
+import ctypes
+import os
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from vendor_requests import vendor_requests
+
+class HAPTIC_SAMPLE(ctypes.Structure):
+    _fields_ = [('time', ctypes.c_uint16), ('current', ctypes.c_uint16), ('emf', ctypes.c_uint16),
+                ('fb', ctypes.c_uint16), ('enc', ctypes.c_uint16), ('pos', ctypes.c_uint16),
+                ('vel', ctypes.c_int16), ('acc', ctypes.c_int16), ('edges', ctypes.c_uint16)]
+
+class HAPTIC_STATS(ctypes.Structure):
+    _fields_ = [('packets', ctypes.c_uint64), ('samples', ctypes.c_uint64), ('missed', ctypes.c_uint64),
+                ('overruns', ctypes.c_uint64), ('malformed', ctypes.c_uint64), ('dropped', ctypes.c_uint16)]
+
+class HAPTIC_CLOCK(ctypes.Structure):
+    _fields_ = [('syncs', ctypes.c_uint64), ('points', ctypes.c_uint32), ('rate', ctypes.c_uint32),
+                ('tick', ctypes.c_uint64), ('host_ns', ctypes.c_int64), ('frame', ctypes.c_double),
+                ('host_ppm', ctypes.c_double), ('frame_ppm', ctypes.c_double), ('rtt_ns', ctypes.c_int64),
+                ('jitter_ns', ctypes.c_int64), ('request_tick', ctypes.c_uint64), ('request_ns', ctypes.c_int64),
+                ('request', ctypes.c_uint8), ('request_count', ctypes.c_uint8)]
+
+HAPTIC_SERIAL_MAX = 32
+_SERIALS = (ctypes.c_char*HAPTIC_SERIAL_MAX)*16
+
+_lib = ctypes.CDLL(os.path.join(os.path.dirname(os.path.abspath(__file__)), 'libhaptic_host.so'))
+_lib.haptic_open.restype = ctypes.c_void_p
+_lib.haptic_open.argtypes = [ctypes.c_size_t]
+_lib.haptic_open_sim.restype = ctypes.c_void_p
+_lib.haptic_open_sim.argtypes = [ctypes.c_size_t, ctypes.c_double]
+_lib.haptic_close.argtypes = [ctypes.c_void_p]
+_lib.haptic_start.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+_lib.haptic_stop.argtypes = [ctypes.c_void_p]
+_lib.haptic_read.restype = ctypes.c_size_t
+_lib.haptic_read.argtypes = [ctypes.c_void_p, ctypes.POINTER(HAPTIC_SAMPLE), ctypes.c_size_t, ctypes.c_int]
+_lib.haptic_control.argtypes = [ctypes.c_void_p, ctypes.c_uint8, ctypes.c_uint8, ctypes.c_uint16, ctypes.c_uint16,
+                                ctypes.c_void_p, ctypes.c_uint16, ctypes.c_uint]
+_lib.haptic_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(HAPTIC_STATS)]
+_lib.haptic_list.restype = ctypes.c_size_t
+_lib.haptic_list.argtypes = [_SERIALS, ctypes.c_size_t]
+_lib.haptic_open_serial.restype = ctypes.c_void_p
+_lib.haptic_open_serial.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+_lib.haptic_serial.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
+_lib.haptic_sync.argtypes = [ctypes.c_void_p]
+_lib.haptic_clock.argtypes = [ctypes.c_void_p, ctypes.POINTER(HAPTIC_CLOCK)]
+_lib.haptic_clock_ns.restype = ctypes.c_int64
+_lib.haptic_clock_ns.argtypes = [ctypes.POINTER(HAPTIC_CLOCK), ctypes.c_uint16]
+_lib.haptic_clock_frame.restype = ctypes.c_double
+_lib.haptic_clock_frame.argtypes = [ctypes.POINTER(HAPTIC_CLOCK), ctypes.c_uint16]
+_lib.haptic_record.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+_lib.haptic_shm_list.restype = ctypes.c_size_t
+_lib.haptic_shm_list.argtypes = [_SERIALS, ctypes.c_size_t]
+_lib.haptic_shm_open.restype = ctypes.c_void_p
+_lib.haptic_shm_open.argtypes = [ctypes.c_char_p]
+_lib.haptic_shm_close.argtypes = [ctypes.c_void_p]
+_lib.haptic_shm_state.argtypes = [ctypes.c_void_p, ctypes.POINTER(HAPTIC_SAMPLE), ctypes.POINTER(HAPTIC_STATS)]
+_lib.haptic_shm_clock.argtypes = [ctypes.c_void_p, ctypes.POINTER(HAPTIC_CLOCK)]
+_lib.haptic_shm_read.restype = ctypes.c_size_t
+_lib.haptic_shm_read.argtypes = [ctypes.c_void_p, ctypes.POINTER(HAPTIC_SAMPLE), ctypes.c_size_t, ctypes.c_int]
+_lib.haptic_shm_lost.restype = ctypes.c_uint64
+_lib.haptic_shm_lost.argtypes = [ctypes.c_void_p]
+_lib.haptic_shm_control.argtypes = [ctypes.c_void_p, ctypes.c_uint8, ctypes.c_uint8, ctypes.c_uint16, ctypes.c_uint16,
+                                    ctypes.c_void_p, ctypes.c_uint16, ctypes.c_uint]
+
+def list_devices(shared = False):
+    """Serial numbers of the boards on the bus, or with shared = True of
+    the boards hapticd is publishing."""
+    serials = _SERIALS()
+    num = (_lib.haptic_shm_list if shared else _lib.haptic_list)(serials, len(serials))
+    return [serials[n].value.decode('ascii') for n in range(num)]
+
+class USBError(IOError):
+    pass
+
+class usb_comm(vendor_requests):
+    """Drop-in for usb_comm.usb_comm on top of libhaptic_host: the same
+    vendor requests (vendor_requests.py), with the telemetry stream read
+    by several transfers in flight on the library's own thread instead of
+    one read per call. Pass sim = True to talk to the simulated board
+    instead of hardware, serial to pick one of several boards, and shared
+    = True to go through hapticd's shared memory instead of claiming the
+    board."""
+
+    USBError = USBError
+
+    def __init__(self, sim = False, ring = 1<<16, transfers = 8, speed = 1., serial = None, shared = False):
+        self.timeout = 1000
+        self.dev = None
+        self.shm = None
+        self.buffer = (HAPTIC_SAMPLE*1024)()
+        if shared:
+            serial = serial or (list_devices(shared = True) or [None])[0]
+            self.shm = _lib.haptic_shm_open(serial.encode('ascii')) if serial else None
+            if not self.shm:
+                raise ValueError('hapticd is not publishing %s' % ('board ' + serial if serial else 'any board'))
+            self.shm_serial = serial
+            return
+        if sim:
+            self.dev = _lib.haptic_open_sim(ring, speed)
+        else:
+            self.dev = _lib.haptic_open_serial(serial.encode('ascii') if serial else None, ring)
+        if not self.dev:
+            raise ValueError('no simulated board available' if sim else
+                             'no USB device found matching idVendor = 0x6666 and idProduct = 0x0003' +
+                             (' and serial number ' + serial if serial else ''))
+        if _lib.haptic_start(self.dev, transfers)<0:
+            self.close()
+            raise USBError('could not start the telemetry stream')
+
+    def __del__(self):
+        self.close()
+
+    def close(self):
+        if getattr(self, 'dev', None):
+            _lib.haptic_close(self.dev)
+            self.dev = None
+        if getattr(self, 'shm', None):
+            _lib.haptic_shm_close(self.shm)
+            self.shm = None
+
+    def ctrl_transfer(self, bmRequestType, bRequest, wValue = 0, wIndex = 0, data = None):
+        """Like pyusb's: data is the length to read for IN requests, the
+        bytes to send for OUT ones. Raises USBError on failure."""
+        if bmRequestType&0x80:
+            length = data or 0
+            buf = ctypes.create_string_buffer(length)
+        else:
+            data = data or b''
+            length = len(data)
+            buf = ctypes.create_string_buffer(data, length)
+        if self.shm:
+            ret = _lib.haptic_shm_control(self.shm, bmRequestType, bRequest, wValue, wIndex, buf, length, self.timeout)
+        else:
+            ret = _lib.haptic_control(self.dev, bmRequestType, bRequest, wValue, wIndex, buf, length, self.timeout)
+        if ret<0:
+            raise USBError('control transfer %d failed' % bRequest)
+        return bytearray(buf.raw[:ret])
+
+    @property
+    def stats(self):
+        stats = HAPTIC_STATS()
+        if self.shm:
+            _lib.haptic_shm_state(self.shm, None, ctypes.byref(stats))
+            stats.overruns = _lib.haptic_shm_lost(self.shm)     # this reader's, the board's are hapticd's
+        else:
+            _lib.haptic_stats(self.dev, ctypes.byref(stats))
+        return stats
+
+    @property
+    def serial(self):
+        if self.shm:
+            return self.shm_serial
+        buf = ctypes.create_string_buffer(HAPTIC_SERIAL_MAX)
+        return buf.value.decode('ascii') if _lib.haptic_serial(self.dev, buf, len(buf))>=0 else None
+
+    def get_state(self):
+        """Through hapticd, the latest sample as get_samples() gives them
+        and whether the board is still attached, without reading the
+        stream."""
+        last = HAPTIC_SAMPLE()
+        attached = _lib.haptic_shm_state(self.shm, ctypes.byref(last), None)
+        return [last.time, last.current, last.emf, last.fb, last.enc, last.pos, last.vel, last.acc], bool(attached)
+
+    def record(self, path):
+        """Capture the stream and vendor requests to path (see
+        haptic_capture.h) from now until record(None) or close(); for
+        sim/replay.c. Not through hapticd, which captures with -c. Raises
+        USBError if the file could not be written."""
+        if self.shm:
+            raise USBError('capture through hapticd -c')
+        if _lib.haptic_record(self.dev, path.encode() if path else None)<0:
+            raise USBError('could not capture to %s' % path)
+
+    def sync(self):
+        """Take one GET_CLOCK round trip into the clock estimate; call it
+        every 100 ms or so. Through hapticd, which keeps the estimate up
+        itself, it does nothing. Returns False if the request failed."""
+        return True if self.shm else _lib.haptic_sync(self.dev)>=0
+
+    @property
+    def clock(self):
+        """The clock estimate as a HAPTIC_CLOCK (see haptic_host.h)."""
+        clock = HAPTIC_CLOCK()
+        if self.shm:
+            _lib.haptic_shm_clock(self.shm, ctypes.byref(clock))
+        else:
+            _lib.haptic_clock(self.dev, ctypes.byref(clock))
+        return clock
+
+    def sample_time(self, time, clock = None):
+        """Host time of a sample's tick, on time.monotonic()'s clock, and
+        its USB frame time in frames, from the clock estimate (or the one
+        given). Good within a few seconds of the last sync."""
+        clock = clock or self.clock
+        return _lib.haptic_clock_ns(ctypes.byref(clock), time)*1e-9, _lib.haptic_clock_frame(ctypes.byref(clock), time)
+
+    @property
+    def missed(self):
+        return self.stats.missed
+
+    @property
+    def dropped(self):
+        return self.stats.dropped
+
+    def get_samples(self, timeout = 100):
+        """Return the telemetry samples received since the last call, up to
+        1024, as [time, current_val, emf_val, fb_val, enc_count_val, enc_pos,
+        vel, acc] lists, waiting up to timeout ms for the first; enc_pos is
+        the low 16 bits of the unclamped position, vel and acc the
+        observer's in counts/s and 16 counts/s^2; channels set_telemetry()
+        left out read 0. Lost packets are counted in self.missed, samples
+        the device could not queue in self.dropped, samples this side did
+        not collect in time in self.stats.overruns."""
+        if self.shm:
+            num = _lib.haptic_shm_read(self.shm, self.buffer, len(self.buffer), int(timeout))
+        else:
+            num = _lib.haptic_read(self.dev, self.buffer, len(self.buffer), int(timeout))
+        return [[s.time, s.current, s.emf, s.fb, s.enc, s.pos, s.vel, s.acc] for s in self.buffer[:num]]
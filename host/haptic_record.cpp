@@ -0,0 +1,160 @@
+/*
+	Records a board's stream to a capture file
+
+	Takes the board's whole EP1 IN stream at full rate into a capture
+	(haptic_capture.h) until the time is up or it is interrupted, for
+	sim/replay.c to feed back through the firmware. Before the stream
+	starts it has the board stream every channel, edges included, and
+	reads back its settings (gains, soft limits, filters, the EMF
+	calibration), which go into the capture with the requests. Once the
+	stream is running, GET_STATE takes the state the control loop carries
+	between ticks, for the replay to pick up from, and again every second,
+	for it to check itself against; GET_CLOCK every 100 ms places the
+	requests on the board's ticks. Built by the host target in SConstruct:
+
+		scons host && host/haptic_record -s -t 10 -o knob.hcap
+
+	-s  record the simulated board instead of hardware
+	-S  speed of the simulated board, 1 = real time (default 1)
+	-n  serial number of the board to record (default the first found)
+	-t  seconds to record, 0 = until interrupted (default 0)
+	-o  capture file (default haptic.hcap)
+	-c  telemetry channel mask,ticks per packet to stream (default 0xFF,0)
+	-x  EP1 IN transfers kept in flight (default 8)
+
+	Programs on the library can capture their own traffic the same way,
+	with Client::record(), and hapticd does for every board with -c.
+*/
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "haptic_host.h"
+
+#define GET_GAINS       6
+#define GET_FILTERS     13
+#define GET_EMF         14
+#define GET_LIMITS      16
+#define SET_TELEMETRY   17
+#define GET_TELEMETRY   18
+#define GET_STATE       20
+#define STATE_LENGTH    64
+#define TIMEOUT_MS      1000
+#define SYNC_MS         100
+#define STATE_MS        1000
+#define BATCH           4096
+
+typedef std::chrono::steady_clock record_clock;
+
+static volatile sig_atomic_t record_quit = 0;
+
+static void record_signal(int sig) {
+    (void)sig;
+    record_quit = 1;
+}
+
+// The state a replay starts from, read so it goes into the capture
+static int record_state(haptic::Client &client) {
+    static const struct { uint8_t request; uint16_t length; } reads[] = {
+        {GET_TELEMETRY, 3}, {GET_GAINS, 10}, {GET_LIMITS, 4}, {GET_FILTERS, 6}, {GET_EMF, 6}
+    };
+    uint8_t data[16];
+    int failed = 0;
+
+    for (const auto &read : reads)
+        if (client.control(0xC0, read.request, 0, 0, data, read.length, TIMEOUT_MS)<read.length)
+            failed++;
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    std::unique_ptr<haptic::Transport> transport;
+    std::vector<haptic::Sample> drain(BATCH);
+    record_clock::time_point t0, now, next_sync, next_state, next_status;
+    uint8_t state[STATE_LENGTH];
+    haptic::Stats stats;
+    const char *path = "haptic.hcap", *serial = nullptr;
+    double speed = 1., seconds = 0., elapsed;
+    unsigned transfers = 8;
+    int opt, sim = 0, channels = 0xFF, hold = 0;
+
+    while ((opt = getopt(argc, argv, "sS:n:t:o:c:x:"))!=-1) {
+        switch (opt) {
+            case 's': sim = 1; break;
+            case 'S': speed = atof(optarg); break;
+            case 'n': serial = optarg; break;
+            case 't': seconds = atof(optarg); break;
+            case 'o': path = optarg; break;
+            case 'c': sscanf(optarg, "%i,%d", &channels, &hold); break;
+            case 'x': transfers = (unsigned)atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s] [-S speed] [-n serial] [-t seconds] [-o file] [-c mask,ticks] [-x transfers]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    transport = sim ? haptic::open_sim(speed):haptic::open_libusb(serial);
+    if (!transport) {
+        fprintf(stderr, "%s\n", sim ? "could not start the simulated board":"no such device 6666:0003, or built without libusb");
+        return 1;
+    }
+    haptic::Client client(std::move(transport), 1<<16);
+    if (client.record(path)<0) {
+        fprintf(stderr, "could not create %s\n", path);
+        return 1;
+    }
+    if (client.control(0x40, SET_TELEMETRY, (uint16_t)channels, (uint16_t)hold, nullptr, 0, TIMEOUT_MS)<0)
+        fprintf(stderr, "the board would not stream channels 0x%02X\n", channels);
+    if (record_state(client))
+        fprintf(stderr, "the board would not report all of its state; the replay will start from defaults\n");
+    if (client.start(transfers)<0) {
+        fprintf(stderr, "could not start the telemetry stream\n");
+        return 1;
+    }
+    if (client.control(0xC0, GET_STATE, 0, 0, state, STATE_LENGTH, TIMEOUT_MS)<STATE_LENGTH)
+        fprintf(stderr, "the board would not report its control state; the replay will only settle toward it\n");
+    signal(SIGINT, record_signal);
+    signal(SIGTERM, record_signal);
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+    printf("recording %s to %s, %s\n", sim ? "the simulated board":"hardware", path,
+           seconds>0. ? "for the time given":"until interrupted");
+
+    t0 = record_clock::now();
+    next_sync = t0+std::chrono::milliseconds(SYNC_MS);
+    next_state = t0+std::chrono::milliseconds(STATE_MS);
+    next_status = t0+std::chrono::seconds(1);
+    while (!record_quit && client.attached()) {
+        client.read(drain.data(), drain.size(), 10);    // the capture is written as packets come in
+        now = record_clock::now();
+        elapsed = std::chrono::duration<double>(now-t0).count();
+        if (seconds>0. && elapsed>=seconds)
+            break;
+        if (now>=next_sync) {
+            client.sync();
+            next_sync += std::chrono::milliseconds(SYNC_MS);
+        }
+        if (now>=next_state) {
+            client.control(0xC0, GET_STATE, 0, 0, state, STATE_LENGTH, TIMEOUT_MS);
+            next_state += std::chrono::milliseconds(STATE_MS);
+        }
+        if (now>=next_status) {
+            stats = client.stats();
+            printf("  %.0f s: %llu samples, %llu packets missed\n", elapsed,
+                   (unsigned long long)stats.samples, (unsigned long long)stats.missed);
+            next_status += std::chrono::seconds(1);
+        }
+    }
+    elapsed = std::chrono::duration<double>(record_clock::now()-t0).count();
+    client.stop();
+    stats = client.stats();
+    if (client.record(nullptr)<0) {
+        fprintf(stderr, "%s could not be written whole\n", path);
+        return 1;
+    }
+    printf("%.1f s: %llu samples in %llu packets, %.0f samples/s; %llu packets missed, %llu malformed, %u dropped on the device\n",
+           elapsed, (unsigned long long)stats.samples, (unsigned long long)stats.packets, stats.samples/elapsed,
+           (unsigned long long)stats.missed, (unsigned long long)stats.malformed, stats.dropped);
+    return client.attached() ? 0:1;
+}
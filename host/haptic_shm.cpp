@@ -0,0 +1,399 @@
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "haptic_shm.h"
+
+#define SHM_SPIN_US     200             // a reader waiting on the daemon spins this long before sleeping
+#define SHM_SLEEP_US    100
+
+// Fields shared between processes are only touched through these
+#define SHM_LOAD(field)         __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#define SHM_STORE(field, val)   __atomic_store_n(&(field), (val), __ATOMIC_RELEASE)
+#define SHM_SWAP(field, from, to)   ({ uint32_t shm_from_ = (from); \
+        __atomic_compare_exchange_n(&(field), &shm_from_, (to), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+
+static void *shm_map(const char *name, size_t size, bool create) {
+    void *map;
+    int fd;
+
+    fd = shm_open(name, create ? O_RDWR|O_CREAT:O_RDWR, 0666);
+    if (fd<0)
+        return nullptr;
+    if (create && ftruncate(fd, size)<0) {
+        close(fd);
+        return nullptr;
+    }
+    map = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return map==MAP_FAILED ? nullptr:map;
+}
+
+static bool shm_alive(int32_t pid) {
+    return pid>0 && (kill(pid, 0)==0 || errno!=ESRCH);
+}
+
+namespace haptic {
+
+/*************************************************
+			Daemon side
+**************************************************/
+
+Publisher::~Publisher() {
+    if (!shm)
+        return;
+    SHM_STORE(shm->attached, 0u);
+    munmap(shm, sizeof(HAPTIC_SHM));
+    shm_unlink(path.c_str());           // readers still mapping it keep it until they let go
+}
+
+// Lays the segment out afresh unless a previous daemon left one of this
+// layout, in which case readers already mapping it carry on where they were
+bool Publisher::open(const std::string &serial) {
+    unsigned n;
+
+    path = HAPTIC_SHM_PREFIX+serial;
+    shm = static_cast<HAPTIC_SHM *>(shm_map(path.c_str(), sizeof(HAPTIC_SHM), true));
+    if (!shm)
+        return false;
+    if (SHM_LOAD(shm->magic)!=HAPTIC_SHM_MAGIC || shm->version!=HAPTIC_SHM_VERSION || shm->ring!=HAPTIC_SHM_RING) {
+        memset(shm, 0, offsetof(HAPTIC_SHM, samples));
+        shm->version = HAPTIC_SHM_VERSION;
+        shm->ring = HAPTIC_SHM_RING;
+        strncpy(shm->serial, serial.c_str(), HAPTIC_SERIAL_MAX-1);
+        SHM_STORE(shm->magic, (uint32_t)HAPTIC_SHM_MAGIC);
+    }
+    for (n = 0; n<HAPTIC_SHM_SLOTS; n++) {  // the old daemon's requests died with it
+        HAPTIC_SHM_REQUEST *req = &shm->requests[n];
+        uint32_t state;
+
+        if (SHM_LOAD(req->state)==HAPTIC_SLOT_BUSY) {  // nothing is on the bus any more: fail it to its reader
+            req->result = -1;
+            SHM_SWAP(req->state, HAPTIC_SLOT_BUSY, HAPTIC_SLOT_DONE);
+        }
+        SHM_SWAP(req->state, HAPTIC_SLOT_ABANDONED, HAPTIC_SLOT_FREE);  // whoever its reader was, it is gone
+        state = SHM_LOAD(req->state);
+        if (state!=HAPTIC_SLOT_FREE && !shm_alive(req->pid))
+            SHM_SWAP(req->state, state, HAPTIC_SLOT_FREE);
+    }
+    SHM_STORE(shm->pid, (int32_t)getpid());
+    return true;
+}
+
+void Publisher::attach(bool attached) {
+    unsigned n;
+
+    SHM_STORE(shm->attached, attached ? 1u:0u);
+    for (n = 0; n<HAPTIC_SHM_SLOTS; n++) {  // and a reader that died holding a slot gives it up
+        HAPTIC_SHM_REQUEST *req = &shm->requests[n];
+        uint32_t state = SHM_LOAD(req->state);
+
+        if ((state==HAPTIC_SLOT_CLAIMED || state==HAPTIC_SLOT_DONE) && !shm_alive(req->pid))
+            SHM_SWAP(req->state, state, HAPTIC_SLOT_FREE);
+    }
+}
+
+// Announces how far the write goes before overwriting anything, so a
+// reader that then finds head short of it knows which slots to distrust
+void Publisher::publish(const Sample *samples, size_t count, const Stats &stats) {
+    uint64_t head = shm->head;
+    uint32_t seq = shm->state_seq;
+    size_t n;
+
+    if (count) {
+        __atomic_store_n(&shm->claim, head+count, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        for (n = 0; n<count; n++)
+            shm->samples[(head+n)&(HAPTIC_SHM_RING-1)] = samples[n];
+        SHM_STORE(shm->head, head+count);
+    }
+
+    __atomic_store_n(&shm->state_seq, seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (count)
+        shm->last = samples[count-1];
+    shm->stats = stats;
+    SHM_STORE(shm->state_seq, seq+2);
+}
+
+void Publisher::publish(const Clock &clock) {
+    uint32_t seq = shm->state_seq;
+
+    __atomic_store_n(&shm->state_seq, seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shm->clock = clock;
+    SHM_STORE(shm->state_seq, seq+2);
+}
+
+bool Publisher::serve(Client &client) {
+    unsigned n;
+
+    for (n = 0; n<HAPTIC_SHM_SLOTS; n++) {
+        HAPTIC_SHM_REQUEST *req = &shm->requests[n];
+
+        if (!SHM_SWAP(req->state, HAPTIC_SLOT_PENDING, HAPTIC_SLOT_BUSY))
+            continue;
+        req->result = req->wLength>HAPTIC_SHM_DATA ? -1:
+                      client.control(req->bmRequestType, req->bRequest, req->wValue, req->wIndex, req->data,
+                                     req->wLength, req->timeout_ms);
+        if (!SHM_SWAP(req->state, HAPTIC_SLOT_BUSY, HAPTIC_SLOT_DONE))
+            SHM_STORE(req->state, (uint32_t)HAPTIC_SLOT_FREE);     // abandoned while on the bus
+        return true;
+    }
+    return false;
+}
+
+Directory::~Directory() {
+    if (!dir)
+        return;
+    munmap(dir, sizeof(HAPTIC_SHM_DIRECTORY));
+    shm_unlink(HAPTIC_SHM_LIST);
+}
+
+bool Directory::open() {
+    dir = static_cast<HAPTIC_SHM_DIRECTORY *>(shm_map(HAPTIC_SHM_LIST, sizeof(HAPTIC_SHM_DIRECTORY), true));
+    if (!dir)
+        return false;
+    memset(dir, 0, sizeof(HAPTIC_SHM_DIRECTORY));
+    dir->version = HAPTIC_SHM_VERSION;
+    dir->pid = getpid();
+    SHM_STORE(dir->magic, (uint32_t)HAPTIC_SHM_MAGIC);
+    return true;
+}
+
+// An entry keeps its serial number once taken, so a board that comes back gets it again
+void Directory::set(const std::string &serial, bool attached) {
+    unsigned n, free = HAPTIC_SHM_DEVICES;
+
+    for (n = 0; n<HAPTIC_SHM_DEVICES; n++) {
+        if (!dir->devices[n].serial[0]) {
+            if (free==HAPTIC_SHM_DEVICES)
+                free = n;
+        } else if (serial==dir->devices[n].serial) {
+            break;
+        }
+    }
+    if (n==HAPTIC_SHM_DEVICES) {
+        if (free==HAPTIC_SHM_DEVICES)
+            return;                     // full; the board is still published, just not listed
+        n = free;
+        strncpy(dir->devices[n].serial, serial.c_str(), HAPTIC_SERIAL_MAX-1);
+    }
+    SHM_STORE(dir->devices[n].attached, attached ? 1u:0u);
+}
+
+}
+
+/*************************************************
+			Reader side (C interface)
+**************************************************/
+
+struct haptic_shm {
+    HAPTIC_SHM *shm;
+    uint64_t pos;                       // next sample this reader takes
+    uint64_t lost;
+};
+
+size_t haptic_shm_list(char (*serials)[HAPTIC_SERIAL_MAX], size_t max) {
+    HAPTIC_SHM_DIRECTORY *dir;
+    size_t num = 0;
+    unsigned n;
+
+    dir = static_cast<HAPTIC_SHM_DIRECTORY *>(shm_map(HAPTIC_SHM_LIST, sizeof(HAPTIC_SHM_DIRECTORY), false));
+    if (!dir)
+        return 0;
+    if (SHM_LOAD(dir->magic)==HAPTIC_SHM_MAGIC && dir->version==HAPTIC_SHM_VERSION && shm_alive(dir->pid)) {
+        for (n = 0; n<HAPTIC_SHM_DEVICES && num<max; n++) {
+            if (!SHM_LOAD(dir->devices[n].attached))
+                continue;
+            memcpy(serials[num], dir->devices[n].serial, HAPTIC_SERIAL_MAX);
+            serials[num++][HAPTIC_SERIAL_MAX-1] = '\0';
+        }
+    }
+    munmap(dir, sizeof(HAPTIC_SHM_DIRECTORY));
+    return num;
+}
+
+// A new reader starts at the newest sample, as a client opening the board would
+haptic_shm *haptic_shm_open(const char *serial) {
+    char first[1][HAPTIC_SERIAL_MAX];
+    std::string path;
+    haptic_shm *reader;
+    HAPTIC_SHM *shm;
+
+    if (!serial) {
+        if (!haptic_shm_list(first, 1))
+            return nullptr;
+        serial = first[0];
+    }
+    path = HAPTIC_SHM_PREFIX;
+    path += serial;
+    shm = static_cast<HAPTIC_SHM *>(shm_map(path.c_str(), sizeof(HAPTIC_SHM), false));
+    if (!shm)
+        return nullptr;
+    if (SHM_LOAD(shm->magic)!=HAPTIC_SHM_MAGIC || shm->version!=HAPTIC_SHM_VERSION || shm->ring!=HAPTIC_SHM_RING ||
+        !(reader = new (std::nothrow) haptic_shm)) {
+        munmap(shm, sizeof(HAPTIC_SHM));
+        return nullptr;
+    }
+    reader->shm = shm;
+    reader->pos = SHM_LOAD(shm->head);
+    reader->lost = 0;
+    return reader;
+}
+
+void haptic_shm_close(haptic_shm *shm) {
+    munmap(shm->shm, sizeof(HAPTIC_SHM));
+    delete shm;
+}
+
+int haptic_shm_state(haptic_shm *shm, HAPTIC_SAMPLE *last, HAPTIC_STATS *stats) {
+    HAPTIC_SAMPLE copy;
+    HAPTIC_STATS totals;
+    uint32_t seq;
+
+    do {
+        while ((seq = SHM_LOAD(shm->shm->state_seq))&1)
+            ;
+        copy = shm->shm->last;
+        totals = shm->shm->stats;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&shm->shm->state_seq, __ATOMIC_RELAXED)!=seq);
+    if (last)
+        *last = copy;
+    if (stats)
+        *stats = totals;
+    return SHM_LOAD(shm->shm->attached) && shm_alive(SHM_LOAD(shm->shm->pid));
+}
+
+void haptic_shm_clock(haptic_shm *shm, HAPTIC_CLOCK *clock) {
+    uint32_t seq;
+
+    do {
+        while ((seq = SHM_LOAD(shm->shm->state_seq))&1)
+            ;
+        *clock = shm->shm->clock;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&shm->shm->state_seq, __ATOMIC_RELAXED)!=seq);
+}
+
+// The unread samples from this reader's position up to the end of the
+// ring, in place; a reader lapped by the daemon skips to the oldest kept
+size_t haptic_shm_peek(haptic_shm *shm, const HAPTIC_SAMPLE **samples, size_t max) {
+    uint64_t head = SHM_LOAD(shm->shm->head);
+    size_t count, pos;
+
+    if (head-shm->pos>HAPTIC_SHM_RING) {
+        shm->lost += head-HAPTIC_SHM_RING-shm->pos;
+        shm->pos = head-HAPTIC_SHM_RING;
+    }
+    pos = shm->pos&(HAPTIC_SHM_RING-1);
+    count = head-shm->pos;
+    if (count>HAPTIC_SHM_RING-pos)
+        count = HAPTIC_SHM_RING-pos;
+    if (count>max)
+        count = max;
+    *samples = shm->shm->samples+pos;
+    return count;
+}
+
+size_t haptic_shm_consume(haptic_shm *shm, size_t count) {
+    uint64_t claim, stale;
+    size_t intact = count;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    claim = __atomic_load_n(&shm->shm->claim, __ATOMIC_RELAXED);
+    stale = claim>HAPTIC_SHM_RING ? claim-HAPTIC_SHM_RING:0;   // slots before this may have been overwritten
+    if (shm->pos<stale) {
+        intact = stale-shm->pos>=count ? 0:count-(size_t)(stale-shm->pos);
+        shm->lost += count-intact;
+    }
+    shm->pos += count;
+    return intact;
+}
+
+// Copies out what haptic_shm_peek() would show, twice over for a run that
+// wraps, keeping only samples still intact once the copies are done
+size_t haptic_shm_read(haptic_shm *shm, HAPTIC_SAMPLE *samples, size_t max, int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout_ms);
+    const HAPTIC_SAMPLE *ring;
+    size_t num = 0, count, intact;
+
+    while (num<max) {
+        count = haptic_shm_peek(shm, &ring, max-num);
+        if (!count) {
+            if (num || timeout_ms<=0 || std::chrono::steady_clock::now()>=deadline)
+                break;
+            std::this_thread::sleep_for(std::chrono::microseconds(SHM_SLEEP_US*10));
+            continue;
+        }
+        memcpy(samples+num, ring, count*sizeof(HAPTIC_SAMPLE));
+        intact = haptic_shm_consume(shm, count);
+        memmove(samples+num, samples+num+count-intact, intact*sizeof(HAPTIC_SAMPLE));
+        num += intact;
+    }
+    return num;
+}
+
+uint64_t haptic_shm_lost(haptic_shm *shm) {
+    return shm->lost;
+}
+
+// Takes a free mailbox slot, hands it to the daemon and waits for the
+// result; one given up on after the daemon took it is left for it to free
+int haptic_shm_control(haptic_shm *shm, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                       uint16_t wIndex, uint8_t *data, uint16_t wLength, unsigned timeout_ms) {
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start+std::chrono::milliseconds(timeout_ms);
+    HAPTIC_SHM_REQUEST *req = nullptr;
+    unsigned n;
+    int ret;
+
+    if (wLength>HAPTIC_SHM_DATA)
+        return -1;
+    while (!req) {
+        for (n = 0; n<HAPTIC_SHM_SLOTS && !req; n++)
+            if (SHM_SWAP(shm->shm->requests[n].state, HAPTIC_SLOT_FREE, HAPTIC_SLOT_CLAIMED))
+                req = &shm->shm->requests[n];
+        if (!req) {
+            if (std::chrono::steady_clock::now()>=deadline)
+                return -1;
+            std::this_thread::sleep_for(std::chrono::microseconds(SHM_SLEEP_US));
+        }
+    }
+    req->pid = getpid();
+    req->bmRequestType = bmRequestType;
+    req->bRequest = bRequest;
+    req->wValue = wValue;
+    req->wIndex = wIndex;
+    req->wLength = wLength;
+    req->timeout_ms = timeout_ms;
+    if (!(bmRequestType&0x80) && wLength)
+        memcpy(req->data, data, wLength);
+    SHM_STORE(req->state, (uint32_t)HAPTIC_SLOT_PENDING);
+
+    while (SHM_LOAD(req->state)!=HAPTIC_SLOT_DONE) {
+        auto now = std::chrono::steady_clock::now();
+
+        if (now>=deadline || !shm_alive(SHM_LOAD(shm->shm->pid))) {
+            if (SHM_SWAP(req->state, HAPTIC_SLOT_PENDING, HAPTIC_SLOT_FREE) ||
+                SHM_SWAP(req->state, HAPTIC_SLOT_BUSY, HAPTIC_SLOT_ABANDONED))
+                return -1;
+            continue;                   // it finished just now
+        }
+        if (now-start>std::chrono::microseconds(SHM_SPIN_US))
+            std::this_thread::sleep_for(std::chrono::microseconds(SHM_SLEEP_US));
+        else
+            std::this_thread::yield();
+    }
+    ret = req->result;
+    if (ret>0 && (bmRequestType&0x80))
+        memcpy(data, req->data, ret);
+    SHM_STORE(req->state, (uint32_t)HAPTIC_SLOT_FREE);
+    return ret;
+}
@@ -0,0 +1,145 @@
+/*
+	Shared-memory publishing of the boards hapticd owns
+
+	hapticd (hapticd.cpp) holds every attached board and publishes each one
+	in a POSIX shared-memory segment named HAPTIC_SHM_PREFIX plus its serial
+	number, which any number of local processes can map read-mostly:
+
+	  state     the latest sample, the stream statistics and the clock
+	            estimate (Client::sync(), which the daemon keeps up), under
+	            a sequence lock, so a reader that wants only the current
+	            position never touches the ring
+	  samples   a broadcast ring the daemon writes and never waits on; each
+	            reader keeps its own position, and a reader that falls more
+	            than a ring behind is moved up and told how many it lost
+	  requests  a few mailbox slots through which readers have the daemon
+	            run control transfers, since only it can talk to the board
+
+	Samples can be looked at in place with haptic_shm_peek(), then checked
+	and passed over with haptic_shm_consume(), or copied out with
+	haptic_shm_read(). The directory segment HAPTIC_SHM_LIST lists the serial
+	numbers being published. A segment outlives the board going away, with
+	attached cleared, and is picked up again if it comes back.
+
+	Nothing here takes a lock: fields that cross processes are read and
+	written with acquire/release atomics, and a slot changes hands by
+	compare-and-swap of its state.
+*/
+
+#ifndef _HAPTIC_SHM_H_
+#define _HAPTIC_SHM_H_
+
+#include "haptic_host.h"
+
+#define HAPTIC_SHM_PREFIX   "/haptic-"          // shm_open() name of a board's segment, then its serial number
+#define HAPTIC_SHM_LIST    "/haptic"
+#define HAPTIC_SHM_MAGIC    0x31545048          // "HPT1", written last once a segment is laid out
+#define HAPTIC_SHM_VERSION  4
+#define HAPTIC_SHM_DEVICES  16                  // boards the directory has room for
+#define HAPTIC_SHM_RING     (1<<16)             // samples, a power of 2: 13 s of the stream
+#define HAPTIC_SHM_SLOTS    8                   // control requests outstanding at once
+#define HAPTIC_SHM_DATA     4096                // longest data stage a request can carry
+
+enum {                                          // HAPTIC_SHM_REQUEST state
+    HAPTIC_SLOT_FREE,
+    HAPTIC_SLOT_CLAIMED,                        // a reader is filling it in
+    HAPTIC_SLOT_PENDING,                        // for the daemon to pick up
+    HAPTIC_SLOT_BUSY,                           // on the bus
+    HAPTIC_SLOT_DONE,                           // result is in, for the reader to collect
+    HAPTIC_SLOT_ABANDONED                       // the reader gave up; the daemon frees it when done
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t state;
+    int32_t pid;                                // of the reader that claimed it, so a dead one's can be freed
+    uint8_t bmRequestType, bRequest;
+    uint16_t wValue, wIndex, wLength;
+    uint32_t timeout_ms;
+    int32_t result;                             // bytes moved, <0 on failure
+    uint8_t data[HAPTIC_SHM_DATA];
+} HAPTIC_SHM_REQUEST;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    char serial[HAPTIC_SERIAL_MAX];
+    int32_t pid;                                // the daemon's
+    uint32_t attached;
+    uint32_t ring;                              // HAPTIC_SHM_RING when it was laid out
+    uint32_t state_seq;                         // odd while last, stats and clock are being written
+    HAPTIC_SAMPLE last;
+    HAPTIC_STATS stats;
+    HAPTIC_CLOCK clock;
+    uint64_t head;                              // samples ever written, sample n in samples[n&(ring-1)]
+    uint64_t claim;                             // head once the samples being written are in
+    HAPTIC_SHM_REQUEST requests[HAPTIC_SHM_SLOTS];
+    HAPTIC_SAMPLE samples[HAPTIC_SHM_RING];
+} HAPTIC_SHM;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    struct {
+        char serial[HAPTIC_SERIAL_MAX];
+        uint32_t attached;                      // 0 for a free entry, or a board that has gone away
+    } devices[HAPTIC_SHM_DEVICES];
+} HAPTIC_SHM_DIRECTORY;
+
+typedef struct haptic_shm haptic_shm;
+
+size_t haptic_shm_list(char (*serials)[HAPTIC_SERIAL_MAX], size_t max);   // boards attached to hapticd
+haptic_shm *haptic_shm_open(const char *serial);           // that board, or the first attached if NULL
+void haptic_shm_close(haptic_shm *shm);
+int haptic_shm_state(haptic_shm *shm, HAPTIC_SAMPLE *last, HAPTIC_STATS *stats);   // attached
+void haptic_shm_clock(haptic_shm *shm, HAPTIC_CLOCK *clock);
+size_t haptic_shm_peek(haptic_shm *shm, const HAPTIC_SAMPLE **samples, size_t max);
+size_t haptic_shm_consume(haptic_shm *shm, size_t count);  // how many of them were not overwritten meanwhile
+size_t haptic_shm_read(haptic_shm *shm, HAPTIC_SAMPLE *samples, size_t max, int timeout_ms);
+uint64_t haptic_shm_lost(haptic_shm *shm);                 // samples this reader fell too far behind for
+int haptic_shm_control(haptic_shm *shm, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+                       uint16_t wIndex, uint8_t *data, uint16_t wLength, unsigned timeout_ms);
+
+#ifdef __cplusplus
+}
+
+namespace haptic {
+
+// The daemon's side of one board's segment
+class Publisher {
+public:
+    Publisher() : shm(nullptr) {}
+    ~Publisher();
+    bool open(const std::string &serial);
+    void attach(bool attached);
+    void publish(const Sample *samples, size_t count, const Stats &stats);  // from the one event thread
+    void publish(const Clock &clock);               // from the same thread
+    bool serve(Client &client);                     // runs a pending request, if there is one
+    const std::string &name() const { return path; }
+
+private:
+    HAPTIC_SHM *shm;
+    std::string path;
+};
+
+// The daemon's side of the directory
+class Directory {
+public:
+    Directory() : dir(nullptr) {}
+    ~Directory();
+    bool open();
+    void set(const std::string &serial, bool attached);
+
+private:
+    HAPTIC_SHM_DIRECTORY *dir;
+};
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,226 @@
+/*
+	Daemon that owns every haptic knob on the host
+
+	Claims each board on the bus as it appears, told apart by its serial
+	number, and publishes it through shared memory (haptic_shm.h) so that
+	any number of local UIs and loggers share one board without contending
+	for USB: they map its segment, read the stream from the broadcast ring
+	and the latest state without copies, and have the daemon run their
+	control transfers through the segment's mailbox.
+
+	All the boards' EP1 IN streams are serviced by the one libusb event
+	thread the host library shares between transports. This daemon's own
+	loop moves each board's samples from the library's ring into its
+	segment, runs requests waiting in the mailboxes, every HAPTICD_SYNC_MS
+	takes a GET_CLOCK round trip from each board and publishes its clock
+	estimate, and every HAPTICD_SCAN_MS looks for boards that have come or
+	gone. A board that goes away keeps its segment, marked detached, and is
+	picked up again under the same name if it comes back.
+
+	Every board needs its own serial number, built into its firmware with
+	scons serial=<n>: an unprogrammed board reads FFFFFFFF, so only one of
+	them can be served at a time. Boards without a serial number, or with
+	one already taken, are left alone, and the daemon says so when it finds
+	them. Built by the host target in SConstruct:
+
+		scons host && host/hapticd
+
+	-s  serve the simulated board instead of hardware
+	-S  speed of the simulated board, 1 = real time (default 1)
+	-x  EP1 IN transfers kept in flight per board (default 8)
+	-c  capture each board's traffic to this directory, a file per
+	    attach named for its serial number and the time (haptic_capture.h)
+*/
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <map>
+#include <set>
+#include <thread>
+#include <unistd.h>
+#include "haptic_shm.h"
+
+#define HAPTICD_SCAN_MS     1000        // between looks for boards that have come or gone
+#define HAPTICD_SYNC_MS     100         // between clock syncs
+#define HAPTICD_POLL_US     100         // sleep when there was nothing to move
+#define HAPTICD_RING        (1<<16)     // per board, covering a control transfer that holds up the loop
+#define HAPTICD_BATCH       1024        // samples moved per board per pass
+#define HAPTICD_UNPROGRAMMED    "FFFFFFFF"  // the serial number of a board without one in flash (descriptors.c)
+
+typedef std::chrono::steady_clock hapticd_clock;
+
+struct Board {
+    std::string serial;
+    std::unique_ptr<haptic::Client> client;     // nullptr while it is away
+    haptic::Publisher shm;
+};
+
+static volatile sig_atomic_t hapticd_quit = 0;
+static const char *hapticd_captures = nullptr;  // -c
+
+static void hapticd_signal(int sig) {
+    (void)sig;
+    hapticd_quit = 1;
+}
+
+static Board *hapticd_find(std::vector<std::unique_ptr<Board>> &boards, const std::string &serial) {
+    for (auto &board : boards)
+        if (board->serial==serial)
+            return board.get();
+    return nullptr;
+}
+
+// Takes a board newly found (or back again) into service
+static bool hapticd_attach(std::vector<std::unique_ptr<Board>> &boards, haptic::Directory &dir,
+                           std::unique_ptr<haptic::Transport> transport, unsigned transfers) {
+    std::unique_ptr<haptic::Client> client(new haptic::Client(std::move(transport), HAPTICD_RING));
+    std::string serial = client->serial();
+    Board *board;
+
+    if (serial.empty()) {
+        printf("hapticd: ignoring a board with no serial number\n");
+        return false;
+    }
+    if (serial==HAPTICD_UNPROGRAMMED)
+        printf("hapticd: the board attaching as %s has no serial number programmed; give each board its own with "
+               "scons serial=<n>\n", serial.c_str());
+    board = hapticd_find(boards, serial);
+    if (board && board->client) {
+        printf("hapticd: ignoring a second board with serial number %s\n", serial.c_str());
+        return false;
+    }
+    if (!board) {
+        boards.emplace_back(new Board);
+        board = boards.back().get();
+        board->serial = serial;
+        if (!board->shm.open(serial)) {
+            printf("hapticd: could not create shared memory for %s\n", serial.c_str());
+            boards.pop_back();
+            return false;
+        }
+    }
+    if (hapticd_captures) {
+        char path[4096], stamp[32];
+        time_t now = time(nullptr);
+
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+        snprintf(path, sizeof(path), "%s/%s-%s.hcap", hapticd_captures, serial.c_str(), stamp);
+        if (client->record(path)<0)
+            printf("hapticd: could not create %s\n", path);
+        else
+            printf("hapticd: capturing %s to %s\n", serial.c_str(), path);
+    }
+    if (client->start(transfers)<0) {
+        printf("hapticd: could not start the stream of %s\n", serial.c_str());
+        return false;
+    }
+    board->client = std::move(client);
+    board->shm.attach(true);
+    dir.set(serial, true);
+    printf("hapticd: %s attached, published as %s\n", serial.c_str(), board->shm.name().c_str());
+    return true;
+}
+
+static void hapticd_scan(std::vector<std::unique_ptr<Board>> &boards, haptic::Directory &dir, unsigned transfers) {
+    static std::set<std::string> shared;        // serial numbers already reported as on more than one board
+    std::unique_ptr<haptic::Transport> transport;
+    std::vector<std::string> serials = haptic::list_libusb();
+    std::map<std::string, unsigned> count;
+
+    for (const std::string &serial : serials)
+        count[serial]++;
+    for (auto it = shared.begin(); it!=shared.end(); )
+        it = (count.find(*it)==count.end() || count[*it]<2) ? shared.erase(it):std::next(it);
+    for (const auto &entry : count)
+        if (entry.second>1 && !entry.first.empty() && shared.insert(entry.first).second)
+            printf("hapticd: %u boards have serial number %s, serving one; give each its own with scons serial=<n>\n",
+                   entry.second, entry.first.c_str());
+    for (const std::string &serial : serials) {
+        Board *board = hapticd_find(boards, serial);
+
+        if (serial.empty() || (board && board->client))
+            continue;
+        transport = haptic::open_libusb(serial.c_str());
+        if (transport)
+            hapticd_attach(boards, dir, std::move(transport), transfers);
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::unique_ptr<Board>> boards;
+    haptic::Directory dir;
+    HAPTIC_SAMPLE samples[HAPTICD_BATCH];
+    hapticd_clock::time_point next_scan, next_sync;
+    double speed = 1.;
+    unsigned transfers = 8;
+    int opt, sim = 0, busy;
+    size_t num;
+
+    while ((opt = getopt(argc, argv, "sS:x:c:"))!=-1) {
+        switch (opt) {
+            case 's': sim = 1; break;
+            case 'S': speed = atof(optarg); break;
+            case 'x': transfers = (unsigned)atoi(optarg); break;
+            case 'c': hapticd_captures = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-s] [-S speed] [-x transfers] [-c directory]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (!dir.open()) {
+        fprintf(stderr, "hapticd: could not create %s\n", HAPTIC_SHM_LIST);
+        return 1;
+    }
+    signal(SIGINT, hapticd_signal);
+    signal(SIGTERM, hapticd_signal);
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    if (sim && !hapticd_attach(boards, dir, haptic::open_sim(speed), transfers)) {
+        fprintf(stderr, "hapticd: no simulated board\n");
+        return 1;
+    }
+    next_scan = hapticd_clock::now();
+    next_sync = next_scan;
+
+    while (!hapticd_quit) {
+        busy = 0;
+        for (auto &board : boards) {
+            if (!board->client)
+                continue;
+            num = board->client->read(samples, HAPTICD_BATCH, 0);
+            if (num) {
+                board->shm.publish(samples, num, board->client->stats());
+                busy = 1;
+            }
+            if (!board->client->attached()) {
+                board->client.reset();
+                board->shm.attach(false);
+                dir.set(board->serial, false);
+                printf("hapticd: %s detached\n", board->serial.c_str());
+            } else if (board->shm.serve(*board->client)) {
+                busy = 1;
+            }
+        }
+        if (hapticd_clock::now()>=next_sync) {
+            for (auto &board : boards)
+                if (board->client && board->client->sync()>=0)
+                    board->shm.publish(board->client->clock());
+            next_sync += std::chrono::milliseconds(HAPTICD_SYNC_MS);
+        }
+        if (hapticd_clock::now()>=next_scan) {
+            if (!sim)
+                hapticd_scan(boards, dir, transfers);
+            for (auto &board : boards)
+                board->shm.attach(board->client!=nullptr);  // frees slots of readers that died
+            next_scan += std::chrono::milliseconds(HAPTICD_SCAN_MS);
+        }
+        if (!busy)
+            std::this_thread::sleep_for(std::chrono::microseconds(HAPTICD_POLL_US));
+    }
+    printf("hapticd: exiting\n");
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include "sim.h"
+#include "haptic.h"
+#include "effects.h"
+#include "telemetry.h"
+#include "usb.h"
+#include "simdev.h"
+
+static void (*stream_callback)(void *ctx, uint8_t *data, uint16_t length);
+static void *stream_ctx;
+
+static void simdev_stream(uint8_t *data, uint16_t length) {
+    if (stream_callback)
+        stream_callback(stream_ctx, data, length);
+}
+
+void simdev_open(void (*stream)(void *ctx, uint8_t *data, uint16_t length), void *ctx) {
+    stream_callback = stream;
+    stream_ctx = ctx;
+
+    sim_init();
+    initChip();
+    initInt();
+    initMotor();
+    init_telemetry();
+    initControl();
+    InitUSB();
+    usbhost_stream(1, simdev_stream);
+    usbhost_enumerate();
+}
+
+void simdev_run(double seconds) {
+    long steps = (long)(seconds/SIM_DT+.5);
+
+    while (steps-->0) {
+#ifndef USB_INTERRUPT
+        ServiceUSB();
+#endif
+        telemetry_service();
+        effects_service();
+        control_storeCalib();
+        sim_step();
+    }
+}
+
+double simdev_time(void) {
+    return sim_time();
+}
+
+int simdev_configured(void) {
+    return USB_USWSTAT==CONFIG_STATE;
+}
+
+int simdev_busy(void) {
+    return usbhost_busy();
+}
+
+int simdev_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data) {
+    return usbhost_control(bmRequestType, bRequest, wValue, wIndex, wLength, data);
+}
+
+int simdev_result(void) {
+    return usbhost_result();
+}
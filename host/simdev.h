@@ -0,0 +1,33 @@
+/*
+	The simulated board as a USB device for the host library
+
+	Wraps the firmware running against sim/ the way bench.c does, so that
+	host code can be exercised with no hardware: simdev_open() powers the
+	board up and has the simulated host enumerate it, simdev_run() advances
+	simulated time, running main()'s background work once per SIM_DT, and
+	the control transfer and EP1 IN stream calls go through sim/usbhost.c.
+	There is one simulated board per process.
+*/
+
+#ifndef _SIMDEV_H_
+#define _SIMDEV_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void simdev_open(void (*stream)(void *ctx, uint8_t *data, uint16_t length), void *ctx);
+void simdev_run(double seconds);
+double simdev_time(void);
+int simdev_configured(void);
+int simdev_busy(void);          // a control transfer, or enumeration, is under way
+int simdev_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data);
+int simdev_result(void);        // bytes moved by the last control transfer, -1 if it failed
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,294 @@
+#include "haptic_host.h"
+
+#ifdef HAPTIC_LIBUSB
+
+#include <chrono>
+#include <thread>
+#include <libusb.h>
+
+namespace haptic {
+
+#define LIBUSB_TRANSFERS_MAX    32
+#define LIBUSB_EVENT_MS         100     // how long the event thread blocks before checking to exit
+
+// Every transport in the process shares one libusb context and one thread
+// handling its events, so several boards are serviced by a single event
+// loop; the last transport closed stops it.
+class UsbContext {
+public:
+    static std::shared_ptr<UsbContext> get();      // nullptr if libusb will not start
+    ~UsbContext();
+
+    libusb_context *ctx;
+
+private:
+    UsbContext() : ctx(nullptr), running(false) {}
+    void events();
+
+    std::thread thread;
+    std::atomic<bool> running;
+
+    static std::mutex lock;
+    static std::weak_ptr<UsbContext> shared;
+};
+
+std::mutex UsbContext::lock;
+std::weak_ptr<UsbContext> UsbContext::shared;
+
+std::shared_ptr<UsbContext> UsbContext::get() {
+    std::lock_guard<std::mutex> hold(lock);
+    std::shared_ptr<UsbContext> usb = shared.lock();
+
+    if (usb)
+        return usb;
+    usb.reset(new UsbContext);
+    if (libusb_init(&usb->ctx)<0) {
+        usb->ctx = nullptr;
+        return nullptr;
+    }
+    usb->running = true;
+    usb->thread = std::thread(&UsbContext::events, usb.get());
+    shared = usb;
+    return usb;
+}
+
+UsbContext::~UsbContext() {
+    if (running) {
+        running = false;
+        thread.join();
+    }
+    if (ctx)
+        libusb_exit(ctx);
+}
+
+void UsbContext::events() {
+    timeval tv = {0, LIBUSB_EVENT_MS*1000};
+
+    while (running)
+        libusb_handle_events_timeout_completed(ctx, &tv, nullptr);
+}
+
+// The serial number of a board just opened, empty if it has none
+static std::string libusb_serial(libusb_device *dev, libusb_device_handle *handle) {
+    libusb_device_descriptor desc;
+    unsigned char serial[HAPTIC_SERIAL_MAX];
+
+    if (libusb_get_device_descriptor(dev, &desc)<0 || !desc.iSerialNumber ||
+        libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, serial, sizeof(serial))<0)
+        return std::string();
+    return std::string((char *)serial);
+}
+
+// Opens and claims the first board with that serial number (any, if
+// nullptr) that no other process has claimed already; or, with found,
+// only collects the serial numbers of all of them
+static libusb_device_handle *libusb_find(libusb_context *ctx, const char *serial, std::vector<std::string> *found) {
+    libusb_device **list;
+    libusb_device_handle *handle = nullptr;
+    libusb_device_descriptor desc;
+    ssize_t num, n;
+
+    num = libusb_get_device_list(ctx, &list);
+    for (n = 0; n<num && !handle; n++) {
+        if (libusb_get_device_descriptor(list[n], &desc)<0 || desc.idVendor!=HAPTIC_VID || desc.idProduct!=HAPTIC_PID)
+            continue;
+        if (libusb_open(list[n], &handle)<0) {
+            handle = nullptr;
+            continue;
+        }
+        if (found) {
+            found->push_back(libusb_serial(list[n], handle));
+        } else if (!serial || libusb_serial(list[n], handle)==serial) {
+            libusb_set_auto_detach_kernel_driver(handle, 1);
+            if (libusb_set_configuration(handle, 1)==0 && libusb_claim_interface(handle, 0)==0)
+                break;
+        }
+        libusb_close(handle);
+        handle = nullptr;
+    }
+    if (num>=0)
+        libusb_free_device_list(list, 1);
+    return handle;
+}
+
+// EP1 IN is kept busy with several asynchronous bulk transfers, each one
+// resubmitted from its own completion on the event thread, so the device
+// always has a buffer to send the next packet into. Control transfers use
+// the synchronous API from the caller's thread, which libusb runs
+// alongside the event thread. A transfer that comes back stalled is not
+// resubmitted, since the halt would only stall it again; the next read()
+// or control() clears the halt from the caller's thread, which the
+// firmware takes as the cue to restart the stream, and resubmits it.
+class LibusbTransport : public Transport {
+public:
+    LibusbTransport() : handle(nullptr), gone(false), inflight(0), stalled(0), deliver(nullptr), deliver_ctx(nullptr),
+                        streaming(false), num(0) {}
+    ~LibusbTransport();
+    bool open(const char *serial);
+
+    int control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                uint8_t *data, uint16_t wLength, unsigned timeout_ms) override;
+    int start(unsigned count, Deliver deliver, void *ctx) override;
+    void stop() override;
+    bool attached() const override { return !gone; }
+    void recover() override;
+
+private:
+    static void LIBUSB_CALL complete(libusb_transfer *transfer);
+
+    std::shared_ptr<UsbContext> usb;
+    libusb_device_handle *handle;
+    std::atomic<bool> gone;
+
+    std::atomic<int> inflight;
+    std::atomic<unsigned> stalled;      // transfers held back for the halt to be cleared, a bit each
+    Deliver deliver;
+    void *deliver_ctx;
+    std::atomic<bool> streaming;
+    libusb_transfer *transfers[LIBUSB_TRANSFERS_MAX];
+    uint8_t buffers[LIBUSB_TRANSFERS_MAX][HAPTIC_PACKET];
+    unsigned num;
+};
+
+bool LibusbTransport::open(const char *serial) {
+    usb = UsbContext::get();
+    if (!usb)
+        return false;
+    handle = libusb_find(usb->ctx, serial, nullptr);
+    return handle!=nullptr;
+}
+
+LibusbTransport::~LibusbTransport() {
+    stop();
+    if (handle) {
+        libusb_release_interface(handle, 0);
+        libusb_close(handle);
+    }
+}
+
+void LIBUSB_CALL LibusbTransport::complete(libusb_transfer *transfer) {
+    LibusbTransport *self = static_cast<LibusbTransport *>(transfer->user_data);
+    unsigned n;
+
+    if (transfer->status==LIBUSB_TRANSFER_COMPLETED && transfer->actual_length)
+        self->deliver(self->deliver_ctx, transfer->buffer, transfer->actual_length);
+    if (transfer->status==LIBUSB_TRANSFER_NO_DEVICE)
+        self->gone = true;
+    if (self->streaming && transfer->status==LIBUSB_TRANSFER_STALL) {
+        for (n = 0; n<self->num; n++)
+            if (self->transfers[n]==transfer)
+                self->stalled |= 1u<<n;
+    } else if (self->streaming && transfer->status!=LIBUSB_TRANSFER_NO_DEVICE &&
+               transfer->status!=LIBUSB_TRANSFER_CANCELLED && libusb_submit_transfer(transfer)==0) {
+        return;
+    }
+    self->inflight--;
+}
+
+// Clears a halt on EP1 IN, which the event thread cannot wait on, and puts
+// the transfers it stalled back in flight
+void LibusbTransport::recover() {
+    unsigned mask, n;
+
+    if (!streaming || !stalled)
+        return;
+    if (libusb_clear_halt(handle, HAPTIC_STREAM_EP)==LIBUSB_ERROR_NO_DEVICE)
+        gone = true;
+    mask = stalled.exchange(0);
+    for (n = 0; n<num; n++) {
+        if (!(mask&(1u<<n)))
+            continue;
+        inflight++;
+        if (libusb_submit_transfer(transfers[n])<0)
+            inflight--;
+    }
+}
+
+int LibusbTransport::control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                             uint8_t *data, uint16_t wLength, unsigned timeout_ms) {
+    int ret = libusb_control_transfer(handle, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout_ms);
+
+    if (ret==LIBUSB_ERROR_NO_DEVICE)
+        gone = true;
+    return ret;
+}
+
+int LibusbTransport::start(unsigned count, Deliver deliver, void *ctx) {
+    unsigned n;
+
+    if (count>LIBUSB_TRANSFERS_MAX)
+        count = LIBUSB_TRANSFERS_MAX;
+    this->deliver = deliver;
+    deliver_ctx = ctx;
+    streaming = true;
+    for (num = 0; num<count; num++) {
+        transfers[num] = libusb_alloc_transfer(0);
+        if (!transfers[num])
+            break;
+        libusb_fill_bulk_transfer(transfers[num], handle, HAPTIC_STREAM_EP, buffers[num], HAPTIC_PACKET,
+                                  complete, this, 0);
+    }
+    for (n = 0; n<num; n++) {
+        inflight++;
+        if (libusb_submit_transfer(transfers[n])<0)
+            inflight--;
+    }
+    if (!inflight) {
+        stop();
+        return -1;
+    }
+    return 0;
+}
+
+// Cancels whatever is in flight and waits for the event thread to hand each one back
+void LibusbTransport::stop() {
+    unsigned n;
+
+    if (!streaming)
+        return;
+    streaming = false;
+    for (n = 0; n<num; n++)
+        libusb_cancel_transfer(transfers[n]);
+    while (inflight>0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    for (n = 0; n<num; n++)
+        libusb_free_transfer(transfers[n]);
+    num = 0;
+    stalled = 0;
+}
+
+std::vector<std::string> list_libusb() {
+    std::shared_ptr<UsbContext> usb = UsbContext::get();
+    std::vector<std::string> found;
+
+    if (usb)
+        libusb_find(usb->ctx, nullptr, &found);
+    return found;
+}
+
+std::unique_ptr<Transport> open_libusb(const char *serial) {
+    std::unique_ptr<LibusbTransport> usb(new LibusbTransport);
+
+    if (!usb->open(serial))
+        return nullptr;
+    return std::unique_ptr<Transport>(usb.release());
+}
+
+}
+
+#else
+
+namespace haptic {
+
+std::vector<std::string> list_libusb() {
+    return std::vector<std::string>();
+}
+
+std::unique_ptr<Transport> open_libusb(const char *serial) {
+    (void)serial;
+    return nullptr;                     // built without libusb
+}
+
+}
+
+#endif
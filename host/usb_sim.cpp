@@ -0,0 +1,169 @@
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include "haptic_host.h"
+#include "simdev.h"
+
+namespace haptic {
+
+#define SIM_CHUNK       1e-4            // simulated seconds run between looks at requests, well under a round trip
+#define SIM_ENUMERATE   0.1             // give up on enumeration after this much simulated time
+
+static std::atomic<bool> opened(false); // the firmware's globals make it one board per process
+
+// The simulated board runs on its own thread, standing in for the bus;
+// control transfers are handed to it and the caller sleeps until it is done.
+class SimTransport : public Transport {
+public:
+    explicit SimTransport(double speed);
+    ~SimTransport();
+    bool configured() const { return ready; }
+
+    int control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                uint8_t *data, uint16_t wLength, unsigned timeout_ms) override;
+    int start(unsigned transfers, Deliver deliver, void *ctx) override;
+    void stop() override;
+
+private:
+    enum { IDLE, QUEUED, ACTIVE, DONE };
+
+    static void stream(void *ctx, uint8_t *data, uint16_t length);
+    void run();
+    void service();
+
+    double speed;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::atomic<bool> ready;
+
+    std::mutex lock;                    // guards the request and the stream hook
+    std::condition_variable changed;
+    int state;
+    uint8_t bmRequestType, bRequest;    // as queued
+    uint16_t wValue, wIndex, wLength;
+    uint8_t buffer[4096];               // the data stage, so an abandoned request never touches the caller's
+    int result;
+
+    Deliver deliver;
+    void *deliver_ctx;
+};
+
+SimTransport::SimTransport(double speed)
+    : speed(speed), running(true), ready(false), state(IDLE), result(0), deliver(nullptr), deliver_ctx(nullptr) {
+    thread = std::thread(&SimTransport::run, this);
+    std::unique_lock<std::mutex> hold(lock);
+    changed.wait(hold, [this] { return ready || !running; });
+}
+
+SimTransport::~SimTransport() {
+    running = false;
+    thread.join();
+    opened = false;
+}
+
+void SimTransport::stream(void *ctx, uint8_t *data, uint16_t length) {
+    SimTransport *self = static_cast<SimTransport *>(ctx);
+
+    if (self->deliver)                  // otherwise it is drained and lost, as if nobody were reading
+        self->deliver(self->deliver_ctx, data, length);
+}
+
+// Sim thread: hands a queued request to the simulated host, collects a finished one
+void SimTransport::service() {
+    std::lock_guard<std::mutex> hold(lock);
+
+    if (state==ACTIVE && !simdev_busy()) {
+        result = simdev_result();
+        state = DONE;
+        changed.notify_all();
+    }
+    if (state==QUEUED && !simdev_busy()) {
+        simdev_control(bmRequestType, bRequest, wValue, wIndex, wLength, buffer);
+        state = ACTIVE;
+    }
+}
+
+void SimTransport::run() {
+    std::chrono::steady_clock::time_point wall;
+    double t0;
+
+    simdev_open(stream, this);
+    while (!simdev_configured() && simdev_time()<SIM_ENUMERATE)
+        simdev_run(SIM_CHUNK);
+    {
+        std::lock_guard<std::mutex> hold(lock);
+        ready = simdev_configured();
+        if (!ready)
+            running = false;
+        changed.notify_all();
+    }
+    t0 = simdev_time();
+    wall = std::chrono::steady_clock::now();
+
+    while (running) {
+        service();
+        {
+            std::lock_guard<std::mutex> hold(lock);     // the stream hook runs in here
+            simdev_run(SIM_CHUNK);
+        }
+        if (speed>0.)
+            std::this_thread::sleep_until(wall+std::chrono::duration<double>((simdev_time()-t0)/speed));
+    }
+}
+
+int SimTransport::control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                          uint8_t *data, uint16_t wLength, unsigned timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now()+std::chrono::milliseconds(timeout_ms);
+    std::unique_lock<std::mutex> hold(lock);
+    int ret;
+
+    if (wLength>sizeof(buffer))
+        return -1;
+    // One at a time, like EP0; an abandoned request still has to finish first
+    if (!changed.wait_until(hold, deadline, [this] { return state==IDLE || state==DONE || !running; }) || !running)
+        return -1;
+    this->bmRequestType = bmRequestType;
+    this->bRequest = bRequest;
+    this->wValue = wValue;
+    this->wIndex = wIndex;
+    this->wLength = wLength;
+    if (!(bmRequestType&0x80) && wLength)
+        memcpy(buffer, data, wLength);
+    state = QUEUED;
+    if (!changed.wait_until(hold, deadline, [this] { return state==DONE; }))
+        return -1;                      // left to finish on its own
+    ret = result;
+    if (ret>0 && (bmRequestType&0x80))
+        memcpy(data, buffer, ret);
+    state = IDLE;
+    changed.notify_all();
+    return ret;
+}
+
+int SimTransport::start(unsigned transfers, Deliver deliver, void *ctx) {
+    std::lock_guard<std::mutex> hold(lock);
+
+    (void)transfers;                    // the simulated host keeps EP1 IN polled all the time
+    deliver_ctx = ctx;
+    this->deliver = deliver;
+    return 0;
+}
+
+void SimTransport::stop() {
+    std::lock_guard<std::mutex> hold(lock);
+
+    deliver = nullptr;
+}
+
+std::unique_ptr<Transport> open_sim(double speed) {
+    std::unique_ptr<SimTransport> sim;
+
+    if (opened.exchange(true))
+        return nullptr;
+    sim.reset(new SimTransport(speed));
+    if (!sim->configured())
+        return nullptr;                 // the destructor lets the next open try again
+    return std::unique_ptr<Transport>(sim.release());
+}
+
+}
@@ -0,0 +1,131 @@
+#include "observer.h"
+
+#define OBSERVER_HALF       ((int32_t)1<<(OBSERVER_SHIFT-1))    // half a count, the boundaries of the count's cell
+#define OBSERVER_RESIDUAL   ((int32_t)2<<OBSERVER_SHIFT)        // residuals are clamped to this, so corrections fit in 32 bits
+
+void observer_init(_OBSERVER *self, int16_t alpha, int16_t beta, uint16_t rate) {
+    self->alpha = alpha;
+    self->beta = beta;
+    self->rate = rate;
+    self->pos = 0;
+    self->vel = 0;
+    self->acc = 0;
+    self->dir = 0;
+    self->ticks = 0xFFFF;           // so the first edge says nothing about speed
+    self->window_ticks = 0;
+    self->window_counts = 0;
+    self->emf_sum = 0;
+    self->gain = 0;
+    self->gain_n = 0;
+}
+
+void observer_setGain(_OBSERVER *self, int32_t gain) {
+    self->gain = gain;
+    self->gain_n = gain ? OBSERVER_GAIN_WINDOWS:0;
+}
+
+// An edge: the shaft is on the boundary it crossed, and if the edges since
+// the window opened all went the same way, it has gone window_counts in
+// window_ticks, against the back EMF summed over them
+static void observer_edge(_OBSERVER *self, int16_t delta) {
+    int32_t r, mean, ratio;
+    int16_t dir = (delta>0) ? 1:-1;
+
+    if (dir!=self->dir || self->window_ticks>OBSERVER_WINDOW_MAX) {
+        self->window_ticks = 0;     // open a window at this edge
+        self->window_counts = 0;
+        self->emf_sum = 0;
+    } else {
+        self->window_counts += delta;
+        if (self->window_ticks>=OBSERVER_WINDOW_MIN || self->window_counts>=OBSERVER_WINDOW_COUNTS ||
+            self->window_counts<=-OBSERVER_WINDOW_COUNTS) {
+            mean = self->emf_sum/self->window_ticks;
+            if (mean>=OBSERVER_EMF_MIN || mean<=-OBSERVER_EMF_MIN) {
+                ratio = ((int32_t)self->window_counts<<OBSERVER_EMF_SHIFT)/self->emf_sum;
+                if (ratio>0) {      // the back EMF agreed on the direction
+                    if (!self->gain_n)
+                        self->gain = ratio;
+                    else
+                        self->gain += (ratio-self->gain)>>OBSERVER_GAIN_LEARN;
+                    if (self->gain_n<OBSERVER_GAIN_WINDOWS)
+                        self->gain_n++;
+                }
+            }
+            self->window_ticks = 0;
+            self->window_counts = 0;
+            self->emf_sum = 0;
+        }
+    }
+    self->dir = dir;
+
+    r = -dir*OBSERVER_HALF-self->pos;
+    if (r>OBSERVER_RESIDUAL)
+        r = OBSERVER_RESIDUAL;
+    else if (r<-OBSERVER_RESIDUAL)
+        r = -OBSERVER_RESIDUAL;
+    self->pos += (self->alpha*r)>>OBSERVER_GAIN_SHIFT;
+    if (self->gain_n<OBSERVER_GAIN_WINDOWS) // after that the back EMF has the velocity, and the edges its gain
+        self->vel += ((self->beta*r)>>OBSERVER_GAIN_SHIFT)/self->ticks;
+    self->ticks = 0;
+}
+
+// No edge: the shaft is still inside the count, at most a count from where the last edge left it
+static void observer_bound(_OBSERVER *self) {
+    int32_t edge, bound;
+
+    if (self->pos<=OBSERVER_HALF && self->pos>=-OBSERVER_HALF)
+        return;
+    edge = (self->pos>0) ? OBSERVER_HALF:-OBSERVER_HALF;
+    self->pos = edge;
+    if (edge==-self->dir*OBSERVER_HALF)     // back at the edge it came in by
+        bound = 0;
+    else
+        bound = ((int32_t)1<<OBSERVER_SHIFT)/self->ticks;
+    if (self->vel>bound)
+        self->vel = bound;
+    else if (self->vel<-bound)
+        self->vel = -bound;
+}
+
+void observer_update(_OBSERVER *self, int16_t delta, int16_t emf) {
+    int32_t last = self->vel;
+
+    // Predict, then move the estimate to be relative to the new count
+    self->pos += self->vel;
+    self->pos -= (int32_t)delta<<OBSERVER_SHIFT;
+    if (self->ticks<0xFFFF)
+        self->ticks++;
+
+    // Back EMF is speed every tick, once the edges have shown what it is worth
+    self->emf_sum += emf;
+    if (self->window_ticks<0xFFFF)
+        self->window_ticks++;
+    if (self->gain_n>=OBSERVER_GAIN_WINDOWS)
+        self->vel += (((self->gain*emf)>>(OBSERVER_EMF_SHIFT-OBSERVER_SHIFT))-self->vel)>>OBSERVER_EMF_WEIGHT;
+
+    if (delta)
+        observer_edge(self, delta);
+    else
+        observer_bound(self);
+
+    // Acceleration is what the velocity did, smoothed
+    self->acc += (((self->vel-last)<<(OBSERVER_ACC_SHIFT-OBSERVER_SHIFT))-self->acc)>>OBSERVER_ACC_WEIGHT;
+}
+
+static int16_t observer_saturate(int32_t val) {
+    if (val>32767)
+        return 32767;
+    if (val<-32767)
+        return -32767;
+    return (int16_t)val;
+}
+
+int16_t observer_vel(_OBSERVER *self) {
+    return observer_saturate(((self->vel>>2)*self->rate)>>(OBSERVER_SHIFT-2));
+}
+
+int16_t observer_acc(_OBSERVER *self) {
+    int32_t scale = ((uint32_t)self->rate*self->rate)>>12;
+
+    return observer_saturate(((self->acc>>8)*scale)>>(OBSERVER_ACC_SHIFT+OBSERVER_ACC_OUT_SHIFT-20));
+}
@@ -0,0 +1,71 @@
+/*
+	Position, velocity and acceleration observer
+
+	The encoder only says when the shaft crosses from one count to the
+	next, so at the speeds a hand turns the knob the count changes every
+	few tens of control ticks and differencing it gives nothing but steps.
+	This tracker runs every tick and takes each counted edge as an exact
+	measurement of the shaft position (the boundary between the two
+	counts) and, between edges, the count as a bound on it: an estimate
+	that coasts past the next boundary without an edge is pulled back to
+	it, which is what slows it down when the shaft stops.
+
+	The back EMF, sampled every tick, says how fast the shaft turns but
+	not in counts, so the gain between the two is learned from windows of
+	edges going the same way (counts moved over back EMF summed), and once
+	a few windows agree each tick's back EMF pulls the velocity toward it.
+	Until then, velocity is corrected at edges alone. Acceleration is the
+	velocity's smoothed change; a tracked one would only follow the edges.
+
+	The position is kept relative to the count, so it never overflows
+	however far the shaft turns, with OBSERVER_SHIFT fractional bits;
+	velocity in counts per tick with OBSERVER_SHIFT fractional bits and
+	acceleration in counts per tick^2 with OBSERVER_ACC_SHIFT. Gains have
+	OBSERVER_GAIN_SHIFT fractional bits, alpha and beta up to 1.
+*/
+
+#ifndef _OBSERVER_H_
+#define _OBSERVER_H_
+
+#include <stdint.h>
+
+#define OBSERVER_SHIFT          16      // fractional bits of position and velocity
+#define OBSERVER_ACC_SHIFT      24      // fractional bits of acceleration
+#define OBSERVER_GAIN_SHIFT     8       // fractional bits of alpha and beta
+#define OBSERVER_EMF_SHIFT      24      // fractional bits of the back EMF gain
+#define OBSERVER_WINDOW_MIN     16      // the back EMF gain is learned over at least this many ticks...
+#define OBSERVER_WINDOW_COUNTS  16      // ...or counts, edge to edge, so the edges' timing hardly matters
+#define OBSERVER_WINDOW_MAX     1000    // edges further apart than this say nothing about the gain...
+#define OBSERVER_EMF_MIN        64      // ...and so does less mean back EMF over a window
+#define OBSERVER_GAIN_LEARN     4       // each window moves the gain 1/16 of the way
+#define OBSERVER_GAIN_WINDOWS   8       // windows before the back EMF is trusted
+#define OBSERVER_EMF_WEIGHT     1       // each tick's back EMF moves the velocity 1/2 of the way
+#define OBSERVER_ACC_WEIGHT     5       // acceleration is the velocity's change over about 32 ticks
+#define OBSERVER_ACC_OUT_SHIFT  4       // observer_acc() is in 16 counts/s^2, so a hand's worth fits
+
+#define OBSERVER_GAIN(x)    ((int16_t)((x)*(1<<OBSERVER_GAIN_SHIFT)+.5))    // alpha or beta from a real number
+
+typedef struct {
+    int16_t alpha;                  // position correction per unit residual at an edge
+    int16_t beta;                   // velocity correction per unit residual per tick since the last edge
+    uint16_t rate;                  // ticks per second
+    int32_t pos;                    // estimate less the count
+    int32_t vel;
+    int32_t acc;
+    int16_t dir;                    // of the last edge
+    uint16_t ticks;                 // since it, saturating
+    uint16_t window_ticks;          // since the window the gain is learned over opened
+    int16_t window_counts;          // edges since then
+    int32_t emf_sum;                // back EMF since then
+    int32_t gain;                   // velocity per unit back EMF
+    uint16_t gain_n;                // windows it has been learned from, saturating
+} _OBSERVER;
+
+void observer_init(_OBSERVER *self, int16_t alpha, int16_t beta, uint16_t rate);
+void observer_setGain(_OBSERVER *self, int32_t gain);  // a back EMF gain learned before, trusted from the start
+void observer_update(_OBSERVER *self, int16_t delta, int16_t emf);    // counts moved this tick, and the
+                                                                    // back EMF less its midpoint
+int16_t observer_vel(_OBSERVER *self);                 // counts/s
+int16_t observer_acc(_OBSERVER *self);                 // counts/s^2 >> OBSERVER_ACC_OUT_SHIFT
+
+#endif
@@ -0,0 +1,58 @@
+#include "hal.h"
+#include "pid.h"
+
+static int16_t pid_clamp(int16_t val) {
+    if (val>PID_INPUT_MAX)
+        return PID_INPUT_MAX;
+    if (val<-PID_INPUT_MAX)
+        return -PID_INPUT_MAX;
+    return val;
+}
+
+void pid_init(_PID *self, int16_t kp, int16_t ki, int16_t kd, int16_t out_min, int16_t out_max) {
+    self->out_min = out_min;
+    self->out_max = out_max;
+    pid_setGains(self, kp, ki, kd);
+    pid_reset(self, 0);
+}
+
+void pid_setGains(_PID *self, int16_t kp, int16_t ki, int16_t kd) {
+    self->kp = kp;
+    self->ki = ki;
+    self->kd = kd;
+}
+
+void pid_reset(_PID *self, int16_t measurement) {
+    self->integ = 0;
+    self->last = measurement;
+    self->out = 0;
+}
+
+int16_t pid_update(_PID *self, int16_t setpoint, int16_t measurement) {
+    int16_t error = pid_clamp(setpoint-measurement);
+    int16_t delta = pid_clamp(measurement-self->last);
+    int32_t integ_max = (int32_t)self->out_max<<PID_SHIFT;
+    int32_t integ_min = (int32_t)self->out_min<<PID_SHIFT;
+    int32_t acc;
+
+    self->last = measurement;
+
+    // Freeze the integrator while the output is pinned in the error's direction
+    if (!((error>0 && self->out>=self->out_max) || (error<0 && self->out<=self->out_min))) {
+        self->integ += HAL_MULSS(self->ki, error);
+        if (self->integ>integ_max)
+            self->integ = integ_max;
+        else if (self->integ<integ_min)
+            self->integ = integ_min;
+    }
+
+    // |kp*error|, |kd*delta| < 2^29 and |integ| <= 2^21, so the sum fits in 32 bits
+    acc = (HAL_MULSS(self->kp, error)+self->integ)>>PID_SHIFT;
+    acc -= HAL_MULSS(self->kd, delta);
+    if (acc>self->out_max)
+        acc = self->out_max;
+    else if (acc<self->out_min)
+        acc = self->out_min;
+    self->out = (int16_t)acc;
+    return self->out;
+}
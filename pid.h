@@ -0,0 +1,44 @@
+/*
+	Fixed-point PID controller
+
+	Inputs (setpoint, measurement) are plain integers such as encoder counts.
+	The output is a Q15 effort, +-32767 being full drive in either direction.
+	kp and ki are signed 16-bit values with PID_SHIFT fractional bits; kd is
+	an integer, since the measurement rate in counts per tick is small at
+	kHz loop rates. Each term is one 16x16->32 multiply (the PIC24's MUL.SS
+	on the target), summed in 32 bits and saturated to [out_min, out_max].
+
+	The derivative acts on the measurement rather than the error so setpoint
+	steps do not kick the output. The integrator is stored in output units,
+	clamped to the output range and frozen while the output is saturated in
+	the direction the error would push it (anti-windup), so gains can be
+	changed at run time without a bump.
+*/
+
+#ifndef _PID_H_
+#define _PID_H_
+
+#include <stdint.h>
+
+#define PID_SHIFT       6           // fractional bits of kp and ki
+#define PID_INPUT_MAX   16383       // error and measurement deltas are clamped to this
+
+#define PID_GAIN(x)     ((int16_t)((x)*(1<<PID_SHIFT)+((x)<0 ? -.5:.5)))   // kp or ki from a real number
+
+typedef struct {
+    int16_t kp;                     // Q15 effort per count, PID_SHIFT fractional bits
+    int16_t ki;                     // ...per count per tick
+    int16_t kd;                     // Q15 effort per count/tick of measurement rate, integer
+    int16_t out_min;
+    int16_t out_max;
+    int16_t out;                    // last output
+    int16_t last;                   // last measurement
+    int32_t integ;                  // integrator, output units << PID_SHIFT
+} _PID;
+
+void pid_init(_PID *self, int16_t kp, int16_t ki, int16_t kd, int16_t out_min, int16_t out_max);
+void pid_setGains(_PID *self, int16_t kp, int16_t ki, int16_t kd);
+void pid_reset(_PID *self, int16_t measurement);
+int16_t pid_update(_PID *self, int16_t setpoint, int16_t measurement);
+
+#endif
@@ -0,0 +1,109 @@
+#include "hal.h"
+#include "prof.h"
+
+#ifdef HAPTIC_PROF
+
+typedef struct {
+    uint16_t min;
+    uint16_t max;
+    uint32_t count;
+    uint32_t total;
+    uint16_t hist[PROF_BUCKETS];
+} _PROF;
+
+static _PROF sections[PROF_SECTIONS];
+static uint16_t bases[PROF_SECTIONS];
+static const uint16_t shifts[PROF_SECTIONS] = {4, 4, 5, 6, 7, 4};   // bucket widths of 16 to 128 cycles
+static uint16_t last;                   // TMR4 at the last prof_period()
+static uint16_t started;
+
+void init_prof(uint16_t period) {
+    uint16_t n;
+
+    T4CON = 0x0000;                     // stop Timer4, 1:1 from Fcy
+    TMR4 = 0;
+    PR4 = 0xFFFF;                       // free-running
+    for (n = 0; n<PROF_SECTIONS; n++) {
+        bases[n] = 0;
+        prof_clear(n);
+    }
+    bases[PROF_PERIOD] = period-(PROF_BUCKETS/2<<shifts[PROF_PERIOD]);
+    started = 0;
+    T4CON = 0x8000;
+}
+
+void prof_record(uint16_t section, uint16_t cycles) {
+    _PROF *self = &sections[section];
+    uint16_t bucket;
+
+    if (!self->count || cycles<self->min)
+        self->min = cycles;
+    if (cycles>self->max)
+        self->max = cycles;
+    self->count++;
+    self->total += cycles;
+    bucket = (cycles<bases[section]) ? 0:(cycles-bases[section])>>shifts[section];
+    if (bucket>=PROF_BUCKETS)
+        bucket = PROF_BUCKETS-1;
+    if (self->hist[bucket]!=0xFFFF)     // saturate rather than wrap
+        self->hist[bucket]++;
+}
+
+void prof_period(uint16_t section) {
+    uint16_t now = TMR4;
+
+    if (started)
+        prof_record(section, now-last);
+    last = now;
+    started = 1;
+}
+
+// Callers at a lower priority than the section's own must hold off interrupts
+void prof_clear(uint16_t section) {
+    _PROF *self = &sections[section];
+    uint16_t n;
+
+    self->min = 0;
+    self->max = 0;
+    self->count = 0;
+    self->total = 0;
+    for (n = 0; n<PROF_BUCKETS; n++)
+        self->hist[n] = 0;
+}
+
+static uint8_t *prof_put16(uint8_t *ptr, uint16_t val) {
+    *ptr++ = val&0xFF;
+    *ptr++ = val>>8;
+    return ptr;
+}
+
+static uint8_t *prof_put32(uint8_t *ptr, uint32_t val) {
+    ptr = prof_put16(ptr, (uint16_t)val);
+    return prof_put16(ptr, (uint16_t)(val>>16));
+}
+
+// Packs PROF_REPORT bytes into buf; returns 0 for an unknown section
+uint16_t prof_read(uint16_t section, uint8_t *buf, uint16_t clear) {
+    _PROF copy;
+    uint16_t n;
+
+    if (section>=PROF_SECTIONS)
+        return 0;
+    HAL_DISABLE_INTERRUPTS();           // the sections are written from every priority
+    copy = sections[section];
+    if (clear)
+        prof_clear(section);
+    HAL_ENABLE_INTERRUPTS();
+
+    buf = prof_put16(buf, copy.min);
+    buf = prof_put16(buf, copy.max);
+    buf = prof_put32(buf, copy.count);
+    buf = prof_put32(buf, copy.total);
+    buf = prof_put16(buf, bases[section]);
+    buf = prof_put16(buf, shifts[section]);
+    for (n = 0; n<PROF_BUCKETS; n++)
+        buf = prof_put16(buf, copy.hist[n]);
+    return PROF_REPORT;
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*
+	Hot-path cycle instrumentation
+
+	With HAPTIC_PROF defined, PROF_START() and PROF_END() around a section
+	time it in instruction cycles on free-running Timer4, and prof_period()
+	times the interval between successive calls, for the control loop's
+	jitter. Each section keeps min/max/count/total and a PROF_BUCKETS-bucket
+	histogram in RAM: bucket n counts durations from base+(n<<shift), the
+	last one everything above. prof_read() packs a section for the GET_PROF
+	vendor request (PROF_REPORT bytes, little-endian: min, max, count,
+	total, base, shift, then the buckets) and optionally clears it.
+
+	Without HAPTIC_PROF the macros and init_prof() compile to nothing.
+	Sections are kept under 65536 cycles (4 ms) so Timer4 wraps harmlessly.
+*/
+
+#ifndef _PROF_H_
+#define _PROF_H_
+
+#include <stdint.h>
+
+#define PROF_ENCODER    0           // encoder_serviceInterrupt()
+#define PROF_ADC        1           // adc_serviceInterrupt()
+#define PROF_PID        2           // pid()
+#define PROF_CONTROL    3           // the whole control tick, _ADC1Interrupt()
+#define PROF_USB        4           // ServiceUSB()
+#define PROF_PERIOD     5           // control tick to control tick
+#define PROF_SECTIONS   6
+
+#define PROF_BUCKETS    16
+#define PROF_REPORT     (16+2*PROF_BUCKETS)
+
+#ifdef HAPTIC_PROF
+
+#define PROF_DECLARE(t)         uint16_t t
+#define PROF_START(t)           ((t) = TMR4)
+#define PROF_END(section, t)    prof_record((section), TMR4-(t))
+
+void init_prof(uint16_t period);    // nominal control period in cycles, to centre its histogram
+void prof_record(uint16_t section, uint16_t cycles);
+void prof_period(uint16_t section);
+void prof_clear(uint16_t section);
+uint16_t prof_read(uint16_t section, uint8_t *buf, uint16_t clear);
+
+#else
+
+#define PROF_DECLARE(t)
+#define PROF_START(t)
+#define PROF_END(section, t)
+#define init_prof(period)
+#define prof_period(section)
+
+#endif
+
+#endif
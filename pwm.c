@@ -0,0 +1,38 @@
+#include "hal.h"
+#include "pwm.h"
+
+void init_pwm(_PIN *pin) {
+    oc_pwm(&oc1, pin, &timer2, PWM_FREQ, 0);    // routes OC1 to the pin, held low until pwm_start
+}
+
+void pwm_start(void) {
+    T2CON = 0x0000;             // stop both timers, 1:1 from Fcy
+    T3CON = 0x0000;
+    OC1R = PWM_PERIOD;          // compare values past the period never match, output stays low
+    OC1RS = PWM_PERIOD;
+    OC1CON1bits.OCTSEL = 0;     // OC1 timer counts with Timer2...
+    OC1CON2bits.SYNCSEL = 0x0C; // ...and restarts on its period match
+    OC1CON1bits.OCM = 5;        // double compare, continuous: high from OC1R to OC1RS
+    PR2 = PWM_PERIOD-1;
+    PR3 = PWM_PERIOD/2-1;       // matches mid-on (TMR2 = PWM_PERIOD/2) and mid-off (TMR2 = 0)
+    TMR2 = 0;
+    TMR3 = 0;
+    T2CON = 0x8000;             // Timer3 starts an instruction later, negligible next to the windows
+    T3CON = 0x8000;
+}
+
+// Best called just after the mid-off trigger: OC1R and OC1RS take effect
+// immediately, and the on window has not started yet.
+void pwm_write(uint16_t duty) {
+    uint16_t on = ((uint32_t)duty*PWM_PERIOD)>>16;
+
+    if (on>PWM_PERIOD-PWM_OFF_MIN)
+        on = PWM_PERIOD-PWM_OFF_MIN;
+    if (!on) {
+        OC1R = PWM_PERIOD;      // never matches, driver stays disabled
+        OC1RS = PWM_PERIOD;
+        return;
+    }
+    OC1R = (PWM_PERIOD-on)/2;
+    OC1RS = (PWM_PERIOD+on)/2;
+}
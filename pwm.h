@@ -0,0 +1,27 @@
+/*
+	Center-aligned ultrasonic PWM with synchronized ADC triggers
+
+	The driver's nD2 enable is driven by OC1 in double-compare mode, clocked
+	and restarted by Timer2 at PWM_FREQ, so each period the bridge drives
+	for a window centred on the half period and floats around the period
+	boundary. Timer3, from the same instruction clock, runs at twice
+	PWM_FREQ and is started together with Timer2, so its period matches,
+	which trigger the ADC (see adc.h), fall exactly mid-on and mid-off
+	whatever the duty: currents are sampled while driving and back EMF
+	while floating. PWM_OFF_MIN keeps an off window for the EMF sample.
+*/
+
+#ifndef _PWM_H_
+#define _PWM_H_
+
+#include <stdint.h>
+
+#define PWM_FREQ        20000L      // above hearing, the driver's limit (long: the rates derived from it overflow an int)
+#define PWM_PERIOD      800         // instruction cycles (Fcy = 16 MHz)
+#define PWM_OFF_MIN     80          // shortest floating window around the EMF sample (cycles)
+
+void init_pwm(_PIN *pin);
+void pwm_start(void);
+void pwm_write(uint16_t duty);      // fraction of the period driving, 0-65535
+
+#endif
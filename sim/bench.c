@@ -0,0 +1,314 @@
+/*
+	Host-native benchmark of the haptic firmware
+
+	Runs haptic.c, usb.c and descriptors.c against the simulated board for a
+	fixed stretch of simulated time and reports host cycles spent in each hot
+	path together with how well the loop held position. Built by the
+	haptic_sim target in SConstruct:
+
+		scons haptic_sim && ./haptic_sim -t 2 -p 1 -f 5
+
+	-t  simulated seconds to run (default 2)
+	-p  GET_VALS polling period of the simulated host in ms, 0 = none (default 1)
+	-f  peak external torque from the user's hand in mN*m, 1 Hz (default 5)
+	-a  ms after power-up before the host starts enumerating (default 0)
+	-o  EMF reading with the shaft still, for a unit off the default 32800
+	    (the bench notes measured 33536 to 33664)
+	-D  drift of that reading in counts/s
+	-m  have the host filter EMF with SET_FILTER type,param (see filter.h)
+	    before anything else
+	-e  have the host load a texture of detents between two walls first
+	-r  have the host upload a repeating 1 Hz, +/-20 count sine trajectory
+	    (101 points, 7 EP0 OUT packets) in one transfer and report how
+	    closely ENC_COUNT_VAL followed SETPOINT_VAL
+	-c  have the host stream telemetry channels mask,ticks per packet with
+	    SET_TELEMETRY (see telemetry.h) before anything else
+
+	The control loop starts at power-up, before the host enumerates; the
+	time to its first tick and to SET_CONFIGURATION are reported.
+
+	The deflection is how far the hand moved the knob off the point it was
+	powered up at, in true encoder transitions; the count error is how far
+	ENC_POS_VAL drifted from those transitions. The edge rate and the
+	observer's velocity and acceleration are compared with the shaft's.
+	Last, each filter type is stepped from the top of the range to the
+	bottom, which it must follow down without rising or wrapping.
+
+	One pass of main()'s background loop is run per SIM_DT of simulated time;
+	the control loop runs from its timer callback as it does on the PIC.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "hal.h"
+#include "adc.h"
+#include "effects.h"
+#include "filter.h"
+#include "haptic.h"
+#include "prof.h"
+#include "telemetry.h"
+#include "trajectory.h"
+#include "usb.h"
+
+#define GET_VALS    2
+#define CLEAR_EFFECTS   7
+#define ADD_EFFECT      8
+#define COMMIT_EFFECTS  9
+#define SET_TRAJECTORY  10
+#define SET_FILTER      12
+#define SET_TELEMETRY   17
+#define SINE_POINTS     101
+#define CMD_PER_AMP (0.0024*2400./3.3*65536./8.)   // CURRENT_CMD_VAL counts per A, as haptic.c scales FB
+
+
+#ifndef USB_INTERRUPT
+static SIM_PROF prof_usb = {"ServiceUSB"};
+#endif
+static SIM_PROF prof_telemetry = {"telemetry_service"};
+static SIM_PROF prof_effects = {"effects_service"};
+
+static const uint8_t texture[][8] = {      // -e: type, pos, width, strength, little-endian
+    {EFFECT_DETENTS, 0, 1000&0xFF, 1000>>8, 20, 0, 2000&0xFF, 2000>>8},      // every 20 counts, 140mA peak
+    {EFFECT_WALL_LOW, 0, 970&0xFF, 970>>8, 0, 0, 0, 400*64>>8},             // 400 per count past 970...
+    {EFFECT_WALL_HIGH, 0, 1030&0xFF, 1030>>8, 0, 0, 0, 400*64>>8},          // ...and 1030
+};
+
+static struct {
+    long packets;
+    long samples;
+    long bytes;
+    long gaps;                      // samples missing between consecutive tick stamps
+    long bad;                       // packets whose samples do not come out to their length
+    uint16_t dropped;
+    uint8_t sequence;
+    uint16_t time;
+} stream;
+
+// Walks the varints of every sample, so a packet that does not decode to
+// exactly its own length shows up
+static void stream_packet(uint8_t *data, uint16_t length) {
+    uint16_t n, c, pos = TELEMETRY_HEADER, time = data[4]|(data[5]<<8);
+
+    if (length<TELEMETRY_HEADER || data[0]!=TELEMETRY_VERSION) {
+        stream.bad++;
+        return;
+    }
+    if (stream.packets && data[1]!=(uint8_t)(stream.sequence+1))
+        stream.gaps++;
+    stream.sequence = data[1];
+    stream.dropped = data[6]|(data[7]<<8);
+    if (stream.samples)
+        stream.gaps += (uint16_t)(time-stream.time-1);
+    for (n = 0; n<data[2]; n++)
+        for (c = 0; c<TELEMETRY_CHANNELS; c++)
+            if (data[3]&(1<<c))
+                while (pos<length && (data[pos++]&0x80))
+                    ;
+    if (pos!=length)
+        stream.bad++;
+    stream.time = time+data[2]-1;
+    stream.samples += data[2];
+    stream.bytes += length;
+    stream.packets++;
+}
+
+// Each filter, at its longest, settled high and then stepped all the way
+// down must fall and never rise on the way to the bottom: a negative step
+// taken unsigned runs the sum up instead, until the output wraps
+static void filter_check(void) {
+    static const uint16_t types[][2] = {{FILTER_IIR, 6}, {FILTER_MEAN, 3}, {FILTER_MEDIAN, 7}};
+    static const char *names[] = {"IIR", "mean", "median"};
+    _FILTER f;
+    uint16_t n, m, out, last, rose;
+
+    printf("filters, falling 65472 to 0 over 1000 sets:");
+    for (n = 0; n<sizeof(types)/sizeof(types[0]); n++) {
+        filter_init(&f, types[n][0], types[n][1], 65472);
+        for (m = 0, out = last = 65472, rose = 0; m<1000; m++, last = out)
+            if ((out = filter_update(&f, 0))>last)
+                rose = 1;
+        printf(" %s %u%s", names[n], out, (out || rose) ? " FAILED":"");
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    double duration = 2., poll = 1e-3, torque = 5e-3;
+    double next_poll = 0., attach = 0., t_control = -1., t_config = -1., err = 0., err2 = 0., dev, dev2 = 0., vel, vel2 = 0., cur, cur2 = 0.;
+    double obs, obs2 = 0., acc, acc2 = 0., omega = 0., shaft_acc = 0.;
+    long steps, n, edge0, polls = 0, failed = 0, vels = 0;
+    int32_t pos0;
+    uint8_t vals[8];
+    int opt, effects = 0, loading = -1, trajectory = 0, filter = -1, filter_n = 0, channels = -1, hold = 0;
+    uint8_t sine[SINE_POINTS*TRAJECTORY_POINT];
+    double track, track2 = 0.;
+    long tracks = 0;
+
+    while ((opt = getopt(argc, argv, "t:p:f:a:o:D:m:c:er"))!=-1) {
+        switch (opt) {
+            case 't': duration = atof(optarg); break;
+            case 'p': poll = atof(optarg)*1e-3; break;
+            case 'f': torque = atof(optarg)*1e-3; break;
+            case 'e': effects = 1; break;
+            case 'r': trajectory = 1; break;
+            case 'a': attach = atof(optarg)*1e-3; break;
+            case 'o': sim_emf_mid = atof(optarg); break;
+            case 'D': sim_emf_drift = atof(optarg); break;
+            case 'm': sscanf(optarg, "%d,%d", &filter, &filter_n); break;
+            case 'c': sscanf(optarg, "%i,%d", &channels, &hold); break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds] [-p ms] [-f mNm] [-a ms] [-o emf] [-D counts/s] [-m type,param] [-e] [-r]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    for (n = 0; n<SINE_POINTS; n++) {
+        uint16_t pos = (uint16_t)lround(1000.+20.*sin(2.*M_PI*n/(SINE_POINTS-1)));
+
+        sine[n*TRAJECTORY_POINT] = (n*10)&0xFF;         // every 10 position-loop ticks
+        sine[n*TRAJECTORY_POINT+1] = (n*10)>>8;
+        sine[n*TRAJECTORY_POINT+2] = pos&0xFF;
+        sine[n*TRAJECTORY_POINT+3] = pos>>8;
+    }
+
+    sim_init();
+
+    initChip();
+    initInt();
+    initMotor();
+    init_telemetry();
+    initControl();
+    InitUSB();
+    usbhost_stream(1, stream_packet);
+
+    edge0 = sim_plant.edge;
+    pos0 = ENC_POS_VAL;
+    steps = (long)(duration/SIM_DT+.5);
+    for (n = 0; n<steps; n++) {
+        sim_plant.tau_ext = torque*sin(2.*M_PI*sim_time());
+
+#ifndef USB_INTERRUPT
+        SIM_TIME(prof_usb, ServiceUSB());
+#endif
+        SIM_TIME(prof_telemetry, telemetry_service());
+        SIM_TIME(prof_effects, effects_service());
+        control_storeCalib();
+        if (attach>=0. && sim_time()>=attach) {
+            usbhost_enumerate();
+            attach = -1.;
+        }
+        if (t_control<0. && sim_prof_adc.calls)
+            t_control = sim_time();
+        if (t_config<0. && USB_USWSTAT==CONFIG_STATE) {
+            t_config = sim_time();
+            next_poll = t_config;       // the host polls from when it has a device
+        }
+
+        if (channels>=0 && USB_USWSTAT==CONFIG_STATE && !usbhost_busy()) {
+            usbhost_control(0x40, SET_TELEMETRY, channels, hold, 0, NULL);
+            channels = -1;
+        } else if (filter>=0 && USB_USWSTAT==CONFIG_STATE && !usbhost_busy()) {
+            usbhost_control(0x40, SET_FILTER, filter|(filter_n<<8), ADC_EMF, 0, NULL);
+            filter = -1;
+        } else if (effects && USB_USWSTAT==CONFIG_STATE && !usbhost_busy() && loading<=(int)(sizeof(texture)/8)) {
+            if (usbhost_result()<0)
+                failed++;
+            if (loading<0)
+                usbhost_control(0x40, CLEAR_EFFECTS, 0, 0, 0, NULL);
+            else if (loading<(int)(sizeof(texture)/8))
+                usbhost_control(0x40, ADD_EFFECT, 0, 0, 8, (uint8_t *)texture[loading]);
+            else
+                usbhost_control(0x40, COMMIT_EFFECTS, 0, 0, 0, NULL);
+            loading++;
+        } else if (trajectory==1 && USB_USWSTAT==CONFIG_STATE && !usbhost_busy()) {
+            usbhost_control(0x40, SET_TRAJECTORY, 1, 0, sizeof(sine), sine);
+            trajectory = 2;
+        } else if (poll>0. && USB_USWSTAT==CONFIG_STATE && !usbhost_busy() && sim_time()>=next_poll) {
+            if (usbhost_result()<0)
+                failed++;
+            usbhost_control(0xC0, GET_VALS, 0, 0, 8, vals);
+            polls++;
+            next_poll += poll;
+        }
+
+        omega = sim_plant.omega;
+        sim_step();
+        // The shaft's acceleration smoothed as much as the observer's is, since stick-slip makes it a train of spikes
+        shaft_acc += ((sim_plant.omega-omega)/SIM_DT*PLANT_EDGES_PER_RAD-shaft_acc)*SIM_DT*OBS.rate/(1<<OBSERVER_ACC_WEIGHT);
+
+        dev = (double)(sim_plant.edge-edge0);
+        dev2 += dev*dev;
+        err = (double)(ENC_POS_VAL-pos0)-dev;
+        err2 += err*err;
+        if (t_control>=0.) {
+            vel = ENC_VEL_VAL-sim_plant.omega*PLANT_EDGES_PER_RAD;
+            vel2 += vel*vel;
+            obs = OBS_VEL_VAL-sim_plant.omega*PLANT_EDGES_PER_RAD;
+            obs2 += obs*obs;
+            acc = OBS_ACC_VAL*(double)(1<<OBSERVER_ACC_OUT_SHIFT)-shaft_acc;
+            acc2 += acc*acc;
+            cur = CURRENT_CMD_VAL/CMD_PER_AMP-sim_plant.i;
+            cur2 += cur*cur;
+            vels++;
+            if (trajectory) {
+                track = (double)ENC_COUNT_VAL-SETPOINT_VAL;
+                track2 += track*track;
+                tracks++;
+            }
+        }
+    }
+
+    printf("simulated %.3f s, %ld steps of %.0f us\n", sim_time(), steps, SIM_DT*1e6);
+    printf("host cycles per call:\n");
+#ifdef USB_INTERRUPT
+    sim_prof_report(&sim_prof_usb);
+#else
+    sim_prof_report(&prof_usb);
+#endif
+    sim_prof_report(&prof_telemetry);
+    if (effects)
+        sim_prof_report(&prof_effects);
+    sim_prof_report(&sim_prof_adc);     // runs the control loop
+    sim_prof_report(&sim_prof_ic1);
+    printf("control:\n");
+    printf("  first tick %.3f ms after power-up, ", t_control*1e3);
+    if (t_config>=0.)
+        printf("host configured the device at %.3f ms\n", t_config*1e3);
+    else
+        printf("host never configured the device\n");
+    printf("  %.0f Hz loop rate\n", sim_prof_adc.calls/(sim_time()-t_control));
+#ifdef HAPTIC_PROF
+    {
+        uint8_t report[PROF_REPORT];        // as GET_PROF returns it
+
+        prof_read(PROF_PERIOD, report, 0);
+        printf("  loop period on Timer4: min %u, max %u, mean %.1f cycles\n", report[0]|(report[1]<<8),
+               report[2]|(report[3]<<8), (double)(report[8]|(report[9]<<8)|((uint32_t)report[10]<<16)|((uint32_t)report[11]<<24))/
+               (report[4]|(report[5]<<8)|((uint32_t)report[6]<<16)|((uint32_t)report[7]<<24)));
+    }
+#endif
+    printf("  EMF midpoint calibrated to %u, thresholds %u and %u; true %.0f\n", EMF_CAL.mid, EMF_CAL.low, EMF_CAL.high,
+           sim_emf_mid+sim_emf_drift*sim_time());
+    printf("  shaft angle %.4f rad, speed %.3f rad/s, current %.3f A\n", sim_plant.theta, sim_plant.omega, sim_plant.i);
+    printf("  ENC_POS_VAL %ld, ENC_COUNT_VAL %u, deflection: final %ld, rms %.2f\n", (long)ENC_POS_VAL, ENC_COUNT_VAL,
+           sim_plant.edge-edge0, sqrt(dev2/steps));
+    printf("  count error vs true transitions: final %.0f, rms %.2f\n", err, sqrt(err2/steps));
+    printf("  edge rate ENC_VEL_VAL %d counts/s, true %.0f, rms error %.1f\n", ENC_VEL_VAL,
+           sim_plant.omega*PLANT_EDGES_PER_RAD, vels ? sqrt(vel2/vels):0.);
+    printf("  observer OBS_VEL_VAL %d counts/s, rms error %.1f; OBS_ACC_VAL %d, rms error %.0f counts/s^2\n", OBS_VEL_VAL,
+           vels ? sqrt(obs2/vels):0., OBS_ACC_VAL, vels ? sqrt(acc2/vels):0.);
+    printf("  current command %.1f mA, true %.1f mA, rms error %.1f mA\n", CURRENT_CMD_VAL/CMD_PER_AMP*1e3,
+           sim_plant.i*1e3, vels ? sqrt(cur2/vels)*1e3:0.);
+    if (trajectory)
+        printf("  trajectory: SETPOINT_VAL %u, tracking rms error %.2f counts\n", SETPOINT_VAL,
+               tracks ? sqrt(track2/tracks):0.);
+    printf("usb: %s, %ld GET_VALS issued, %ld failed\n", USB_USWSTAT==CONFIG_STATE ? "configured":"not configured", polls, failed);
+    printf("  EP1 stream: %ld packets, %ld samples, %ld missing, %u dropped on the device, %ld malformed\n",
+           stream.packets, stream.samples, stream.gaps, stream.dropped, stream.bad);
+    printf("  %.1f samples, %.1f bytes per packet\n", stream.packets ? (double)stream.samples/stream.packets:0.,
+           stream.packets ? (double)stream.bytes/stream.packets:0.);
+    filter_check();
+    return 0;
+}
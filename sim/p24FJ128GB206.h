@@ -0,0 +1,228 @@
+/*
+	Simulated SFR file for the PIC24FJ128GB206
+
+	Stands in for the xc16 device header when the firmware is built natively
+	(HAPTIC_SIM). Only the registers and bits the firmware touches are
+	modelled. Registers are plain memory except where the hardware has side
+	effects the firmware relies on: U1IR is write-one-to-clear and pops the
+	U1STAT FIFO, which is emulated by routing writes through a latch that is
+	applied on the next read of U1IRbits. Likewise reading IC1BUF pops the
+	input capture FIFO and IC1CON1bits.ICBNE reflects what is left in it.
+*/
+
+#ifndef _SIM_P24FJ128GB206_H_
+#define _SIM_P24FJ128GB206_H_
+
+#include <stdint.h>
+
+// Configuration words and compiler builtins have no meaning on the host
+#define _CONFIG1(x)
+#define _CONFIG2(x)
+#define _CONFIG3(x)
+#define _CONFIG4(x)
+#define __builtin_nop()         do {} while (0)
+#define __builtin_write_OSCCONL(x)  (OSCCON = (OSCCON&0xFF00)|((x)&0xFF))
+
+extern volatile uint16_t OSCCON;
+
+/*************************************************
+			Change notification / interrupts
+**************************************************/
+
+typedef struct {
+    unsigned CN0IE:1, CN1IE:1, CN2IE:1, CN3IE:1, CN4IE:1, CN5IE:1, CN6IE:1, CN7IE:1;
+    unsigned CN8IE:1, CN9IE:1, CN10IE:1, CN11IE:1, CN12IE:1, CN13IE:1, CN14IE:1, CN15IE:1;
+} CNEN1BITS;
+
+typedef struct {
+    unsigned INT0IF:1, IC1IF:1, OC1IF:1, T1IF:1, :9, AD1IF:1, :2;
+} IFS0BITS;
+
+typedef struct {
+    unsigned INT0IE:1, IC1IE:1, OC1IE:1, T1IE:1, :9, AD1IE:1, :2;
+} IEC0BITS;
+
+typedef struct {
+    unsigned INT0IP:3, :1, IC1IP:3, :1, OC1IP:3, :1, T1IP:3, :1;
+} IPC0BITS;
+
+typedef struct {
+    unsigned SI2C1IF:1, MI2C1IF:1, CMIF:1, CNIF:1, :12;
+} IFS1BITS;
+
+typedef struct {
+    unsigned SI2C1IE:1, MI2C1IE:1, CMIE:1, CNIE:1, :12;
+} IEC1BITS;
+
+typedef struct {
+    unsigned T3IP:3, :1, SPF1IP:3, :1, SPI1IP:3, :1, U1RXIP:3, :1;
+} IPC2BITS;
+
+typedef struct {
+    unsigned U1TXIP:3, :1, AD1IP:3, :1, :8;
+} IPC3BITS;
+
+typedef struct {
+    unsigned SI2C1IP:3, :1, MI2C1IP:3, :1, CMIP:3, :1, CNIP:3, :1;
+} IPC4BITS;
+
+typedef struct {
+    unsigned :6, USB1IF:1, :9;
+} IFS5BITS;
+
+typedef struct {
+    unsigned :6, USB1IE:1, :9;
+} IEC5BITS;
+
+typedef struct {
+    unsigned :8, USB1IP:3, :5;
+} IPC21BITS;
+
+extern volatile CNEN1BITS CNEN1bits;
+extern volatile IFS0BITS IFS0bits;
+extern volatile IEC0BITS IEC0bits;
+extern volatile IPC0BITS IPC0bits;
+extern volatile IFS1BITS IFS1bits;
+extern volatile IEC1BITS IEC1bits;
+extern volatile IPC2BITS IPC2bits;
+extern volatile IPC3BITS IPC3bits;
+extern volatile IPC4BITS IPC4bits;
+extern volatile IFS5BITS IFS5bits;
+extern volatile IEC5BITS IEC5bits;
+extern volatile IPC21BITS IPC21bits;
+
+/*************************************************
+			Timer 5 / input capture 1
+**************************************************/
+
+typedef struct {
+    unsigned IC1R:6, :2, IC2R:6, :2;
+} RPINR7BITS;
+
+typedef struct {
+    unsigned ICM:3, ICBNE:1, ICOV:1, ICI:2, :3, ICTSEL:3, ICSIDL:1, :2;
+} IC1CON1BITS;
+
+typedef union {
+    uint16_t w;
+    IC1CON1BITS bits;
+} SIM_IC1CON1;
+
+extern volatile RPINR7BITS RPINR7bits;
+extern volatile uint16_t T5CON, PR5, TMR5, IC1CON2;
+extern volatile SIM_IC1CON1 sim_IC1CON1;
+
+volatile SIM_IC1CON1 *sim_ic1con1(void);    // refreshes ICBNE from the capture FIFO
+uint16_t sim_ic1buf(void);                  // pops the oldest capture
+
+#define IC1CON1     (sim_IC1CON1.w)
+#define IC1CON1bits (sim_ic1con1()->bits)
+#define IC1BUF      sim_ic1buf()
+
+/*************************************************
+			Timers 2/3/4 / output compare 1
+**************************************************/
+
+typedef struct {
+    unsigned OCM:3, TRIGMODE:1, OCFLT0:1, :5, OCTSEL:3, OCSIDL:1, :2;
+} OC1CON1BITS;
+
+typedef struct {
+    unsigned SYNCSEL:5, OCTRIS:1, TRIGSTAT:1, OCTRIG:1, :4, OCINV:1, FLTTRIEN:1, FLTOUT:1, FLTMD:1;
+} OC1CON2BITS;
+
+extern volatile uint16_t T2CON, T3CON, PR2, PR3, TMR2, TMR3;
+extern volatile uint16_t T4CON, PR4, TMR4;
+extern volatile OC1CON1BITS OC1CON1bits;
+extern volatile OC1CON2BITS OC1CON2bits;
+extern volatile uint16_t OC1R, OC1RS;
+
+/*************************************************
+			ADC
+**************************************************/
+
+typedef struct {
+    unsigned DONE:1, SAMP:1, ASAM:1, :2, SSRC:3, FORM:2, :3, ADSIDL:1, :1, ADON:1;
+} AD1CON1BITS;
+
+typedef struct {
+    unsigned ALTS:1, BUFM:1, SMPI:4, :1, BUFS:1, :2, CSCNA:1, :2, VCFG:3;
+} AD1CON2BITS;
+
+typedef union {
+    uint16_t w;
+    AD1CON1BITS bits;
+} SIM_AD1CON1;
+
+typedef union {
+    uint16_t w;
+    AD1CON2BITS bits;
+} SIM_AD1CON2;
+
+extern volatile SIM_AD1CON1 sim_AD1CON1;
+extern volatile SIM_AD1CON2 sim_AD1CON2;
+extern volatile uint16_t AD1CON3, AD1CHS, AD1CSSL;
+extern volatile unsigned int sim_ADC1BUF[16];
+
+#define AD1CON1     (sim_AD1CON1.w)
+#define AD1CON1bits (sim_AD1CON1.bits)
+#define AD1CON2     (sim_AD1CON2.w)
+#define AD1CON2bits (sim_AD1CON2.bits)
+#define ADC1BUF0    sim_ADC1BUF[0]
+#define ADC1BUF8    sim_ADC1BUF[8]
+
+/*************************************************
+			USB module
+**************************************************/
+
+typedef struct {
+    unsigned USBEN:1, PPBRST:1, RESUME:1, HOSTEN:1, USBRST:1, PKTDIS:1, SE0:1, JSTATE:1, :8;
+} U1CONBITS;
+
+typedef struct {
+    unsigned URSTIF:1, UERRIF:1, SOFIF:1, TRNIF:1, IDLEIF:1, RESUMEIF:1, ATTACHIF:1, STALLIF:1, :8;
+} U1IRBITS;
+
+typedef struct {
+    unsigned VBUSDIS:1, VBUSCHG:1, OTGEN:1, VBUSON:1, DMPULDWN:1, DPPULDWN:1, DMPULUP:1, DPPULUP:1, :8;
+} U1OTGCONBITS;
+
+typedef struct {
+    unsigned USBPWR:1, USUSPND:1, :2, USBBUSY:1, :2, UACTPND:1, :8;
+} U1PWRCBITS;
+
+typedef union {
+    uint16_t w;
+    U1IRBITS bits;
+} SIM_U1IR;
+
+extern volatile U1CONBITS U1CONbits;
+extern volatile U1OTGCONBITS U1OTGCONbits;
+extern volatile U1PWRCBITS U1PWRCbits;
+extern volatile uint16_t U1ADDR, U1EIR, U1IE, U1STAT, U1CNFG1, U1CNFG2, U1BDTP1;
+extern volatile uint16_t U1FRML, U1FRMH;
+extern volatile unsigned int sim_U1EP[16];
+extern volatile uint16_t sim_U1IR_clear;
+
+volatile SIM_U1IR *sim_u1ir(void);      // applies pending write-one-to-clear, returns the flags
+
+#define U1IR        sim_U1IR_clear
+#define U1IRbits    (sim_u1ir()->bits)
+
+#define U1EP0       sim_U1EP[0]
+#define U1EP1       sim_U1EP[1]
+#define U1EP2       sim_U1EP[2]
+#define U1EP3       sim_U1EP[3]
+
+/*************************************************
+			Port B (SHOW_ENUM_STATUS)
+**************************************************/
+
+typedef struct {
+    unsigned RB0:1, RB1:1, RB2:1, RB3:1, RB4:1, RB5:1, :10;
+} PORTBBITS;
+
+extern volatile uint16_t TRISB, PORTB;
+extern volatile PORTBBITS PORTBbits;
+
+#endif
@@ -0,0 +1,41 @@
+#include <math.h>
+#include "plant.h"
+
+void plant_init(_PLANT *self) {
+    self->i = 0.;
+    self->omega = 0.;
+    self->theta = 0.;
+    self->v = 0.;
+    self->tau_ext = 0.;
+    self->edge = 0;
+}
+
+double plant_emf(_PLANT *self) {
+    return PLANT_KE*self->omega;
+}
+
+void plant_step(_PLANT *self, double v, double dt) {
+    double tau, omega;
+
+    self->v = v;
+    self->i += dt*(v-PLANT_R*self->i-plant_emf(self))/PLANT_L;
+
+    tau = PLANT_KE*self->i-PLANT_B*self->omega+self->tau_ext;
+    if (self->omega==0. && fabs(tau)<=PLANT_TC) {
+        omega = 0.;                             // stiction holds the shaft
+    } else {
+        omega = self->omega+dt*(tau-((self->omega>0. || (self->omega==0. && tau>0.)) ? PLANT_TC:-PLANT_TC))/PLANT_J;
+        if (self->omega!=0. && (omega>0.)!=(self->omega>0.))
+            omega = 0.;                         // friction cannot reverse the shaft within one step
+    }
+    self->omega = omega;
+    self->theta += dt*omega;
+
+    if (self->theta>PLANT_THETA_LIM) {          // end stops
+        self->theta = PLANT_THETA_LIM;
+        self->omega = 0.;
+    } else if (self->theta<-PLANT_THETA_LIM) {
+        self->theta = -PLANT_THETA_LIM;
+        self->omega = 0.;
+    }
+}
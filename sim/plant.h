@@ -0,0 +1,35 @@
+/*
+	DC motor + back-EMF + encoder plant for the haptic simulator
+
+	Models the knob as a brushed DC motor driven by the H-bridge, with
+	electrical (R, L, back-EMF) and mechanical (inertia, viscous and coulomb
+	friction, end stops) dynamics. Constants are in SI units.
+*/
+
+#ifndef _PLANT_H_
+#define _PLANT_H_
+
+#define PLANT_VBAT          12.0     // H-bridge supply (V)
+#define PLANT_R             4.5      // armature resistance (ohm)
+#define PLANT_L             1.0e-3   // armature inductance (H)
+#define PLANT_KE            0.012    // back-EMF / torque constant (V*s/rad, N*m/A)
+#define PLANT_J             5.0e-6   // rotor + knob inertia (kg*m^2)
+#define PLANT_B             2.0e-6   // viscous friction (N*m*s/rad)
+#define PLANT_TC            2.0e-4   // coulomb friction (N*m)
+#define PLANT_THETA_LIM     1.5      // end stops at +/- this angle (rad)
+#define PLANT_EDGES_PER_RAD 100.0    // encoder transitions per radian
+
+typedef struct {
+    double i;           // armature current (A)
+    double omega;       // shaft speed (rad/s)
+    double theta;       // shaft angle (rad)
+    double v;           // applied terminal voltage (V)
+    double tau_ext;     // external torque from the user's hand (N*m)
+    long edge;          // encoder transition index
+} _PLANT;
+
+void plant_init(_PLANT *self);
+void plant_step(_PLANT *self, double v, double dt);
+double plant_emf(_PLANT *self);
+
+#endif
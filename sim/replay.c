@@ -0,0 +1,404 @@
+/*
+	Replay of a captured stream through the haptic firmware
+
+	Feeds a capture (host/haptic_capture.h, from host/haptic_record or
+	Client::record()) back through the control code compiled for the host,
+	tick by tick and as fast as it will go, and reports where what the
+	firmware makes of the recorded inputs differs from what the board
+	reported, so a field capture becomes a regression and performance test.
+	Built by the haptic_replay target in SConstruct:
+
+		scons haptic_replay && ./haptic_replay -w 5000 knob.hcap
+
+	-w  ticks after the start, and after a gap in the stream, before a
+	    difference counts, while the observer and the EMF calibration
+	    settle from where the replay picked them up (default 5000, 1 s)
+	-v  print the first this many differing samples (default 0)
+
+	For each recorded tick the replay sets ADC_VALS to the sample's
+	CURRENT, EMF and FB, and input capture takes the edges the board
+	counted since the last sample (the edges channel), spread over the
+	tick, through _IC1Interrupt() and encoder_serviceInterrupt(); then
+	control_serviceInterrupt() runs the tick (encoder_service(), pid(),
+	...) and the sample it publishes is compared with the recorded one on
+	the encoder, position, velocity and acceleration. The ADC and its
+	filters are not run: the capture holds what they put out.
+
+	The firmware's own state picks up from the capture: the gains and soft
+	limits from the replies to the reads the recorder makes first, the
+	rest of what the control loop carries between ticks from the first
+	GET_STATE reply (control_setState()), or failing that the EMF
+	calibration from GET_EMF and the position from the first sample. Each
+	later GET_STATE reply is checked against the replay's own state and
+	picked up from again, as is the position after a gap. Other vendor
+	requests the host made are run through VendorRequests() and
+	VendorRequestsOut() before the tick after the one the board handled
+	them in. A capture without the edges channel has as many edges as the
+	position moved, and misses those the board took while the EMF showed
+	no direction.
+
+	Exits 0 when every compared sample and GET_STATE check matched, 1 when
+	any differed or there was nothing to compare.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hal.h"
+#include "adc.h"
+#include "haptic.h"
+#include "snapshot.h"
+#include "telemetry.h"
+#include "usb.h"
+#include "haptic_capture.h"
+
+#define GET_GAINS       6
+#define GET_EMF         14
+#define GET_LIMITS      16
+#define GET_STATE       20
+#define CAPTURE_PER_TICK    50      // CAPTURE_FREQ/CONTROL_FREQ in haptic.c
+#define CONTROL_FREQ        5000
+#define REPLAY_INPUTS   (TELEMETRY_CURRENT|TELEMETRY_EMF|TELEMETRY_FB|TELEMETRY_POS)
+#define REPLAY_CHANNELS 4           // enc, pos, vel, acc are compared
+
+typedef struct {
+    const HAPTIC_CAPTURE_BLOCK *block;
+    int64_t tick;                   // unwrapped, the tick it goes in before
+    size_t order;                   // in the file, for requests placed on the same tick
+} REPLAY_REQUEST;
+
+static const char *channel_names[REPLAY_CHANNELS] = {"enc", "pos", "vel", "acc"};
+static const uint8_t channel_masks[REPLAY_CHANNELS] = {TELEMETRY_ENC, TELEMETRY_POS, TELEMETRY_VEL, TELEMETRY_ACC};
+
+static SIM_PROF prof_control = {"control_serviceInterrupt"};
+
+static struct {
+    long ticks;
+    long compared;
+    long gaps;                      // ticks missing from the stream
+    long skipped;                   // samples without the channels a tick needs
+    long requests;                  // run through the firmware
+    long failed;                    // the firmware refused, where the board had taken it
+    long states;                    // GET_STATE replies checked against the replay's...
+    long state_differ;              // ...and how many differed
+    int64_t state_first;
+    long differ[REPLAY_CHANNELS];
+    int64_t first[REPLAY_CHANNELS]; // tick of the first difference
+    long worst[REPLAY_CHANNELS];
+    int seeded;                     // from GET_STATE, or the EMF calibration from GET_EMF
+    uint16_t edges;                 // the edge count the last GET_STATE picked up
+} replay;
+
+static int replay_compare(const void *a, const void *b) {
+    const REPLAY_REQUEST *x = a, *y = b;
+
+    if (x->tick!=y->tick)
+        return x->tick<y->tick ? -1:1;
+    return x->order<y->order ? -1:1;
+}
+
+// Where the firmware picks up the board's state: replies to the reads the recorder makes
+static void replay_state(const HAPTIC_CAPTURE_BLOCK *block, const uint8_t *data) {
+    uint16_t word[5], n, width;
+
+    for (n = 0; n<block->count/2 && n<5; n++)
+        word[n] = data[2*n]|(data[2*n+1]<<8);
+    switch (block->bRequest) {
+        case GET_GAINS:
+            if (block->count<10)
+                break;
+            pid_setGains(&PID, word[0], word[1], word[2]);
+            pid_setGains(&CURRENT_PID, word[3], word[4], 0);
+            break;
+        case GET_LIMITS:
+            if (block->count<4)
+                break;
+            ENC_LIMIT_MIN = word[0];
+            ENC_LIMIT_MAX = word[1];
+            break;
+        case GET_EMF:
+            if (block->count<6 || replay.seeded)
+                break;                  // a guess at what GET_STATE has whole
+            width = word[2]-word[0];    // the larger of the band and EMF_DEV_MULT mean deviations
+            EMF_CAL.mid = word[0];
+            EMF_CAL.low = word[1];
+            EMF_CAL.high = word[2];
+            EMF_CAL.startup = 0;
+            EMF_CAL.mid_acc = (uint32_t)word[0]<<EMF_TRACK_SHIFT;
+            EMF_CAL.dev_acc = (width>EMF_CAL.band) ? (uint32_t)(width/EMF_DEV_MULT)<<EMF_TRACK_SHIFT:0;
+            replay.seeded = 1;
+            break;
+    }
+}
+
+// GET_STATE: the first is where the replay picks up, the rest are checked
+// against its own and picked up again from; 1 if it was taken up
+static int replay_load(const HAPTIC_CAPTURE_BLOCK *block, int64_t tick, int verbose) {
+    const uint8_t *data = haptic_capture_payload(block);
+    uint16_t state[CONTROL_STATE_WORDS], mine[CONTROL_STATE_WORDS], n;
+
+    if (block->count<2*CONTROL_STATE_WORDS)
+        return 0;
+    for (n = 0; n<CONTROL_STATE_WORDS; n++)
+        state[n] = data[2*n]|(data[2*n+1]<<8);
+    if (replay.seeded==2) {
+        control_getState(mine);
+        replay.states++;
+        if (memcmp(mine+1, state+1, sizeof(state)-sizeof(state[0]))) {
+            if (!replay.state_differ++)
+                replay.state_first = tick;
+            for (n = 1; verbose && n<CONTROL_STATE_WORDS; n++)
+                if (mine[n]!=state[n])
+                    printf("  state word %u after tick %lld: board %u, replay %u\n", n, (long long)tick-1,
+                           state[n], mine[n]);
+        }
+    }
+    control_setState(state);
+    replay.edges = state[CONTROL_STATE_WORDS-1];
+    replay.seeded = 2;
+    return 1;
+}
+
+// A vendor request as usb.c hands it over: the setup stage, then the data
+// stage a packet at a time; 1 if it was GET_STATE, and taken up
+static int replay_request(const REPLAY_REQUEST *request, int verbose) {
+    const HAPTIC_CAPTURE_BLOCK *block = request->block;
+    const uint8_t *data = haptic_capture_payload(block);
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint16_t sent, length;
+
+    if (block->result<0)
+        return 0;                   // the board never took it either
+    if (block->bmRequestType&0x80 && block->bRequest==GET_STATE)
+        return replay_load(block, request->tick, verbose);
+    if (block->bmRequestType&0x80) {
+        replay_state(block, data);
+        return 0;
+    }
+    USB_setup.bmRequestType = block->bmRequestType;
+    USB_setup.bRequest = block->bRequest;
+    USB_setup.wValue.w = block->wValue;
+    USB_setup.wIndex.w = block->wIndex;
+    USB_setup.wLength.w = block->wLength;
+    USB_request.setup.bmRequestType = NO_REQUEST;
+    USB_request.setup.bRequest = NO_REQUEST;
+    USB_request.bytes_left.w = block->wLength;
+    USB_error_flags = 0;
+    VendorRequests();
+    for (sent = 0; sent<block->count && !USB_error_flags && USB_request.setup.bRequest!=NO_REQUEST; sent += length) {
+        length = (block->count-sent<MAX_PACKET_SIZE) ? block->count-sent:MAX_PACKET_SIZE;
+        memcpy(packet, data+sent, length);
+        USB_buffer_desc.address = packet;
+        USB_buffer_desc.bytecount = length;
+        USB_request.bytes_left.w = (USB_request.bytes_left.w>length) ? USB_request.bytes_left.w-length:0;
+        VendorRequestsOut();
+    }
+    replay.requests++;
+    if (USB_error_flags) {
+        replay.failed++;
+        if (verbose)
+            printf("  request %u at tick %u refused\n", block->bRequest, block->tick);
+    }
+    return 0;
+}
+
+// Picks the position up from a sample the replay did not run
+static void replay_seed(const HAPTIC_SAMPLE *sample) {
+    ENC_COUNT_VAL = sample->enc;
+    ENC_POS_VAL = (int32_t)sample->enc+(int16_t)(sample->pos-sample->enc);
+    TICK_VAL = sample->time+1;
+}
+
+// Edges from the edges channel when the capture has it, or else as many as the position moved
+static void replay_tick(const HAPTIC_SAMPLE *sample, uint8_t channels, const HAPTIC_SAMPLE *last) {
+    int16_t moved = (int16_t)(sample->pos-last->pos);
+    uint16_t edges = moved<0 ? -moved:moved, start = (uint16_t)(sample->time*CAPTURE_PER_TICK), n;
+
+    if (channels&TELEMETRY_EDGES)
+        edges = sample->edges-last->edges;
+
+    for (n = 0; n<edges; n++)      // evenly through the tick before this one
+        sim_capture(start-CAPTURE_PER_TICK+(n+1)*CAPTURE_PER_TICK/(edges+1));
+    TMR5 = start;
+    ADC_VALS[ADC_CURRENT] = sample->current;
+    ADC_VALS[ADC_EMF] = sample->emf;
+    ADC_VALS[ADC_FB] = sample->fb;
+    TICK_VAL = sample->time;
+    SIM_TIME(prof_control, control_serviceInterrupt());
+}
+
+static void replay_check(const HAPTIC_SAMPLE *recorded, uint8_t channels, int64_t tick, long *verbose) {
+    SAMPLE out;
+    long diff[REPLAY_CHANNELS];
+    uint16_t c, differs = 0;
+
+    snapshot_read(&out);
+    diff[0] = (long)out.enc-recorded->enc;
+    diff[1] = (int16_t)(out.pos-recorded->pos);
+    diff[2] = (long)out.vel-recorded->vel;
+    diff[3] = (long)out.acc-recorded->acc;
+    for (c = 0; c<REPLAY_CHANNELS; c++) {
+        if (!(channels&channel_masks[c]) || !diff[c])
+            continue;
+        if (!replay.differ[c]++)
+            replay.first[c] = tick;
+        if (labs(diff[c])>replay.worst[c])
+            replay.worst[c] = labs(diff[c]);
+        differs = 1;
+    }
+    replay.compared++;
+    if (differs && *verbose>0) {
+        (*verbose)--;
+        printf("  tick %lld: enc %u/%u pos %u/%u vel %d/%d acc %d/%d (replay/board)\n", (long long)tick,
+               out.enc, recorded->enc, out.pos, recorded->pos, out.vel, recorded->vel, out.acc, recorded->acc);
+    }
+}
+
+static double replay_seconds(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec+now.tv_nsec*1e-9;
+}
+
+int main(int argc, char **argv) {
+    HAPTIC_CAPTURE_MAP map;
+    const HAPTIC_CAPTURE_BLOCK *block;
+    const HAPTIC_SAMPLE *samples;
+    REPLAY_REQUEST *requests;
+    size_t num = 0, next = 0, n;
+    int64_t tick = 0, last = 0, settle = 0;
+    long warmup = CONTROL_FREQ, verbose = 0, differed = 0;
+    HAPTIC_SAMPLE prev;             // the position and edge count the next tick moves on from
+    uint32_t rate;
+    double t0, wall;
+    int opt, started = 0, seed = 1, loaded;
+    uint16_t c;
+
+    while ((opt = getopt(argc, argv, "w:v:"))!=-1) {
+        switch (opt) {
+            case 'w': warmup = atol(optarg); break;
+            case 'v': verbose = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-w ticks] [-v samples] capture\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind>=argc) {
+        fprintf(stderr, "usage: %s [-w ticks] [-v samples] capture\n", argv[0]);
+        return 2;
+    }
+    if (haptic_capture_map(&map, argv[optind])<0) {
+        fprintf(stderr, "%s is not a capture this can read\n", argv[optind]);
+        return 2;
+    }
+    rate = map.header->rate ? map.header->rate:CONTROL_FREQ;
+
+    // Requests go in by tick, not by where they landed among the packets:
+    // place each against the stream as it had got when it was written
+    for (block = haptic_capture_next(&map, NULL); block; block = haptic_capture_next(&map, block))
+        num += block->type==HAPTIC_CAPTURE_REQUEST;
+    requests = calloc(num ? num:1, sizeof(REPLAY_REQUEST));
+    num = 0;
+    for (block = haptic_capture_next(&map, NULL); block; block = haptic_capture_next(&map, block)) {
+        if (block->type==HAPTIC_CAPTURE_SAMPLES && block->count) {
+            tick = started ? tick+(int16_t)(block->tick-(uint16_t)tick):block->tick;
+            for (n = 0; !started && n<num; n++)     // those made before the stream came in, against its start
+                requests[n].tick = tick+(int16_t)(requests[n].tick-(uint16_t)tick)+1;
+            tick += block->count-1;
+            started = 1;
+        } else if (block->type==HAPTIC_CAPTURE_REQUEST) {
+            uint16_t handled = block->tick;
+            const uint8_t *data = haptic_capture_payload(block);
+
+            if (block->bRequest==GET_STATE && block->count>=2)
+                handled = data[0]|(data[1]<<8);     // exactly, from the board
+            requests[num].block = block;
+            requests[num].tick = started ? tick+(int16_t)(handled-(uint16_t)tick)+1:handled;
+            requests[num].order = num;
+            num++;
+        }
+    }
+    qsort(requests, num, sizeof(REPLAY_REQUEST), replay_compare);
+
+    sim_init();
+    initChip();
+    initInt();
+    initMotor();
+    init_telemetry();
+    initControl();
+    InitUSB();
+
+    printf("replaying %s: board %s, %u ticks/s, %lu requests\n", argv[optind],
+           map.header->serial[0] ? map.header->serial:"(no serial number)", rate, (unsigned long)num);
+    started = 0;
+    memset(&prev, 0, sizeof(prev));
+    t0 = replay_seconds();
+    for (block = haptic_capture_next(&map, NULL); block; block = haptic_capture_next(&map, block)) {
+        if (block->type!=HAPTIC_CAPTURE_SAMPLES || !block->count)
+            continue;
+        samples = haptic_capture_payload(block);
+        for (n = 0; n<block->count; n++) {
+            tick = started ? last+(int16_t)(samples[n].time-(uint16_t)last):samples[n].time;
+            started = 1;
+            loaded = 0;
+            while (next<num && requests[next].tick<=tick)
+                loaded |= replay_request(&requests[next++], verbose>0);
+            if (loaded) {               // the board's own state, right up to this tick
+                last = tick-1;
+                prev.pos = (uint16_t)ENC_POS_VAL;
+                prev.edges = replay.edges;
+                if (seed || tick<settle)
+                    settle = tick;
+                seed = 0;
+            }
+            if ((block->channels&REPLAY_INPUTS)!=REPLAY_INPUTS) {
+                replay.skipped++;
+                seed = 1;
+            } else if (seed || tick!=last+1) {
+                if (!seed)
+                    replay.gaps += tick-last-1;
+                replay_seed(&samples[n]);
+                settle = tick+warmup;
+                seed = 0;
+            } else {
+                replay_tick(&samples[n], block->channels, &prev);
+                control_storeCalib();   // as the main loop would, between ticks
+                replay.ticks++;
+                if (tick>=settle)
+                    replay_check(&samples[n], block->channels, tick, &verbose);
+            }
+            last = tick;
+            prev = samples[n];
+        }
+    }
+    wall = replay_seconds()-t0;
+
+    printf("replayed %ld ticks, %.3f s of the board's time, in %.3f s: %.0fx real time\n", replay.ticks,
+           (double)replay.ticks/rate, wall, wall>0. ? replay.ticks/(double)rate/wall:0.);
+    printf("host cycles per call:\n");
+    sim_prof_report(&prof_control);
+    sim_prof_report(&sim_prof_ic1);
+    printf("  %ld ticks missing from the stream, %ld samples without current, EMF, FB and position\n",
+           replay.gaps, replay.skipped);
+    printf("  %ld requests run, %ld refused\n", replay.requests, replay.failed);
+    if (replay.state_differ)
+        printf("  %ld of %ld GET_STATE checks differed, first after tick %lld\n", replay.state_differ, replay.states,
+               (long long)replay.state_first-1);
+    else
+        printf("  %ld GET_STATE checks, all match\n", replay.states);
+    printf("compared %ld samples after %ld ticks to settle:\n", replay.compared, warmup);
+    for (c = 0; c<REPLAY_CHANNELS; c++) {
+        if (replay.differ[c])
+            printf("  %s: %ld differ, first at tick %lld, by up to %ld\n", channel_names[c], replay.differ[c],
+                   (long long)replay.first[c], replay.worst[c]);
+        else
+            printf("  %s: all match\n", channel_names[c]);
+        differed += replay.differ[c];
+    }
+    free(requests);
+    haptic_capture_unmap(&map);
+    return (differed || replay.state_differ || !replay.compared) ? 1:0;
+}
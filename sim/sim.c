@@ -0,0 +1,538 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "hal.h"
+
+/*************************************************
+			SFRs
+**************************************************/
+
+volatile uint16_t OSCCON;
+volatile CNEN1BITS CNEN1bits;
+volatile IFS0BITS IFS0bits;
+volatile IEC0BITS IEC0bits;
+volatile IPC0BITS IPC0bits;
+volatile IFS1BITS IFS1bits;
+volatile IEC1BITS IEC1bits;
+volatile IPC2BITS IPC2bits;
+volatile IPC3BITS IPC3bits;
+volatile IPC4BITS IPC4bits;
+volatile IFS5BITS IFS5bits;
+volatile IEC5BITS IEC5bits;
+volatile IPC21BITS IPC21bits;
+volatile uint16_t TRISB, PORTB;
+volatile PORTBBITS PORTBbits;
+volatile RPINR7BITS RPINR7bits;
+volatile uint16_t T5CON, PR5, TMR5, IC1CON2;
+volatile uint16_t T2CON, T3CON, PR2, PR3, TMR2, TMR3;
+volatile uint16_t T4CON, PR4, TMR4;
+volatile OC1CON1BITS OC1CON1bits;
+volatile OC1CON2BITS OC1CON2bits;
+volatile uint16_t OC1R, OC1RS;
+volatile SIM_IC1CON1 sim_IC1CON1;
+volatile SIM_AD1CON1 sim_AD1CON1;
+volatile SIM_AD1CON2 sim_AD1CON2;
+volatile uint16_t AD1CON3, AD1CHS, AD1CSSL;
+volatile unsigned int sim_ADC1BUF[16];
+
+/*************************************************
+			Board model
+**************************************************/
+
+// Wiring of the haptic board, see MiniProject4_Notes.txt
+#define SIM_ENCODER     (&D[0])
+#define SIM_ENCODER_RP  20              // D[0] is RP20
+#define SIM_nSF         (&D[1])
+#define SIM_nD2         (&D[2])
+#define SIM_D1          (&D[3])
+#define SIM_ENA         (&D[4])
+#define SIM_IN2         (&D[5])
+#define SIM_IN1         (&D[6])
+#define SIM_INV         (&D[8])
+
+#define SIM_ADC_VREF        3.3     // ADC reference (V)
+#define SIM_CURRENT_SHUNT   0.01    // current sense resistor (ohm)
+#define SIM_FB_GAIN         (0.0024*2400.)  // FB mirror ratio times load resistor (V/A)
+
+#define SIM_STEP_CYCLES     ((int)(FCY*SIM_DT+0.5))    // instruction cycles per scheduler step
+
+// Bridge state an ADC input is sampled in
+#define SIM_SAMPLE_IDEAL    0       // averaged, for pin_read
+#define SIM_SAMPLE_ON       1       // driving
+#define SIM_SAMPLE_OFF      2       // floating
+
+_PIN D[14], A[6];
+_TIMER timer1, timer2, timer3, timer4, timer5;
+_OC oc1, oc2, oc3, oc4, oc5, oc6, oc7, oc8, oc9;
+_LED led1, led2, led3;
+
+_PLANT sim_plant;
+double sim_emf_mid = SIM_ADC_EMF_MID;
+double sim_emf_drift;
+uint32_t sim_serial = SIM_SERIAL;
+double sim_usb_ppm;
+SIM_PROF sim_prof_cn = {"_CNInterrupt"};
+SIM_PROF sim_prof_ic1 = {"_IC1Interrupt"};
+SIM_PROF sim_prof_adc = {"_ADC1Interrupt"};
+SIM_PROF sim_prof_usb = {"_USB1Interrupt"};
+SIM_PROF sim_prof_timer[5] = {{"timer1 callback"}, {"timer2 callback"}, {"timer3 callback"},
+                              {"timer4 callback"}, {"timer5 callback"}};
+
+static _TIMER *sim_timers[] = {&timer1, &timer2, &timer3, &timer4, &timer5};
+static double sim_t;
+static uint16_t sim_ic1_fifo[4];
+static uint16_t sim_ic1_count;
+static uint16_t sim_adc_input;          // next AN input of the MUX A scan
+static uint16_t sim_adc_count;          // conversions into the current set
+static uint16_t sim_t2_prescale;        // instruction cycles towards the next TMR2/TMR3 count
+static uint16_t sim_t3_prescale;
+static uint16_t sim_t4_prescale;
+static uint16_t sim_t5_prescale;
+static uint16_t sim_seed = 0xACE1;
+static uint16_t sim_flash_calib[HAL_FLASH_PAGE/2];   // the calib page's low words, inverted so zeros read erased;
+                                                    // sim_init() leaves it, as a power cycle leaves flash
+
+void __attribute__((weak)) _CNInterrupt(void) {}
+void __attribute__((weak)) _IC1Interrupt(void) {}
+void __attribute__((weak)) _ADC1Interrupt(void) {}
+void __attribute__((weak)) _USB1Interrupt(void) {}
+
+uint16_t sim_rand(void) {
+    sim_seed = sim_seed*25173+13849;
+    return sim_seed;
+}
+
+uint16_t sim_flash_read(uint32_t addr) {
+    if (addr==HAL_SERIAL_ADDRESS)
+        return (uint16_t)(sim_serial>>16);
+    if (addr==HAL_SERIAL_ADDRESS+2)
+        return (uint16_t)sim_serial;
+    if (addr>=HAL_CALIB_ADDRESS && addr<HAL_CALIB_ADDRESS+HAL_FLASH_PAGE)
+        return ~sim_flash_calib[(addr-HAL_CALIB_ADDRESS)/2];
+    return 0xFFFF;
+}
+
+void sim_flash_erase(uint32_t addr) {
+    if (addr>=HAL_CALIB_ADDRESS && addr<HAL_CALIB_ADDRESS+HAL_FLASH_PAGE)
+        memset(sim_flash_calib, 0, sizeof(sim_flash_calib));
+}
+
+void sim_flash_write(uint32_t addr, uint16_t word) {
+    if (addr>=HAL_CALIB_ADDRESS && addr<HAL_CALIB_ADDRESS+HAL_FLASH_PAGE)
+        sim_flash_calib[(addr-HAL_CALIB_ADDRESS)/2] |= (uint16_t)~word;    // programming only clears bits
+}
+
+static uint16_t sim_adc(double volts) {
+    double code = floor(volts/SIM_ADC_VREF*1023.+0.5);
+
+    if (code<0.)
+        code = 0.;
+    if (code>1023.)
+        code = 1023.;
+    return (uint16_t)code<<6;       // 10-bit result, left justified like pin_read
+}
+
+static uint16_t sim_adc_emf(void) {
+    double code = sim_emf_mid+sim_emf_drift*sim_t+SIM_ADC_EMF_GAIN*sim_plant.omega;
+
+    code += (double)(sim_rand()%(2*SIM_ADC_EMF_NOISE+1))-SIM_ADC_EMF_NOISE;
+    return sim_adc(code/65536.*SIM_ADC_VREF);
+}
+
+// OC1 in double-compare mode on Timer2: the fraction of the period it is high
+static double sim_oc1_level(void) {
+    if (!(T2CON&0x8000) || OC1R>PR2 || OC1RS<=OC1R)
+        return 0.;
+    return (double)((OC1RS>PR2 ? PR2+1:OC1RS)-OC1R)/(PR2+1);
+}
+
+static double sim_pin_level(_PIN *pin) {
+    if (pin->owner==&oc1 && OC1CON1bits.OCM==5)
+        return sim_oc1_level();
+    if (pin->owner)
+        return (double)pin->value/65536.;   // duty cycle of the OC driving it
+    return pin->value ? 1.:0.;
+}
+
+static double sim_motor_voltage(void) {
+    double v;
+
+    if (!SIM_ENA->value || SIM_D1->value)
+        return 0.;                          // outputs disabled
+    v = PLANT_VBAT*(sim_pin_level(SIM_IN1)-sim_pin_level(SIM_IN2))*sim_pin_level(SIM_nD2);
+    return SIM_INV->value ? -v:v;
+}
+
+/*************************************************
+			Clock, UART, UI
+**************************************************/
+
+void init_clock(void) {}
+
+void init_uart(void) {}
+
+void init_ui(void) {
+    led1.on = 0;
+    led2.on = 0;
+    led3.on = 0;
+}
+
+void led_on(_LED *self) { self->on = 1; }
+void led_off(_LED *self) { self->on = 0; }
+void led_toggle(_LED *self) { self->on = !self->on; }
+void led_write(_LED *self, uint16_t val) { self->on = val ? 1:0; }
+uint16_t led_read(_LED *self) { return self->on; }
+
+/*************************************************
+			Pins
+**************************************************/
+
+void init_pin(void) {
+    uint16_t n;
+
+    for (n = 0; n<14; n++) {
+        D[n].value = 0;
+        D[n].analog = 0;
+        D[n].annum = -1;
+        D[n].owner = NULL;
+    }
+    for (n = 0; n<6; n++) {
+        A[n].value = 0;
+        A[n].analog = 0;
+        A[n].annum = n;
+        A[n].owner = NULL;
+    }
+    SIM_nSF->value = 1;                     // no driver fault
+}
+
+void pin_digitalIn(_PIN *self) { self->analog = 0; }
+void pin_digitalOut(_PIN *self) { self->analog = 0; }
+void pin_analogIn(_PIN *self) { self->analog = (self->annum>=0); }
+void pin_set(_PIN *self) { pin_write(self, 1); }
+void pin_clear(_PIN *self) { pin_write(self, 0); }
+void pin_toggle(_PIN *self) { pin_write(self, !self->value); }
+
+void pin_write(_PIN *self, uint16_t val) {
+    if (self->owner) {
+        self->owner->duty = val;
+        self->value = val;
+    } else {
+        self->value = val ? 1:0;
+    }
+}
+
+// Sense currents only flow while the bridge drives; the EMF input reads the
+// driven rail then and the back EMF while the bridge floats.
+static uint16_t sim_adc_channel(int16_t annum, uint16_t sample) {
+    switch (annum) {
+        case 0:
+            return sample==SIM_SAMPLE_OFF ? 0:sim_adc(fabs(sim_plant.i)*SIM_CURRENT_SHUNT);
+        case 1:
+            if (sample==SIM_SAMPLE_ON)
+                return sim_adc(sim_motor_voltage()>0. ? SIM_ADC_VREF:0.);
+            return sim_adc_emf();
+        case 2:
+            return sample==SIM_SAMPLE_OFF ? 0:sim_adc(fabs(sim_plant.i)*SIM_FB_GAIN);
+        default:
+            return 0;
+    }
+}
+
+uint16_t pin_read(_PIN *self) {
+    if (!self->analog)
+        return self->value;
+    return sim_adc_channel(self->annum, SIM_SAMPLE_IDEAL);
+}
+
+/*************************************************
+			ADC scan
+**************************************************/
+
+// One Timer3-triggered conversion (auto-sample, SSRC = 010) of MUX B on odd
+// conversions with ALTS, else of MUX A (the next scanned input with CSCNA),
+// stored and interrupting the way AD1CON2 asks for
+static void sim_adc_trigger(uint16_t sample) {
+    uint16_t n, base, annum;
+
+    if (!AD1CON1bits.ADON || AD1CON1bits.SSRC!=2)
+        return;
+    if (AD1CON2bits.ALTS && (sim_adc_count&1)) {
+        annum = (AD1CHS>>8)&0x1F;
+    } else if (AD1CON2bits.CSCNA) {
+        for (n = 0; n<16 && !(AD1CSSL&(1<<sim_adc_input)); n++)
+            sim_adc_input = (sim_adc_input+1)&15;
+        annum = sim_adc_input;
+        sim_adc_input = (sim_adc_input+1)&15;
+    } else {
+        annum = AD1CHS&0x1F;
+    }
+    base = (AD1CON2bits.BUFM && AD1CON2bits.BUFS) ? 8:0;
+    sim_ADC1BUF[base+sim_adc_count] = sim_adc_channel(annum, sample);
+    if (++sim_adc_count<=AD1CON2bits.SMPI)
+        return;
+    sim_adc_count = 0;
+    sim_adc_input = 0;                  // scan and alternation restart with each set
+    if (AD1CON2bits.BUFM)
+        AD1CON2bits.BUFS ^= 1;          // the module moves on to the other half
+    IFS0bits.AD1IF = 1;
+    if (IEC0bits.AD1IE)
+        SIM_TIME(sim_prof_adc, _ADC1Interrupt());
+}
+
+/*************************************************
+			Timers
+**************************************************/
+
+void init_timer(void) {
+    uint16_t n;
+
+    for (n = 0; n<5; n++) {
+        sim_timers[n]->period = 0.;
+        sim_timers[n]->elapsed = 0.;
+        sim_timers[n]->prescale = 1;
+        sim_timers[n]->running = 0;
+        sim_timers[n]->flag = 0;
+        sim_timers[n]->aftercount = 0;
+        sim_timers[n]->callback = NULL;
+    }
+}
+
+void timer_setPeriod(_TIMER *self, float period) {
+    static const uint16_t prescales[] = {1, 8, 64, 256};
+    uint16_t n;
+
+    self->period = period;
+    self->elapsed = 0.;
+    for (n = 0; n<3 && period*FCY/prescales[n]>65536.; n++) {}
+    self->prescale = prescales[n];
+}
+
+float timer_period(_TIMER *self) { return self->period; }
+void timer_setFreq(_TIMER *self, float freq) { timer_setPeriod(self, 1./freq); }
+float timer_freq(_TIMER *self) { return 1./self->period; }
+void timer_start(_TIMER *self) { self->flag = 0; self->running = 1; }
+void timer_stop(_TIMER *self) { self->running = 0; }
+uint16_t timer_flag(_TIMER *self) { return self->flag; }
+void timer_lower(_TIMER *self) { self->flag = 0; }
+
+uint16_t timer_read(_TIMER *self) {
+    return (uint16_t)(self->elapsed*FCY/self->prescale);
+}
+
+void timer_every(_TIMER *self, float interval, void (*callback)(_TIMER *self)) {
+    timer_setPeriod(self, interval);
+    self->aftercount = 0;
+    self->callback = callback;
+    timer_start(self);
+}
+
+void timer_after(_TIMER *self, float delay, uint16_t num_times, void (*callback)(_TIMER *self)) {
+    timer_setPeriod(self, delay);
+    self->aftercount = num_times;
+    self->callback = callback;
+    timer_start(self);
+}
+
+void timer_cancel(_TIMER *self) {
+    timer_stop(self);
+    self->callback = NULL;
+}
+
+static void sim_timer_step(_TIMER *self, SIM_PROF *prof) {
+    if (!self->running || self->period<=0.)
+        return;
+    self->elapsed += SIM_DT;
+    while (self->running && self->elapsed>=self->period) {
+        self->elapsed -= self->period;
+        self->flag = 1;
+        if (self->callback) {
+            SIM_TIME(*prof, self->callback(self));
+            if (self->aftercount && !--self->aftercount)
+                timer_cancel(self);
+        }
+    }
+}
+
+// Counts one instruction cycle on an SFR-driven timer (TON, TCKPS);
+// returns 1 on a period match, when the count restarts
+static int sim_tmr_tick(volatile uint16_t *tmr, uint16_t pr, uint16_t con, uint16_t *prescale) {
+    static const uint16_t prescales[] = {1, 8, 64, 256};
+
+    if (!(con&0x8000) || ++*prescale<prescales[(con>>4)&3])
+        return 0;
+    *prescale = 0;
+    if (*tmr==pr) {
+        *tmr = 0;
+        return 1;
+    }
+    (*tmr)++;
+    return 0;
+}
+
+// Timer2/Timer3 as pwm.c runs them, cycle by cycle so the Timer3 ADC
+// triggers see where in the OC1 window they land, Timer4 for prof.c and
+// Timer5 for sof.c (input capture keeps its own count, see sim_ic1_clock).
+// Firmware takes no simulated time, so prof.c only sees periods here.
+static void sim_tmr_step(void) {
+    uint16_t n, on;
+
+    for (n = 0; n<SIM_STEP_CYCLES; n++) {
+        sim_tmr_tick(&TMR2, PR2, T2CON, &sim_t2_prescale);
+        sim_tmr_tick(&TMR4, PR4, T4CON, &sim_t4_prescale);
+        sim_tmr_tick(&TMR5, PR5, T5CON, &sim_t5_prescale);
+        if (sim_tmr_tick(&TMR3, PR3, T3CON, &sim_t3_prescale)) {
+            on = OC1CON1bits.OCM==5 && (T2CON&0x8000) && TMR2>=OC1R && TMR2<OC1RS;
+            sim_adc_trigger(on ? SIM_SAMPLE_ON:SIM_SAMPLE_OFF);
+        }
+    }
+}
+
+/*************************************************
+			Input capture
+**************************************************/
+
+volatile SIM_IC1CON1 *sim_ic1con1(void) {
+    sim_IC1CON1.bits.ICBNE = sim_ic1_count ? 1:0;
+    return &sim_IC1CON1;
+}
+
+uint16_t sim_ic1buf(void) {
+    uint16_t val = sim_ic1_fifo[0];
+    uint16_t n;
+
+    if (!sim_ic1_count)
+        return val;
+    for (n = 1; n<sim_ic1_count; n++)
+        sim_ic1_fifo[n-1] = sim_ic1_fifo[n];
+    sim_ic1_count--;
+    return val;
+}
+
+// Free-running ICxTMR clocked from the timer ICTSEL picks (only timer5 and Fcy are modelled)
+static double sim_ic1_clock(void) {
+    static const uint16_t prescales[] = {1, 8, 64, 256};
+
+    switch (sim_IC1CON1.bits.ICTSEL) {
+        case 3: return (T5CON&0x8000) ? FCY/prescales[(T5CON>>4)&3]:0.;
+        case 7: return FCY;
+        default: return 0.;
+    }
+}
+
+void sim_capture(uint16_t time) {
+    if (RPINR7bits.IC1R!=SIM_ENCODER_RP || sim_IC1CON1.bits.ICM!=1)
+        return;                             // only capture-every-edge mode is modelled
+    if (sim_ic1_count==4) {
+        sim_IC1CON1.bits.ICOV = 1;
+        return;
+    }
+    sim_ic1_fifo[sim_ic1_count++] = time;
+    IFS0bits.IC1IF = 1;
+    if (IEC0bits.IC1IE)
+        SIM_TIME(sim_prof_ic1, _IC1Interrupt());
+}
+
+static void sim_ic1_edge(void) {
+    double clock = sim_ic1_clock();
+
+    if (clock>0.)
+        sim_capture((uint16_t)(uint64_t)(sim_t*clock));
+}
+
+/*************************************************
+			Output compare
+**************************************************/
+
+void init_oc(void) {}
+
+void oc_pwm(_OC *self, _PIN *pin, _TIMER *timer, float freq, uint16_t duty) {
+    self->pin = pin;
+    self->timer = timer;
+    self->freq = freq;
+    self->duty = duty;
+    pin->owner = self;
+    pin->value = duty;
+    if (timer) {
+        timer_setFreq(timer, freq);
+        timer_start(timer);
+    }
+}
+
+void oc_free(_OC *self) {
+    if (self->pin)
+        self->pin->owner = NULL;
+    self->pin = NULL;
+}
+
+/*************************************************
+			Scheduler
+**************************************************/
+
+void sim_init(void) {
+    plant_init(&sim_plant);
+    usbhost_init();
+    sim_ic1_count = 0;
+    sim_adc_input = 0;
+    sim_adc_count = 0;
+    sim_t2_prescale = 0;
+    sim_t3_prescale = 0;
+    sim_t4_prescale = 0;
+    sim_t5_prescale = 0;
+    sim_t = 0.;
+}
+
+double sim_time(void) {
+    return sim_t;
+}
+
+void sim_step(void) {
+    long edge;
+    uint16_t n;
+
+    plant_step(&sim_plant, sim_motor_voltage(), SIM_DT);
+    sim_t += SIM_DT;
+
+    edge = (long)floor(sim_plant.theta*PLANT_EDGES_PER_RAD);
+    while (sim_plant.edge!=edge) {          // one change notification and capture per encoder transition
+        sim_plant.edge += (edge>sim_plant.edge) ? 1:-1;
+        SIM_ENCODER->value = !SIM_ENCODER->value;
+        IFS1bits.CNIF = 1;
+        if (CNEN1bits.CN14IE && IEC1bits.CNIE)
+            SIM_TIME(sim_prof_cn, _CNInterrupt());
+        sim_ic1_edge();
+    }
+
+    for (n = 0; n<5; n++)
+        sim_timer_step(sim_timers[n], &sim_prof_timer[n]);
+    sim_tmr_step();
+
+    usbhost_step();
+    if (sim_u1ir()->w&U1IE) {               // any enabled USB flag requests the interrupt
+        IFS5bits.USB1IF = 1;
+        if (IEC5bits.USB1IE)
+            SIM_TIME(sim_prof_usb, _USB1Interrupt());
+    }
+}
+
+/*************************************************
+			Profiling
+**************************************************/
+
+void sim_prof_add(SIM_PROF *self, uint64_t cycles) {
+    if (!self->calls || cycles<self->min)
+        self->min = cycles;
+    if (cycles>self->max)
+        self->max = cycles;
+    self->total += cycles;
+    self->calls++;
+}
+
+void sim_prof_report(SIM_PROF *self) {
+    if (!self->calls) {
+        printf("  %-24s %10s\n", self->name, "not run");
+        return;
+    }
+    printf("  %-24s %10llu calls %10.1f mean %8llu min %8llu max\n", self->name,
+           (unsigned long long)self->calls, (double)self->total/self->calls,
+           (unsigned long long)self->min, (unsigned long long)self->max);
+}
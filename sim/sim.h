@@ -0,0 +1,183 @@
+/*
+	Host-native stand-in for the PIC24 peripheral library
+
+	Declares the same pin/timer/oc/ui/uart calls the firmware uses from
+	../lib, implemented in sim.c against the motor plant in plant.c, plus the
+	scheduler and profiling hooks used by the benchmark harness in bench.c.
+	Simulated time advances in SIM_DT steps; each step integrates the plant,
+	raises change notifications and input captures on encoder transitions,
+	runs expired timers, counts Timer2/Timer3 (the PWM and its ADC
+	triggers), Timer4 and Timer5 cycle by cycle and lets the simulated USB
+	host move one transaction and start a frame each millisecond.
+*/
+
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <stdint.h>
+#include <p24FJ128GB206.h>
+#include "plant.h"
+
+#define FCY         16e6        // instruction clock being simulated (Hz)
+#define SIM_DT      10e-6       // scheduler step (s)
+
+/*************************************************
+			Peripheral library stand-ins
+**************************************************/
+
+typedef struct _OC _OC;
+typedef struct _TIMER _TIMER;
+
+typedef struct {
+    uint16_t value;             // digital level, or duty when owned by an OC
+    uint16_t analog;            // configured as an analog input
+    int16_t annum;              // ADC channel, -1 for digital-only pins
+    _OC *owner;                 // output compare driving this pin, if any
+} _PIN;
+
+struct _TIMER {
+    double period;              // seconds
+    double elapsed;             // seconds into the current period
+    uint16_t prescale;
+    uint16_t running;
+    uint16_t flag;
+    uint16_t aftercount;        // remaining callbacks for timer_after, 0 = forever
+    void (*callback)(_TIMER *self);
+};
+
+struct _OC {
+    _PIN *pin;
+    _TIMER *timer;
+    double freq;
+    uint16_t duty;
+};
+
+typedef struct {
+    uint16_t on;
+} _LED;
+
+extern _PIN D[14], A[6];
+extern _TIMER timer1, timer2, timer3, timer4, timer5;
+extern _OC oc1, oc2, oc3, oc4, oc5, oc6, oc7, oc8, oc9;
+extern _LED led1, led2, led3;
+
+void init_clock(void);
+void init_uart(void);
+void init_pin(void);
+void init_ui(void);
+void init_timer(void);
+void init_oc(void);
+
+void pin_digitalIn(_PIN *self);
+void pin_digitalOut(_PIN *self);
+void pin_analogIn(_PIN *self);
+void pin_set(_PIN *self);
+void pin_clear(_PIN *self);
+void pin_toggle(_PIN *self);
+void pin_write(_PIN *self, uint16_t val);
+uint16_t pin_read(_PIN *self);
+
+void timer_setPeriod(_TIMER *self, float period);
+float timer_period(_TIMER *self);
+void timer_setFreq(_TIMER *self, float freq);
+float timer_freq(_TIMER *self);
+void timer_start(_TIMER *self);
+void timer_stop(_TIMER *self);
+uint16_t timer_flag(_TIMER *self);
+void timer_lower(_TIMER *self);
+uint16_t timer_read(_TIMER *self);
+void timer_every(_TIMER *self, float interval, void (*callback)(_TIMER *self));
+void timer_after(_TIMER *self, float delay, uint16_t num_times, void (*callback)(_TIMER *self));
+void timer_cancel(_TIMER *self);
+
+void oc_pwm(_OC *self, _PIN *pin, _TIMER *timer, float freq, uint16_t duty);
+void oc_free(_OC *self);
+
+void led_on(_LED *self);
+void led_off(_LED *self);
+void led_toggle(_LED *self);
+void led_write(_LED *self, uint16_t val);
+uint16_t led_read(_LED *self);
+
+/*************************************************
+			Simulation control
+**************************************************/
+
+#define SIM_ADC_EMF_MID     32800   // default EMF pin reading with the shaft still
+#define SIM_ADC_EMF_GAIN    400.    // EMF counts per rad/s
+#define SIM_ADC_EMF_NOISE   24      // peak EMF noise (counts)
+#define SIM_SERIAL          0x51A00001  // serial number the simulated board is programmed with
+
+extern _PLANT sim_plant;
+extern double sim_emf_mid;          // EMF pin reading with the shaft still, SIM_ADC_EMF_MID by default...
+extern double sim_emf_drift;        // ...plus this many counts per simulated second
+extern uint32_t sim_serial;         // serial number programmed into the simulated board, SIM_SERIAL by default
+extern double sim_usb_ppm;          // the host's frame clock runs slow of the board's by this many ppm
+
+void sim_init(void);
+void sim_step(void);
+double sim_time(void);
+uint16_t sim_rand(void);
+uint16_t sim_flash_read(uint32_t addr); // low word of a program word: erased, but for the serial number and calib page
+void sim_flash_erase(uint32_t addr);    // the page addr is in, if it is the calib page
+void sim_flash_write(uint32_t addr, uint16_t word);
+void sim_capture(uint16_t time);    // an encoder edge input capture takes at that count, as if from the plant
+
+// Firmware interrupt vectors dispatched by the scheduler (weak defaults in sim.c)
+void _CNInterrupt(void);
+void _IC1Interrupt(void);
+void _ADC1Interrupt(void);
+void _USB1Interrupt(void);
+
+/*************************************************
+			Host cycle profiling
+**************************************************/
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t sim_cycles(void) { return __rdtsc(); }
+#else
+#include <time.h>
+static inline uint64_t sim_cycles(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull+ts.tv_nsec;
+}
+#endif
+
+typedef struct {
+    const char *name;
+    uint64_t calls;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} SIM_PROF;
+
+void sim_prof_add(SIM_PROF *self, uint64_t cycles);
+void sim_prof_report(SIM_PROF *self);
+
+#define SIM_TIME(prof, call)    do {                \
+        uint64_t sim_t0_ = sim_cycles();            \
+        call;                                       \
+        sim_prof_add(&(prof), sim_cycles()-sim_t0_);\
+    } while (0)
+
+extern SIM_PROF sim_prof_cn;
+extern SIM_PROF sim_prof_ic1;
+extern SIM_PROF sim_prof_adc;
+extern SIM_PROF sim_prof_usb;
+extern SIM_PROF sim_prof_timer[5];       // timer_every/timer_after callbacks, i.e. the timer ISRs
+
+/*************************************************
+			Simulated USB host (usbhost.c)
+**************************************************/
+
+void usbhost_init(void);
+void usbhost_step(void);
+int usbhost_busy(void);
+int usbhost_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data);
+int usbhost_result(void);
+void usbhost_enumerate(void);
+void usbhost_stream(uint16_t ep, void (*callback)(uint8_t *data, uint16_t length));
+
+#endif
@@ -0,0 +1,301 @@
+/*
+	Simulated USB serial interface engine and host
+
+	Moves packets between a scripted host and the buffer descriptor table the
+	firmware sets up in usb.c, one transaction per scheduler step, the way the
+	SIE does: a transaction only completes on a BD the firmware has handed to
+	the USB module (UOWN), its result is posted to the four-deep U1STAT FIFO
+	and TRNIF, and a SETUP token sets PKTDIS until the firmware clears it.
+	A STALL handshake aborts the host's control transfer. An OUT packet whose
+	DATA0/DATA1 does not match a BD with DTSEN is ACKed and dropped.
+*/
+
+#include <string.h>
+#include "sim.h"
+#include "usb.h"
+
+#define USBHOST_FIFO_DEPTH  4
+#define USBHOST_FRAME       1e-3    // one SOF per millisecond, off the host's clock
+
+#define BD_UOWN     0x80
+#define BD_DTS      0x40
+#define BD_DTSEN    0x08
+#define BD_BSTALL   0x04
+
+// Control transfer stages
+#define STAGE_IDLE      0
+#define STAGE_SETUP     1
+#define STAGE_DATA_IN   2
+#define STAGE_DATA_OUT  3
+#define STAGE_STATUS_IN 4
+#define STAGE_STATUS_OUT 5
+
+volatile U1CONBITS U1CONbits;
+volatile U1OTGCONBITS U1OTGCONbits;
+volatile U1PWRCBITS U1PWRCbits;
+volatile uint16_t U1ADDR, U1EIR, U1IE, U1STAT, U1CNFG1, U1CNFG2, U1BDTP1;
+volatile uint16_t U1FRML, U1FRMH;
+volatile unsigned int sim_U1EP[16];
+volatile uint16_t sim_U1IR_clear;
+
+static volatile SIM_U1IR sim_U1IR;
+static uint16_t fifo[USBHOST_FIFO_DEPTH];
+static uint16_t fifo_count;
+
+static struct {
+    uint16_t stage;
+    uint8_t setup[8];
+    uint8_t *data;
+    uint16_t length;
+    uint16_t done;
+    uint16_t data01;                // toggle of the next data stage packet
+    int result;
+} xfer;
+
+static const uint8_t (*script)[8];
+static uint16_t script_left;
+static uint8_t script_buffer[256];
+static uint16_t stream_ep;
+static void (*stream_callback)(uint8_t *data, uint16_t length);
+static uint8_t ppbi[16][2];         // even/odd buffer the SIE uses next, per endpoint and direction
+static uint16_t reset_sent;
+static double sof_next;            // simulated time of the next SOF
+static uint16_t frame;
+
+static const uint8_t enumeration[][8] = {
+    {0x80, GET_DESCRIPTOR, 0x00, DEVICE, 0x00, 0x00, 0x40, 0x00},
+    {0x00, SET_ADDRESS, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x80, GET_DESCRIPTOR, 0x00, DEVICE, 0x00, 0x00, 0x12, 0x00},
+    {0x80, GET_DESCRIPTOR, 0x00, CONFIGURATION, 0x00, 0x00, 0xFF, 0x00},
+    {0x80, GET_DESCRIPTOR, 0x00, STRING, 0x00, 0x00, 0xFF, 0x00},
+    {0x80, GET_DESCRIPTOR, 0x02, STRING, 0x09, 0x04, 0xFF, 0x00},
+    {0x80, GET_DESCRIPTOR, 0x03, STRING, 0x09, 0x04, 0xFF, 0x00},
+    {0x00, SET_CONFIGURATION, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00}
+};
+
+volatile SIM_U1IR *sim_u1ir(void) {
+    uint16_t clear = sim_U1IR_clear;
+
+    sim_U1IR_clear = 0;
+    if ((clear&U1IR_TRNIF) && sim_U1IR.bits.TRNIF) {
+        memmove(fifo, fifo+1, (--fifo_count)*sizeof(fifo[0]));     // advance the U1STAT FIFO
+    }
+    sim_U1IR.w &= ~clear;
+    if (fifo_count) {
+        U1STAT = fifo[0];
+        sim_U1IR.bits.TRNIF = 1;
+    }
+    return &sim_U1IR;
+}
+
+static int usbhost_pingpong(uint16_t ep) {
+    switch (U1CNFG1&0x03) {
+        case 1: return ep==0;
+        case 2: return 1;
+        case 3: return ep!=0;
+        default: return 0;
+    }
+}
+
+static BUFDESC *usbhost_bd(uint16_t ep, uint16_t dir) {
+    if (usbhost_pingpong(ep))
+        return &BD[(ep<<2)|(dir<<1)|ppbi[ep][dir]];
+    return &BD[(ep<<1)|dir];
+}
+
+static int usbhost_post(uint16_t ep, uint16_t dir) {
+    if (fifo_count==USBHOST_FIFO_DEPTH)
+        return 0;
+    fifo[fifo_count++] = (ep<<4)|(dir<<3)|(ppbi[ep][dir]<<2);
+    if (usbhost_pingpong(ep))
+        ppbi[ep][dir] ^= 1;                 // SIE moves on to the other buffer
+    sim_u1ir();
+    return 1;
+}
+
+// Returns 1 when the transaction completed, 0 on NAK, -1 on STALL
+static int usbhost_setup(uint8_t *packet) {
+    BUFDESC *bd = usbhost_bd(0, 0);
+
+    if (!(bd->status&BD_UOWN) || fifo_count==USBHOST_FIFO_DEPTH)
+        return 0;
+    memcpy(bd->address, packet, 8);
+    bd->bytecount = 8;
+    bd->status = TOKEN_SETUP;
+    U1CONbits.PKTDIS = 1;
+    return usbhost_post(0, 0);
+}
+
+static int usbhost_in(uint16_t ep, uint8_t *buffer, uint16_t *length) {
+    BUFDESC *bd = usbhost_bd(ep, 1);
+
+    if (U1CONbits.PKTDIS || !(bd->status&BD_UOWN) || fifo_count==USBHOST_FIFO_DEPTH)
+        return 0;
+    if (bd->status&BD_BSTALL)
+        return -1;
+    *length = bd->bytecount;
+    if (buffer)
+        memcpy(buffer, bd->address, *length);
+    bd->status = TOKEN_IN|(bd->status&0x40);
+    return usbhost_post(ep, 1);
+}
+
+static int usbhost_out(uint16_t ep, uint8_t *buffer, uint16_t length, uint16_t data01) {
+    BUFDESC *bd = usbhost_bd(ep, 0);
+
+    if (U1CONbits.PKTDIS || !(bd->status&BD_UOWN) || fifo_count==USBHOST_FIFO_DEPTH)
+        return 0;
+    if (bd->status&BD_BSTALL)
+        return -1;
+    if ((bd->status&BD_DTSEN) && !(bd->status&BD_DTS)!=!data01)
+        return 1;                           // taken for a retransmission, the firmware never sees it
+    if (length>bd->bytecount)
+        length = bd->bytecount;
+    memcpy(bd->address, buffer, length);
+    bd->bytecount = length;
+    bd->status = TOKEN_OUT|(bd->status&0x40);
+    return usbhost_post(ep, 0);
+}
+
+void usbhost_init(void) {
+    memset((void *)&sim_U1IR, 0, sizeof(sim_U1IR));
+    sim_U1IR_clear = 0;
+    fifo_count = 0;
+    memset(ppbi, 0, sizeof(ppbi));
+    xfer.stage = STAGE_IDLE;
+    xfer.result = 0;
+    script = NULL;
+    script_left = 0;
+    stream_callback = NULL;
+    reset_sent = 0;
+    sof_next = USBHOST_FRAME;
+    frame = 0;
+}
+
+int usbhost_busy(void) {
+    return xfer.stage!=STAGE_IDLE || script_left;
+}
+
+int usbhost_result(void) {
+    return xfer.result;
+}
+
+int usbhost_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data) {
+    if (xfer.stage!=STAGE_IDLE)
+        return -1;
+    xfer.setup[0] = bmRequestType;
+    xfer.setup[1] = bRequest;
+    xfer.setup[2] = wValue&0xFF;
+    xfer.setup[3] = wValue>>8;
+    xfer.setup[4] = wIndex&0xFF;
+    xfer.setup[5] = wIndex>>8;
+    xfer.setup[6] = wLength&0xFF;
+    xfer.setup[7] = wLength>>8;
+    xfer.data = data;
+    xfer.length = wLength;
+    xfer.done = 0;
+    xfer.result = 0;
+    xfer.stage = STAGE_SETUP;
+    return 0;
+}
+
+void usbhost_stream(uint16_t ep, void (*callback)(uint8_t *data, uint16_t length)) {
+    stream_ep = ep;
+    stream_callback = callback;
+}
+
+void usbhost_enumerate(void) {
+    script = enumeration;
+    script_left = sizeof(enumeration)/sizeof(enumeration[0]);
+}
+
+static void usbhost_finish(int result) {
+    xfer.result = result;
+    xfer.stage = STAGE_IDLE;
+}
+
+// Returns nonzero if a control transaction took place on the bus
+static int usbhost_transfer(void) {
+    uint16_t length;
+    int ret = 0;
+
+    switch (xfer.stage) {
+        case STAGE_SETUP:
+            ret = usbhost_setup(xfer.setup);
+            xfer.data01 = 1;
+            if (ret>0)
+                xfer.stage = !xfer.length ? STAGE_STATUS_IN:(xfer.setup[0]&0x80) ? STAGE_DATA_IN:STAGE_DATA_OUT;
+            break;
+        case STAGE_DATA_IN:
+            ret = usbhost_in(0, script_buffer, &length);
+            if (ret<0) {
+                usbhost_finish(-1);
+            } else if (ret>0) {
+                if (length>xfer.length-xfer.done)
+                    length = xfer.length-xfer.done;
+                if (xfer.data)
+                    memcpy(xfer.data+xfer.done, script_buffer, length);
+                xfer.done += length;
+                if (length<MAX_PACKET_SIZE || xfer.done==xfer.length)
+                    xfer.stage = STAGE_STATUS_OUT;
+            }
+            break;
+        case STAGE_DATA_OUT:
+            length = xfer.length-xfer.done;
+            if (length>MAX_PACKET_SIZE)
+                length = MAX_PACKET_SIZE;
+            ret = usbhost_out(0, xfer.data ? xfer.data+xfer.done:script_buffer, length, xfer.data01);
+            if (ret<0) {
+                usbhost_finish(-1);
+            } else if (ret>0) {
+                xfer.data01 ^= 1;
+                xfer.done += length;
+                if (xfer.done==xfer.length)
+                    xfer.stage = STAGE_STATUS_IN;
+            }
+            break;
+        case STAGE_STATUS_IN:
+            ret = usbhost_in(0, NULL, &length);
+            if (ret)
+                usbhost_finish(ret<0 ? -1:xfer.done);
+            break;
+        case STAGE_STATUS_OUT:
+            ret = usbhost_out(0, NULL, 0, 1);
+            if (ret)
+                usbhost_finish(ret<0 ? -1:xfer.done);
+            break;
+    }
+    return ret;
+}
+
+void usbhost_step(void) {
+    uint16_t length;
+
+    if (!U1OTGCONbits.DPPULUP)
+        return;                             // not attached
+    if (!reset_sent) {                      // bus reset once the pull-up is seen
+        sim_U1IR.bits.URSTIF = 1;
+        memset(ppbi, 0, sizeof(ppbi));      // stands in for the firmware's PPBRST pulse
+        reset_sent = 1;
+        return;
+    }
+    if (sim_time()>=sof_next) {
+        sof_next += USBHOST_FRAME*(1.+sim_usb_ppm*1e-6);
+        frame = (frame+1)&0x7FF;
+        U1FRML = frame&0xFF;
+        U1FRMH = frame>>8;
+        sim_U1IR.bits.SOFIF = 1;
+    }
+    if (xfer.stage==STAGE_IDLE && script_left) {
+        memcpy(xfer.setup, *script++, 8);
+        script_left--;
+        xfer.data = NULL;
+        xfer.length = xfer.setup[6]|(xfer.setup[7]<<8);
+        xfer.done = 0;
+        xfer.stage = STAGE_SETUP;
+    }
+    if (!usbhost_transfer() && stream_callback) {   // bulk IN polling gets the bus when EP0 is idle or NAKing
+        if (usbhost_in(stream_ep, script_buffer, &length)>0)
+            stream_callback(script_buffer, length);
+    }
+}
@@ -0,0 +1,21 @@
+#include "hal.h"
+#include "snapshot.h"
+
+static volatile SAMPLE buffer[2];
+static volatile uint16_t sequence;  // buffer[sequence&1] is the latest
+
+void snapshot_publish(SAMPLE *sample) {
+    uint16_t next = sequence+1;
+
+    buffer[next&1] = *sample;       // nobody reads this one until...
+    sequence = next;                // ...this single write hands it over
+}
+
+void snapshot_read(SAMPLE *sample) {
+    uint16_t seq;
+
+    do {                            // a publish during the copy makes us take the newer one
+        seq = sequence;
+        *sample = buffer[seq&1];
+    } while (seq!=sequence);
+}
@@ -0,0 +1,20 @@
+/*
+	Coherent sensor snapshot
+
+	The control loop publishes each tick's SAMPLE here once it is complete;
+	USB and the background read the latest one whole. The writer fills the
+	buffer readers are not pointed at and then bumps a sequence counter, and
+	readers retry their copy if the counter moved under them, so neither
+	side ever disables interrupts. Only one context may publish, and it
+	must outrank every reader (the control loop does).
+*/
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "telemetry.h"
+
+void snapshot_publish(SAMPLE *sample);
+void snapshot_read(SAMPLE *sample);
+
+#endif
@@ -0,0 +1,44 @@
+#include "hal.h"
+#include "sof.h"
+
+static volatile uint16_t tick_val;      // tick the control loop is on...
+static volatile uint16_t tick_start;    // ...and timer5 when it started
+static uint16_t frame;                  // last SOF latched
+static SOF_TIME frame_time;
+
+void init_sof(void) {
+    tick_val = 0;
+    tick_start = TMR5;
+    frame = 0;
+    frame_time.tick = 0;
+    frame_time.phase = 0;
+}
+
+void sof_tick(uint16_t tick) {
+    tick_start = TMR5;
+    tick_val = tick;
+}
+
+void sof_now(SOF_TIME *time) {
+    uint16_t start, now;
+
+    do {                                // a tick starting under us makes us read it again
+        time->tick = tick_val;
+        start = tick_start;
+        now = TMR5;
+    } while (time->tick!=tick_val);
+    time->phase = now-start;
+}
+
+void sof_latch(void) {
+    SOF_TIME time;
+
+    sof_now(&time);                     // first, it only gets later
+    frame = (U1FRMH<<8|U1FRML)&0x7FF;
+    frame_time = time;
+}
+
+uint16_t sof_read(SOF_TIME *time) {
+    *time = frame_time;
+    return frame;
+}
@@ -0,0 +1,34 @@
+/*
+	Device time against USB frame time
+
+	The device keeps time in control ticks, which every SAMPLE carries. At
+	the top of each tick the control loop hands sof_tick() the tick it is
+	on, and the moment is noted on timer5 (CAPTURE_FREQ), so any later one
+	reads as the tick plus timer5 counts into it (SOF_TIME).
+
+	The host's USB controller starts a frame every millisecond off its own
+	clock and numbers it (11 bits) in the SOF token. ServiceUSB() hands
+	each SOF to sof_latch(), which pairs its frame number with the device
+	time, so the host can fit device ticks to frame time, and from there
+	to its own clock, offset and drift both. A latch is as late as
+	ServiceUSB() is getting to SOFIF (the USB interrupt, or with polled USB
+	the background loop), never early: the host's fit leans on that.
+*/
+
+#ifndef _SOF_H_
+#define _SOF_H_
+
+#include <stdint.h>
+
+typedef struct {
+    uint16_t tick;                  // control tick
+    uint16_t phase;                 // timer5 counts into it
+} SOF_TIME;
+
+void init_sof(void);
+void sof_tick(uint16_t tick);       // top of each control tick, from the control loop only
+void sof_latch(void);               // from ServiceUSB() when SOFIF is set
+void sof_now(SOF_TIME *time);       // from anything the control loop outranks
+uint16_t sof_read(SOF_TIME *time);  // frame number of the last SOF, and when it was latched
+
+#endif
@@ -0,0 +1,246 @@
+#include "hal.h"
+#include "usb.h"
+#include "usb_app.h"
+#include "telemetry.h"
+
+static SAMPLE ring[TELEMETRY_RING];
+static volatile uint16_t ring_head;         // advanced only by the control loop
+static volatile uint16_t ring_tail;         // advanced only by the background
+static volatile uint16_t dropped;           // samples lost to a full ring
+
+// Packet buffer states
+#define PACKET_FREE     0
+#define PACKET_READY    1                   // packed, waiting for a buffer descriptor
+#define PACKET_BUSY     2                   // handed to the SIE
+
+// Packets go through the buffers, and with USB_PINGPONG through the even and
+// odd EP1 IN descriptors, in strict rotation, so three indices are enough.
+static BYTE packet[2][MAX_PACKET_SIZE];
+static volatile BYTE state[2];
+static BYTE fill;                           // packet the background packs next
+static BYTE next;                           // packet armed next
+static volatile BYTE done;                  // packet the SIE completes next, which is the descriptor it uses next
+static volatile BYTE inflight;              // packets the SIE owns, at most USB_PPB
+static BYTE data01;                         // DATA0/DATA1 toggle for the next packet
+static BYTE sequence;
+static volatile BYTE enabled;
+static volatile BYTE restart;               // set from the USB interrupt, the stream restarted by the background
+
+// The packet being filled, and how the host wants the next one
+static BYTE length[2];                      // bytes in each buffer once packed
+static BYTE count;                          // samples in packet[fill] so far, 0 before it is started
+static BYTE *put;                           // where its next sample goes
+static uint16_t first;                      // tick of its first sample
+static uint16_t prev[TELEMETRY_CHANNELS];   // channels of its last sample, what the next is coded against
+static BYTE mask;                           // channels it carries
+static BYTE hold;                           // samples it is sent at
+static volatile BYTE format_mask;           // taken up when the next packet is started
+static volatile BYTE format_hold;
+
+void init_telemetry(void) {
+    ring_head = 0;
+    ring_tail = 0;
+    dropped = 0;
+    sequence = 0;
+    done = 0;
+    enabled = 0;
+    restart = 0;
+    format_mask = TELEMETRY_DEFAULT;
+    format_hold = TELEMETRY_HOLD;
+}
+
+void telemetry_record(SAMPLE *sample) {
+    uint16_t head = ring_head;
+
+    if (!enabled)
+        return;
+    if ((uint16_t)(head-ring_tail)>=TELEMETRY_RING) {
+        dropped++;                          // host is not keeping up
+        return;
+    }
+    ring[head&(TELEMETRY_RING-1)] = *sample;
+    ring_head = head+1;
+}
+
+static BYTE *telemetry_put(BYTE *ptr, uint16_t val) {
+    *ptr++ = val&0xFF;
+    *ptr++ = val>>8;
+    return ptr;
+}
+
+static BYTE *telemetry_varint(BYTE *ptr, int16_t delta) {
+    uint16_t val = ((uint16_t)delta<<1)^(uint16_t)(delta>>15);   // zig-zag: small either way stays short
+
+    while (val>=0x80) {
+        *ptr++ = (val&0x7F)|0x80;
+        val >>= 7;
+    }
+    *ptr++ = val;
+    return ptr;
+}
+
+// Codes a sample's channels against the last one's into buf, returning its end
+static BYTE *telemetry_encode(BYTE *buf, SAMPLE *sample, uint16_t *vals) {
+    BYTE n;
+
+    vals[0] = sample->current;
+    vals[1] = sample->emf;
+    vals[2] = sample->fb;
+    vals[3] = sample->enc;
+    vals[4] = sample->pos;
+    vals[5] = sample->vel;
+    vals[6] = sample->acc;
+    vals[7] = sample->edges;
+    for (n = 0; n<TELEMETRY_CHANNELS; n++)
+        if (mask&(1<<n))
+            buf = telemetry_varint(buf, (int16_t)(vals[n]-prev[n]));
+    return buf;
+}
+
+static void telemetry_start(uint16_t time) {
+    BYTE n;
+
+    put = packet[fill];
+    mask = format_mask;
+    hold = format_hold;
+    first = time;
+    *put++ = TELEMETRY_VERSION;
+    *put++ = sequence++;
+    *put++ = 0;                             // sample count, once it is known
+    *put++ = mask;
+    put = telemetry_put(put, time);
+    put = telemetry_put(put, dropped);
+    for (n = 0; n<TELEMETRY_CHANNELS; n++)
+        prev[n] = 0;
+}
+
+static void telemetry_close(void) {
+    packet[fill][2] = count;
+    length[fill] = put-packet[fill];
+    count = 0;
+    state[fill] = PACKET_READY;
+    fill ^= 1;
+}
+
+// Adds what the ring holds to the packet being filled, sending it on when
+// the next sample does not fit, does not follow on, or it has hold of them
+static void telemetry_pack(void) {
+    BYTE code[3*TELEMETRY_CHANNELS];        // a varint of 16 bits is at most 3 bytes
+    uint16_t vals[TELEMETRY_CHANNELS];
+    uint16_t tail = ring_tail;
+    SAMPLE *sample;
+    BYTE *end, *ptr;
+    BYTE n;
+
+    while (state[fill]==PACKET_FREE && tail!=ring_head) {
+        sample = &ring[tail&(TELEMETRY_RING-1)];
+        if (!count) {
+            telemetry_start(sample->time);
+        } else if (sample->time!=(uint16_t)(first+count)) {
+            telemetry_close();              // samples were dropped in between
+            continue;
+        }
+        end = telemetry_encode(code, sample, vals);
+        if (end-code>packet[fill]+MAX_PACKET_SIZE-put) {
+            telemetry_close();
+            continue;
+        }
+        for (ptr = code; ptr<end; )
+            *put++ = *ptr++;
+        for (n = 0; n<TELEMETRY_CHANNELS; n++)
+            prev[n] = vals[n];
+        tail++;
+        if (++count>=hold || count==TELEMETRY_MAX)
+            telemetry_close();
+    }
+    ring_tail = tail;
+}
+
+// Called with the USB interrupt masked or from it. Packets alternate between
+// the even and odd descriptors the same way the SIE does.
+static void telemetry_arm(void) {
+    BUFDESC *bd;
+
+    while (state[next]==PACKET_READY && inflight<USB_PPB) {
+        bd = &BD[USB_BD(1, 1, next)];
+        bd->address = packet[next];
+        bd->bytecount = length[next];
+        state[next] = PACKET_BUSY;
+        inflight++;
+        next ^= 1;
+        bd->status = data01 ? 0xC8:0x88;    // send packet as DATA0/DATA1, set UOWN bit last
+        data01 ^= 1;
+    }
+}
+
+// Starts the stream over, from the background with the USB interrupt masked:
+// the packer's state is the background's, so the USB interrupt only asks
+static void telemetry_restart(void) {
+    state[0] = PACKET_FREE;
+    state[1] = PACKET_FREE;
+    fill = done;                            // packets go on from the descriptor the SIE looks at next
+    next = done;
+    inflight = 0;
+    data01 = 0;
+    count = 0;                              // the sequence goes on, so the host sees what was lost
+    ring_tail = ring_head;
+    restart = 0;
+}
+
+void telemetry_busReset(void) {
+    done = 0;                               // PPBRST points the SIE at the even descriptors
+}
+
+void telemetry_configure(void) {
+    U1EP1 = 0x05;                           // EP1 is IN only with handshaking
+    telemetry_clearHalt();
+    enabled = 1;
+}
+
+void telemetry_clearHalt(void) {
+    BD[USB_BD(1, 1, 0)].status = 0x00;      // MCU owns the buffer descriptors, and nothing is armed until the restart
+    BD[USB_BD(1, 1, 1)].status = 0x00;
+    restart = 1;                            // which starts again from DATA0
+}
+
+int16_t telemetry_setFormat(uint16_t channels, uint16_t ticks) {
+    if (channels>TELEMETRY_ALL || ticks>TELEMETRY_MAX)
+        return -1;
+    format_mask = channels;
+    format_hold = ticks ? ticks:TELEMETRY_HOLD;     // 0 for the default
+    return 0;
+}
+
+uint16_t telemetry_mask(void) {
+    return format_mask;
+}
+
+uint16_t telemetry_hold(void) {
+    return format_hold;
+}
+
+void telemetry_service(void) {
+    if (!enabled || USB_USWSTAT!=CONFIG_STATE)
+        return;
+    if (restart) {
+        USB_DISABLE_INTERRUPT();
+        telemetry_restart();
+        USB_ENABLE_INTERRUPT();
+    }
+    telemetry_pack();                       // fill a free buffer while the other one is in flight
+    if (state[next]==PACKET_READY && inflight<USB_PPB) {
+        USB_DISABLE_INTERRUPT();
+        if (!restart)                       // not a packet packed before a restart asked for since
+            telemetry_arm();
+        USB_ENABLE_INTERRUPT();
+    }
+}
+
+void telemetry_serviceIn(void) {
+    done ^= 1;                              // the SIE moves on to the other descriptor either way
+    if (restart)
+        return;                             // a packet from before the restart
+    state[done^1] = PACKET_FREE;
+    inflight--;
+    telemetry_arm();                        // hand over a prepared buffer right away
+}
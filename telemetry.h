@@ -0,0 +1,80 @@
+/*
+	Streaming telemetry over EP1 IN
+
+	The control loop records one SAMPLE per tick into a ring buffer; the
+	background packs them into bulk packets of up to 64 bytes on EP1 IN,
+	filling one buffer while the SIE sends the other (with USB_PINGPONG,
+	both can be queued on the even and odd descriptors). A packet is
+
+	  byte 0    TELEMETRY_VERSION
+	  byte 1    sequence number
+	  byte 2    samples in it
+	  byte 3    channel mask, the TELEMETRY_ channels each sample carries
+	  bytes 4-5 control tick of the first sample; the rest follow on
+	            consecutive ticks, so a gap starts a new packet
+	  bytes 6-7 samples dropped so far
+
+	then, per sample, each channel in the mask in bit order as a varint of
+	its zig-zagged change from the previous sample: 7 bits a byte, least
+	significant first, the top bit set on all but the last. The first
+	sample's changes are from 0, so every packet decodes on its own. Most
+	channels move by a few counts a tick and take one byte, so a packet
+	holds 6 samples of the seven TELEMETRY_DEFAULT channels, 27 of two and
+	55 of one, where it held 3 at full width. TELEMETRY_EDGES, the edges
+	the loop has taken from input capture whether the EMF gave them a
+	direction or not, is only streamed when asked for: a replay needs it.
+
+	A packet is sent once the next sample would not fit, or once it holds
+	the samples of TELEMETRY_HOLD ticks, which bounds the latency; the
+	host can trade latency for fewer packets, and pick the channels, with
+	telemetry_setFormat().
+*/
+
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdint.h>
+
+#define TELEMETRY_RING      64      // samples buffered between the control loop and USB (power of 2)
+#define TELEMETRY_VERSION   2       // of the packet layout
+#define TELEMETRY_HEADER    8       // bytes of packet header
+#define TELEMETRY_MAX       56      // samples a packet can hold, at a byte each
+#define TELEMETRY_HOLD      5       // default ticks a packet collects before it is sent, 1ms
+
+// Channels, in the order they are encoded
+#define TELEMETRY_CURRENT   0x01
+#define TELEMETRY_EMF       0x02
+#define TELEMETRY_FB        0x04
+#define TELEMETRY_ENC       0x08
+#define TELEMETRY_POS       0x10
+#define TELEMETRY_VEL       0x20
+#define TELEMETRY_ACC       0x40
+#define TELEMETRY_EDGES     0x80
+#define TELEMETRY_CHANNELS  8
+#define TELEMETRY_ALL       0xFF
+#define TELEMETRY_DEFAULT   0x7F    // all but TELEMETRY_EDGES
+
+typedef struct {
+    uint16_t time;                  // control tick the sample was taken on
+    uint16_t current;
+    uint16_t emf;
+    uint16_t fb;
+    uint16_t enc;                   // as the loop sees it, inside the soft limits
+    uint16_t pos;                   // unclamped, low half
+    int16_t vel;                    // observed, counts/s
+    int16_t acc;                    // observed, 16 counts/s^2
+    uint16_t edges;                 // taken from input capture since start, counted or not
+} SAMPLE;
+
+void init_telemetry(void);
+void telemetry_record(SAMPLE *sample);
+void telemetry_configure(void);     // from the USB interrupt on SET_CONFIGURATION, the stream restarted by telemetry_service()
+void telemetry_clearHalt(void);     // likewise on CLEAR_FEATURE(ENDPOINT_HALT) of EP1 IN
+void telemetry_busReset(void);      // from the USB interrupt on a bus reset
+int16_t telemetry_setFormat(uint16_t channels, uint16_t ticks);    // -1 if either is out of range
+uint16_t telemetry_mask(void);
+uint16_t telemetry_hold(void);
+void telemetry_service(void);
+void telemetry_serviceIn(void);
+
+#endif
@@ -0,0 +1,108 @@
+#include "hal.h"
+#include "trajectory.h"
+
+// MAX_PACKET_SIZE is a multiple of TRAJECTORY_POINT, so points never span packets
+static _POINT points[2][TRAJECTORY_POINTS];
+static uint16_t lengths[2];                 // points in each buffer
+static uint16_t repeats[2];
+static volatile uint16_t active;            // buffer the control loop plays
+static volatile uint16_t ready;             // the other one is uploaded, switch to it
+
+static uint16_t loading;                    // upload side: buffer being filled
+static uint16_t expected;                   // bytes announced in the setup packet
+static uint16_t received;
+static uint16_t loading_repeat;
+
+static uint16_t playing;                    // control loop side
+static uint16_t tick;                       // position-loop ticks into the trajectory
+static uint16_t segment;                    // point the current segment starts at
+
+void init_trajectory(void) {
+    active = 0;
+    ready = 0;
+    playing = 0;
+    expected = 0;
+    received = 0;
+}
+
+int16_t trajectory_begin(uint16_t length, uint16_t repeat) {
+    if (!length || length%TRAJECTORY_POINT || length>TRAJECTORY_POINTS*TRAJECTORY_POINT)
+        return -1;
+    ready = 0;                              // an upload not yet switched to is replaced
+    loading = active^1;
+    expected = length;
+    received = 0;
+    loading_repeat = repeat;
+    return 0;
+}
+
+int16_t trajectory_load(uint8_t *data, uint16_t length) {
+    _POINT *point = &points[loading][received/TRAJECTORY_POINT];
+
+    if (received+length>expected)
+        return -1;
+    received += length;
+    for (; length>=TRAJECTORY_POINT; length -= TRAJECTORY_POINT, data += TRAJECTORY_POINT, point++) {
+        point->time = data[0]|(data[1]<<8);
+        point->pos = data[2]|(data[3]<<8);
+    }
+    return 0;
+}
+
+int16_t trajectory_end(void) {
+    _POINT *point = points[loading];
+    uint16_t num = received/TRAJECTORY_POINT;
+    uint16_t n;
+
+    if (received!=expected)
+        return -1;
+    for (n = 1; n<num; n++) {
+        if (point[n].time<=point[n-1].time)
+            return -1;
+    }
+    lengths[loading] = num;
+    repeats[loading] = loading_repeat;
+    expected = 0;
+    ready = 1;
+    return 0;
+}
+
+// Called once per position-loop pass; returns the setpoint to servo to,
+// the one passed in when no trajectory is playing
+uint16_t trajectory_update(uint16_t setpoint) {
+    _POINT *point;
+    uint16_t num;
+
+    if (ready) {                            // start the uploaded trajectory
+        active ^= 1;
+        ready = 0;
+        playing = 1;
+        tick = 0;
+        segment = 0;
+    }
+    if (!playing)
+        return setpoint;
+
+    point = points[active];
+    num = lengths[active];
+    while (segment+1<num && tick>=point[segment+1].time)
+        segment++;
+    if (segment+1==num) {                   // reached the last point
+        setpoint = point[segment].pos;
+        if (repeats[active]) {
+            tick = 0;
+            segment = 0;
+        } else {
+            playing = 0;
+        }
+        return setpoint;
+    }
+    if (tick<=point[segment].time) {        // before the first point
+        setpoint = point[segment].pos;
+    } else {
+        setpoint = point[segment].pos+(int16_t)(((int32_t)(int16_t)(point[segment+1].pos-point[segment].pos)*
+                   (tick-point[segment].time))/(point[segment+1].time-point[segment].time));
+    }
+    tick++;
+    return setpoint;
+}
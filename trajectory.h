@@ -0,0 +1,34 @@
+/*
+	Setpoint trajectories uploaded in one control transfer
+
+	The host sends a whole trajectory as the OUT data stage of one vendor
+	request, spread over as many EP0 packets as it takes: up to
+	TRAJECTORY_POINTS points of 4 bytes, each a time in position-loop ticks
+	from the start of playback and an encoder count, little-endian, times
+	increasing. Points are loaded as packets arrive into the buffer the
+	control loop is not playing; once the transfer completes, the loop
+	switches to it on its next pass and interpolates linearly between the
+	points, holding the last one when the trajectory ends, or starting over
+	if it was uploaded to repeat.
+*/
+
+#ifndef _TRAJECTORY_H_
+#define _TRAJECTORY_H_
+
+#include <stdint.h>
+
+#define TRAJECTORY_POINTS   128
+#define TRAJECTORY_POINT    4           // bytes per point in the data stage
+
+typedef struct {
+    uint16_t time;                      // position-loop ticks from the start
+    uint16_t pos;                       // encoder count
+} _POINT;
+
+void init_trajectory(void);
+int16_t trajectory_begin(uint16_t length, uint16_t repeat);     // -1 if length is not a valid upload
+int16_t trajectory_load(uint8_t *data, uint16_t length);        // -1 past the announced length
+int16_t trajectory_end(void);           // -1 if the points are not in time order
+uint16_t trajectory_update(uint16_t setpoint);
+
+#endif
@@ -1,9 +1,17 @@
-#include <p24FJ128GB206.h>
+#include "hal.h"
 #include "usb.h"
+#include "usb_app.h"
+#include "prof.h"
+#include "sof.h"
 
-BUFDESC __attribute__ ((aligned (512))) BD[32];
+#define USB_PRIORITY    3   // USB interrupt runs below the control loop and encoder
+
+BUFDESC __attribute__ ((aligned (512))) BD[USB_NUM_BD];
 
 BYTE EP0_OUT_buffer[MAX_PACKET_SIZE];
+#ifdef USB_PINGPONG
+BYTE EP0_OUT_odd_buffer[MAX_PACKET_SIZE];
+#endif
 BYTE EP0_IN_buffer[MAX_PACKET_SIZE];
 
 BUFDESC USB_buffer_desc;
@@ -14,11 +22,31 @@ BYTE USB_curr_config;
 BYTE USB_device_status;
 BYTE USB_USTAT;
 BYTE USB_USWSTAT;
+BYTE USB_ep0_out_odd;
+BYTE USB_ep0_in_odd;
+
+void InitEP0(void) {
+    BD[USB_BD(0, 0, 0)].bytecount = MAX_PACKET_SIZE;
+    BD[USB_BD(0, 0, 0)].address = EP0_OUT_buffer;   // EP0 OUT gets a buffer
+    BD[USB_BD(0, 0, 0)].status = 0x88;              // set UOWN bit (USB can write)
+    BD[USB_BD(0, 1, 0)].address = EP0_IN_buffer;    // EP0 IN gets a buffer
+    BD[USB_BD(0, 1, 0)].status = 0x08;              // clear UOWN bit (MCU can write)
+#ifdef USB_PINGPONG
+    BD[USB_BD(0, 0, 1)].bytecount = MAX_PACKET_SIZE;
+    BD[USB_BD(0, 0, 1)].address = EP0_OUT_odd_buffer;   // odd EP0 OUT gets its own buffer
+    BD[USB_BD(0, 0, 1)].status = 0x88;
+    BD[USB_BD(0, 1, 1)].address = EP0_IN_buffer;    // EP0 IN is never queued twice, so it shares
+    BD[USB_BD(0, 1, 1)].status = 0x08;
+#endif
+    USB_ep0_out_odd = 0;                            // PPBRST points the SIE at the even buffers
+    USB_ep0_in_odd = 0;
+}
 
 void InitUSB(void) {
     unsigned int *U1EP;
     BYTE n;
 
+    InitSerialNumber();
     U1CONbits.PPBRST = 1;
     U1ADDR = 0;
     U1EIR = 0xFF;
@@ -27,18 +55,24 @@ void InitUSB(void) {
     for (n = 0; n<16; n++)
         U1EP[n] = ENDPT_DISABLED;
     U1EP0 = ENDPT_CONTROL;
-    BD[EP0OUT].bytecount = MAX_PACKET_SIZE;
-    BD[EP0OUT].address = EP0_OUT_buffer;    // EP0 OUT gets a buffer
-    BD[EP0OUT].status = 0x88;               // set UOWN bit (USB can write)
-    BD[EP0IN].address = EP0_IN_buffer;      // EP0 IN gets a buffer
-    BD[EP0IN].status = 0x08;                // clear UOWN bit (MCU can write)
+    InitEP0();
+#ifdef USB_PINGPONG
+    U1CNFG1 = 0x02;             // even/odd ping-pong buffers on all endpoints
+#else
     U1CNFG1 = 0x00;
+#endif
     U1CNFG2 = 0x00;
     U1BDTP1 = (unsigned int)BD>>8;
     U1OTGCONbits.OTGEN = 1;
     U1OTGCONbits.DPPULUP = 1;
     U1PWRCbits.USBPWR = 1;
     U1CONbits.PKTDIS = 0;
+#ifdef USB_INTERRUPT
+    U1IE = U1IR_URSTIF|U1IR_UERRIF|U1IR_SOFIF|U1IR_TRNIF|U1IR_IDLEIF|U1IR_RESUMEIF|U1IR_STALLIF;
+    IPC21bits.USB1IP = USB_PRIORITY;
+    IFS5bits.USB1IF = 0;
+    IEC5bits.USB1IE = 1;        // service USB from _USB1Interrupt
+#endif
     USB_curr_config = 0x00;
     USB_USWSTAT = 0x00;         // default to powered state
     USB_device_status = 0x01;
@@ -59,25 +93,31 @@ void ServiceUSB(void) {
     if (U1IRbits.UERRIF) {
         U1EIR = 0xFF;           // clear all flags in U1EIR to clear U1EIR
         U1IR = U1IR_UERRIF;     // clear UERRIF
-    } else if (U1IRbits.SOFIF) {
+    }
+    if (U1IRbits.SOFIF) {
+        sof_latch();            // pair the frame number with device time, as early as we can
         U1IR = U1IR_SOFIF;      // clear SOFIF
-    } else if (U1IRbits.IDLEIF) {
+    }
+    if (U1IRbits.IDLEIF) {
         U1IR = U1IR_IDLEIF;     // clear IDLEIF
 //      U1PWRCbits.USUSPND = 1; // put USB module in suspend mode
 #ifdef SHOW_ENUM_STATUS
         PORTB &= 0xE0;
         PORTBbits.RB4 = 1;
 #endif
-    } else if (U1IRbits.RESUMEIF) {
+    }
+    if (U1IRbits.RESUMEIF) {
         U1IR = U1IR_RESUMEIF;   // clear RESUMEIF
 //      U1PWRCbits.USUSPND = 0; // resume USB module operation
 #ifdef SHOW_ENUM_STATUS
         PORTB &= 0xE0;
         PORTB |= 0x01<<USB_USWSTAT;
 #endif
-    } else if (U1IRbits.STALLIF) {
+    }
+    if (U1IRbits.STALLIF) {
         U1IR = U1IR_STALLIF;    // clear STALLIF
-    } else if (U1IRbits.URSTIF) {
+    }
+    if (U1IRbits.URSTIF) {
         USB_curr_config = 0x00;
         while (U1IRbits.TRNIF) {
             U1IR = U1IR_TRNIF;  // clear TRNIF to advance the U1STAT FIFO
@@ -91,11 +131,12 @@ void ServiceUSB(void) {
         U1EP = (unsigned int *)&U1EP0;
         for (n = 0; n<16; n++)
             U1EP[n] = ENDPT_DISABLED;   // clear all EP control registers to disable all endpoints
-        BD[EP0OUT].bytecount = MAX_PACKET_SIZE;
-        BD[EP0OUT].address = EP0_OUT_buffer;    // EP0 OUT gets a buffer
-        BD[EP0OUT].status = 0x88;               // set UOWN bit (USB can write)
-        BD[EP0IN].address = EP0_IN_buffer;      // EP0 IN gets a buffer
-        BD[EP0IN].status = 0x08;                // clear UOWN bit (MCU can write)
+#ifdef USB_PINGPONG
+        U1CONbits.PPBRST = 1;           // reset the ping-pong pointers to the even buffers
+        U1CONbits.PPBRST = 0;
+#endif
+        InitEP0();
+        EndpointsReset();               // let the application forget what it had queued
         U1ADDR = 0x00;                  // set USB Address to 0
         U1IR = 0xFF;                    // clear all the USB interrupt flags
         U1EP0 = ENDPT_CONTROL;          // EP0 is a control pipe and requires an ACK
@@ -106,12 +147,22 @@ void ServiceUSB(void) {
         PORTB &= 0xE0;
         PORTBbits.RB1 = 1;              // set bit 1 of PORTB to indicate Powered state
 #endif
-    } else if (U1IRbits.TRNIF) {
-        buf_desc_ptr = &BD[U1STAT>>3];  // ENDPT and DIR bits of U1STAT provide the offset into the buffer descriptor table
+        return;                         // reset flushed the U1STAT FIFO and cleared all flags
+    }
+    while (U1IRbits.TRNIF) {            // drain every transaction queued in the U1STAT FIFO
+        buf_desc_ptr = &BD[USB_STAT_BD(U1STAT)];   // ENDPT, DIR (and PPBI) bits of U1STAT provide the offset into the buffer descriptor table
         USB_buffer_desc.status = buf_desc_ptr->status;
         USB_buffer_desc.bytecount = buf_desc_ptr->bytecount;
         USB_buffer_desc.address = buf_desc_ptr->address;
         USB_USTAT = U1STAT;             // save the USB status register
+#ifdef USB_PINGPONG
+        if ((USB_USTAT&0xF0)==EP0) {    // the SIE moves on to the other EP0 buffer in this direction
+            if (USB_USTAT&0x08)
+                USB_ep0_in_odd = !(USB_USTAT&0x04);
+            else
+                USB_ep0_out_odd = !(USB_USTAT&0x04);
+        }
+#endif
         U1IR = U1IR_TRNIF;              // clear TRNIF
 #ifdef SHOW_ENUM_STATUS
         if (USB_USTAT&0xF0==EP0) {      // toggle RB5 to reflect EP0 activity
@@ -130,13 +181,24 @@ void ServiceUSB(void) {
                 ProcessOutToken();
         }
         if (USB_error_flags&0x01) {             // if there was a Request Error...
-            BD[EP0OUT].bytecount = MAX_PACKET_SIZE;   // ...get ready to receive the next Setup token...
-            BD[EP0IN].status = 0x84;
-            BD[EP0OUT].status = 0x84;                 // ...and issue a protocol stall on EP0
+            BD[EP0OUT_NEXT].bytecount = MAX_PACKET_SIZE;  // ...get ready to receive the next Setup token...
+            BD[EP0IN_NEXT].status = 0x84;
+            BD[EP0OUT_NEXT].status = 0x84;                // ...and issue a protocol stall on EP0
         }
     }
 }
 
+#ifdef USB_INTERRUPT
+void HAL_ISR _USB1Interrupt(void) {
+    PROF_DECLARE(t);
+
+    PROF_START(t);
+    IFS5bits.USB1IF = 0;                // clear first so a flag raised while servicing interrupts again
+    ServiceUSB();
+    PROF_END(PROF_USB, t);
+}
+#endif
+
 void ProcessSetupToken(void) {
     BYTE *buf_ptr;
 
@@ -149,12 +211,18 @@ void ProcessSetupToken(void) {
     USB_setup.wIndex.b[1] = *buf_ptr++;
     USB_setup.wLength.b[0] = *buf_ptr++;
     USB_setup.wLength.b[1] = *buf_ptr++;
-    BD[EP0OUT].bytecount = MAX_PACKET_SIZE;     // reset the EP0 OUT byte count
-    BD[EP0IN].status = 0x08;                   // return the EP0 IN buffer to us (dequeue any pending requests)
-    BD[EP0OUT].status = (!(USB_setup.bmRequestType&0x80) && (USB_setup.wLength.w)) ? 0xC8:0x88;    // set EP0 OUT UOWN back to USB and DATA0/DATA1 packet according to the request type
+    BD[EP0OUT_LAST].bytecount = MAX_PACKET_SIZE;    // reset the EP0 OUT byte count
+    BD[EP0IN_NEXT].status = 0x08;              // return the EP0 IN buffer to us (dequeue any pending requests)
+#ifdef USB_PINGPONG
+    BD[EP0IN_LAST].status = 0x08;
+    BD[EP0OUT_LAST].status = 0x88;             // the buffer the setup arrived in waits for the one after next
+    BD[EP0OUT_NEXT].bytecount = MAX_PACKET_SIZE;
+#endif
+    BD[EP0OUT_NEXT].status = (!(USB_setup.bmRequestType&0x80) && (USB_setup.wLength.w)) ? 0xC8:0x88;    // set EP0 OUT UOWN back to USB and DATA0/DATA1 packet according to the request type
     U1CONbits.PKTDIS = 0;                 // assuming there is nothing to dequeue, clear the packet disable bit
     USB_request.setup.bmRequestType = NO_REQUEST;   // clear the device request in process
     USB_request.setup.bRequest = NO_REQUEST;
+    USB_request.bytes_left.w = (USB_setup.bmRequestType&0x80) ? 0:USB_setup.wLength.w;  // OUT data stage to come, if any
     switch (USB_setup.bmRequestType&0x60) {    // extract request type bits
         case STANDARD_REQ:
             StandardRequests();
@@ -179,10 +247,10 @@ void StandardRequests(void) {
         case GET_STATUS:
             switch (USB_setup.bmRequestType&0x1F) { // extract request recipient bits
                 case RECIPIENT_DEVICE:
-                    BD[EP0IN].address[0] = USB_device_status;
-                    BD[EP0IN].address[1] = 0x00;
-                    BD[EP0IN].bytecount = 0x02;
-                    BD[EP0IN].status = 0xC8;                     // send packet as DATA1, set UOWN bit
+                    BD[EP0IN_NEXT].address[0] = USB_device_status;
+                    BD[EP0IN_NEXT].address[1] = 0x00;
+                    BD[EP0IN_NEXT].bytecount = 0x02;
+                    BD[EP0IN_NEXT].status = 0xC8;                     // send packet as DATA1, set UOWN bit
                     break;
                 case RECIPIENT_INTERFACE:
                     switch (USB_USWSTAT) {
@@ -191,10 +259,10 @@ void StandardRequests(void) {
                             break;
                         case CONFIG_STATE:
                             if (USB_setup.wIndex.b[0]<NUM_INTERFACES) {
-                                BD[EP0IN].address[0] = 0x00;
-                                BD[EP0IN].address[1] = 0x00;
-                                BD[EP0IN].bytecount = 0x02;
-                                BD[EP0IN].status = 0xC8;         // send packet as DATA1, set UOWN bit
+                                BD[EP0IN_NEXT].address[0] = 0x00;
+                                BD[EP0IN_NEXT].address[1] = 0x00;
+                                BD[EP0IN_NEXT].bytecount = 0x02;
+                                BD[EP0IN_NEXT].status = 0xC8;         // send packet as DATA1, set UOWN bit
                             } else {
                                 USB_error_flags |= 0x01;    // set Request Error Flag
                             }
@@ -204,10 +272,10 @@ void StandardRequests(void) {
                     switch (USB_USWSTAT) {
                         case ADDRESS_STATE:
                             if (!(USB_setup.wIndex.b[0]&0x0F)) {    // get EP, strip off direction bit and see if it is EP0
-                                BD[EP0IN].address[0] = (((USB_setup.wIndex.b[0]&0x80) ? BD[EP0IN].status:BD[EP0OUT].status)&0x04)>>2;    // return the BSTALL bit of EP0 IN or OUT, whichever was requested
-                                BD[EP0IN].address[1] = 0x00;
-                                BD[EP0IN].bytecount = 0x02;
-                                BD[EP0IN].status = 0xC8;         // send packet as DATA1, set UOWN bit
+                                BD[EP0IN_NEXT].address[0] = (((USB_setup.wIndex.b[0]&0x80) ? BD[EP0IN_NEXT].status:BD[EP0OUT_NEXT].status)&0x04)>>2;    // return the BSTALL bit of EP0 IN or OUT, whichever was requested
+                                BD[EP0IN_NEXT].address[1] = 0x00;
+                                BD[EP0IN_NEXT].bytecount = 0x02;
+                                BD[EP0IN_NEXT].status = 0xC8;         // send packet as DATA1, set UOWN bit
                             } else {
                                 USB_error_flags |= 0x01;    // set Request Error Flag
                             }
@@ -215,12 +283,12 @@ void StandardRequests(void) {
                         case CONFIG_STATE:
                             U1EP = (unsigned int *)&U1EP0;
                             n = USB_setup.wIndex.b[0]&0x0F;    // get EP and strip off direction bit for offset from U1EP0
-                            buf_desc_ptr = &BD[EP0OUT]+((n<<1)|((USB_setup.wIndex.b[0]&0x80) ? 0x01:0x00));    // compute pointer to the buffer descriptor for the specified EP
+                            buf_desc_ptr = &BD[USB_BD(n, (USB_setup.wIndex.b[0]&0x80) ? 0x01:0x00, 0)];    // compute pointer to the buffer descriptor for the specified EP
                             if (U1EP[n]&((USB_setup.wIndex.b[0]&0x80) ? 0x04:0x08)) { // if the specified EP is enabled for transfers in the specified direction...
-                                BD[EP0IN].address[0] = ((buf_desc_ptr->status)&0x04)>>2;    // ...return the BSTALL bit of the specified EP
-                                BD[EP0IN].address[1] = 0x00;
-                                BD[EP0IN].bytecount = 0x02;
-                                BD[EP0IN].status = 0xC8;         // send packet as DATA1, set UOWN bit
+                                BD[EP0IN_NEXT].address[0] = ((buf_desc_ptr->status)&0x04)>>2;    // ...return the BSTALL bit of the specified EP
+                                BD[EP0IN_NEXT].address[1] = 0x00;
+                                BD[EP0IN_NEXT].bytecount = 0x02;
+                                BD[EP0IN_NEXT].status = 0xC8;         // send packet as DATA1, set UOWN bit
                             } else {
                                 USB_error_flags |= 0x01;    // set Request Error Flag
                             }
@@ -243,8 +311,8 @@ void StandardRequests(void) {
                                 USB_device_status &= 0xFE;
                             else
                                 USB_device_status |= 0x01;
-                            BD[EP0IN].bytecount = 0x00;          // set EP0 IN byte count to 0
-                            BD[EP0IN].status = 0xC8;             // send packet as DATA1, set UOWN bit
+                            BD[EP0IN_NEXT].bytecount = 0x00;          // set EP0 IN byte count to 0
+                            BD[EP0IN_NEXT].status = 0xC8;             // send packet as DATA1, set UOWN bit
                             break;
                         default:
                             USB_error_flags |= 0x01;        // set Request Error Flag
@@ -254,8 +322,8 @@ void StandardRequests(void) {
                     switch (USB_USWSTAT) {
                         case ADDRESS_STATE:
                             if (!(USB_setup.wIndex.b[0]&0x0F)) {    // get EP, strip off direction bit, and see if its EP0
-                                BD[EP0IN].bytecount = 0x00;      // set EP0 IN byte count to 0
-                                BD[EP0IN].status = 0xC8;         // send packet as DATA1, set UOWN bit
+                                BD[EP0IN_NEXT].bytecount = 0x00;      // set EP0 IN byte count to 0
+                                BD[EP0IN_NEXT].status = 0xC8;         // send packet as DATA1, set UOWN bit
                             } else {
                                 USB_error_flags |= 0x01;    // set Request Error Flag
                             }
@@ -263,7 +331,7 @@ void StandardRequests(void) {
                         case CONFIG_STATE:
                             U1EP = (unsigned int *)&U1EP0;
                             if (n = USB_setup.wIndex.b[0]&0x0F) {    // get EP and strip off direction bit for offset from U1EP0, if not EP0...
-                                buf_desc_ptr = &BD[(n<<1)|((USB_setup.wIndex.b[0]&0x80) ? 0x01:0x00)];    // compute pointer to the buffer descriptor for the specified EP
+                                buf_desc_ptr = &BD[USB_BD(n, (USB_setup.wIndex.b[0]&0x80) ? 0x01:0x00, 0)];    // compute pointer to the buffer descriptor for the specified EP
                                 if (USB_setup.wIndex.b[0]&0x80) {    // if the specified EP direction is IN...
                                     if (U1EP[n]&0x04) {     // if EPn is enabled for IN transfers...
                                         buf_desc_ptr->status = (USB_setup.bRequest==CLEAR_FEATURE) ? 0x00:0x84;
@@ -277,10 +345,15 @@ void StandardRequests(void) {
                                         USB_error_flags |= 0x01;    // set Request Error Flag
                                     }
                                 }
+#ifdef USB_PINGPONG
+                                buf_desc_ptr[1].status = buf_desc_ptr->status;  // halt or clear the odd buffer too
+#endif
                             }
                             if (!(USB_error_flags&0x01)) {  // if there was no Request Error...
-                                BD[EP0IN].bytecount = 0x00;
-                                BD[EP0IN].status = 0xC8;         // ...send packet as DATA1, set UOWN bit
+                                if (n && USB_setup.bRequest==CLEAR_FEATURE)
+                                    EndpointHaltCleared(USB_setup.wIndex.b[0]);    // let the application re-arm it from DATA0
+                                BD[EP0IN_NEXT].bytecount = 0x00;
+                                BD[EP0IN_NEXT].status = 0xC8;         // ...send packet as DATA1, set UOWN bit
                             }
                             break;
                         default:
@@ -300,8 +373,8 @@ void StandardRequests(void) {
                 USB_request.setup.wValue.w = USB_setup.wValue.w;
                 USB_request.setup.wIndex.w = USB_setup.wIndex.w;
                 USB_request.setup.wLength.w = USB_setup.wLength.w;
-                BD[EP0IN].bytecount = 0x00;              // set EP0 IN byte count to 0
-                BD[EP0IN].status = 0xC8;                 // send packet as DATA1, set UOWN bit
+                BD[EP0IN_NEXT].bytecount = 0x00;              // set EP0 IN byte count to 0
+                BD[EP0IN_NEXT].status = 0xC8;                 // send packet as DATA1, set UOWN bit
             }
             break;
         case GET_DESCRIPTOR:
@@ -347,6 +420,9 @@ void StandardRequests(void) {
                         case 2:
                             USB_request.data_ptr = String2;
                             break;
+                        case 3:
+                            USB_request.data_ptr = String3;
+                            break;
                         default:
                             USB_error_flags |= 0x01;    // set Request Error Flag
                     }
@@ -363,9 +439,9 @@ void StandardRequests(void) {
             }
             break;
         case GET_CONFIGURATION:
-            BD[EP0IN].address[0] = USB_curr_config;          // copy current device configuration to EP0 IN buffer
-            BD[EP0IN].bytecount = 0x01;
-            BD[EP0IN].status = 0xC8;                         // send packet as DATA1, set UOWN bit
+            BD[EP0IN_NEXT].address[0] = USB_curr_config;          // copy current device configuration to EP0 IN buffer
+            BD[EP0IN_NEXT].bytecount = 0x01;
+            BD[EP0IN_NEXT].status = 0xC8;                         // send packet as DATA1, set UOWN bit
             break;
         case SET_CONFIGURATION:
             if (USB_setup.wValue.b[0]<=NUM_CONFIGURATIONS) {
@@ -382,13 +458,14 @@ void StandardRequests(void) {
                         break;
                     default:
                         USB_USWSTAT = CONFIG_STATE;
+                        InitEndpoints();        // let the application enable its data endpoints
 #ifdef SHOW_ENUM_STATUS
                         PORTB &= 0xE0;
                         PORTBbits.RB3 = 1;
 #endif
                 }
-                BD[EP0IN].bytecount = 0x00;                  // set EP0 IN byte count to 0
-                BD[EP0IN].status = 0xC8;                     // send packet as DATA1, set UOWN bit
+                BD[EP0IN_NEXT].bytecount = 0x00;                  // set EP0 IN byte count to 0
+                BD[EP0IN_NEXT].status = 0xC8;                     // send packet as DATA1, set UOWN bit
             } else {
                 USB_error_flags |= 0x01;                // set Request Error Flag
             }
@@ -397,9 +474,9 @@ void StandardRequests(void) {
             switch (USB_USWSTAT) {
                 case CONFIG_STATE:
                     if (USB_setup.wIndex.b[0]<NUM_INTERFACES) {
-                        BD[EP0IN].address[0] = 0x00;         // always send back 0 for bAlternateSetting
-                        BD[EP0IN].bytecount = 0x01;
-                        BD[EP0IN].status = 0xC8;             // send packet as DATA1, set UOWN bit
+                        BD[EP0IN_NEXT].address[0] = 0x00;         // always send back 0 for bAlternateSetting
+                        BD[EP0IN_NEXT].bytecount = 0x01;
+                        BD[EP0IN_NEXT].status = 0xC8;             // send packet as DATA1, set UOWN bit
                     } else {
                         USB_error_flags |= 0x01;        // set Request Error Flag
                     }
@@ -414,8 +491,8 @@ void StandardRequests(void) {
                     if (USB_setup.wIndex.b[0]<NUM_INTERFACES) {
                         switch (USB_setup.wValue.b[0]) {
                             case 0:                     // currently support only bAlternateSetting of 0
-                                BD[EP0IN].bytecount = 0x00;  // set EP0 IN byte count to 0
-                                BD[EP0IN].status = 0xC8;     // send packet as DATA1, set UOWN bit
+                                BD[EP0IN_NEXT].bytecount = 0x00;  // set EP0 IN byte count to 0
+                                BD[EP0IN_NEXT].status = 0xC8;     // send packet as DATA1, set UOWN bit
                                 break;
                             default:
                                 USB_error_flags |= 0x01;    // set Request Error Flag
@@ -470,12 +547,21 @@ void ProcessInToken(void) {
                     break;
             }
             break;
+        default:
+            EndpointInToken();
     }
 }
 
 void ProcessOutToken(void) {
+    unsigned int received;
+
     switch (USB_USTAT&0xF0) {    // extract the EP bits
         case EP0:
+            if (USB_request.bytes_left.w>USB_buffer_desc.bytecount) {
+                USB_request.bytes_left.w -= USB_buffer_desc.bytecount;     // VendorRequestsOut() sees what is still to come
+            } else {
+                USB_request.bytes_left.w = 0;
+            }
             switch (USB_request.setup.bmRequestType&0x60) {   // extract request type bits
                 case STANDARD_REQ:
                     break;
@@ -485,11 +571,21 @@ void ProcessOutToken(void) {
                     VendorRequestsOut();
                     break;
             }
-            BD[EP0OUT].bytecount = MAX_PACKET_SIZE;
-            BD[EP0OUT].status = 0x88;
-            BD[EP0IN].bytecount = 0x00;      // set EP0 IN byte count to 0
-            BD[EP0IN].status = 0xC8;         // send packet as DATA1, set UOWN bit
+            if (USB_request.bytes_left.w && USB_buffer_desc.bytecount==MAX_PACKET_SIZE) {  // more data packets to come...
+                received = USB_setup.wLength.w-USB_request.bytes_left.w;
+                BD[EP0OUT_LAST].bytecount = MAX_PACKET_SIZE;
+                // ...so hand the buffer back for data packet received/64-1+USB_PPB, DATA1 first and alternating
+                BD[EP0OUT_LAST].status = ((received/MAX_PACKET_SIZE-1+USB_PPB)&1) ? 0x88:0xC8;
+                break;
+            }
+            USB_request.bytes_left.w = 0;
+            BD[EP0OUT_LAST].bytecount = MAX_PACKET_SIZE;
+            BD[EP0OUT_LAST].status = 0x88;
+            BD[EP0IN_NEXT].bytecount = 0x00; // set EP0 IN byte count to 0
+            BD[EP0IN_NEXT].status = 0xC8;         // send packet as DATA1, set UOWN bit
             break;
+        default:
+            EndpointOutToken();
     }
 }
 
@@ -506,8 +602,8 @@ void SendDataPacket(void) {
         USB_request.bytes_left.w -= MAX_PACKET_SIZE;
     }
     for (n = 0; n<packet_length; n++) {
-        BD[EP0IN].address[n] = *USB_request.data_ptr++;
+        BD[EP0IN_NEXT].address[n] = *USB_request.data_ptr++;
     }
-    BD[EP0IN].bytecount = packet_length;
-    BD[EP0IN].status = ((BD[EP0IN].status^0x40)&0x40)|0x88; // toggle the DATA01 bit, clear the PIDs bits, and set the UOWN and DTS bits
+    BD[EP0IN_NEXT].bytecount = packet_length;
+    BD[EP0IN_NEXT].status = ((BD[EP0IN_LAST].status^0x40)&0x40)|0x88; // toggle the DATA01 bit, clear the PIDs bits, and set the UOWN and DTS bits
 }
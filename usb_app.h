@@ -0,0 +1,64 @@
+/*
+	Application hooks for data endpoints
+
+	usb.c only handles EP0 itself. Like VendorRequests(), these are called
+	from the USB stack and implemented by the application: InitEndpoints()
+	once the host selects a configuration, EndpointInToken() and
+	EndpointOutToken() when a transaction completes on any endpoint other
+	than EP0 (USB_USTAT holds the endpoint and direction), and
+	EndpointHaltCleared() once CLEAR_FEATURE(ENDPOINT_HALT) has taken an
+	endpoint's descriptors back, so whatever was queued on it is gone and
+	its next packet must go as DATA0, and EndpointsReset() after a bus
+	reset, which also points the SIE back at the even descriptors.
+*/
+
+#ifndef _USB_APP_H_
+#define _USB_APP_H_
+
+#ifndef EP1
+#define EP1         0x10    // ENDPT bits of U1STAT for endpoint 1
+#endif
+
+// Buffer descriptor table layout. With USB_PINGPONG every endpoint direction
+// has an even and an odd descriptor and the SIE alternates between them, so
+// the CPU can queue the next packet while the current one is on the bus.
+#ifdef USB_PINGPONG
+#define USB_PPB             2       // descriptors per endpoint direction
+#define USB_BD(ep, dir, odd)    (((ep)<<2)|((dir)<<1)|(odd))
+#define USB_STAT_BD(stat)       ((stat)>>2)     // ENDPT, DIR and PPBI bits of U1STAT
+#else
+#define USB_PPB             1
+#define USB_BD(ep, dir, odd)    (((ep)<<1)|(dir))
+#define USB_STAT_BD(stat)       ((stat)>>3)     // ENDPT and DIR bits of U1STAT
+#endif
+#define USB_NUM_BD          (16*2*USB_PPB)
+
+// EP0 descriptors the SIE uses next and used last in each direction
+#define EP0OUT_NEXT     USB_BD(0, 0, USB_ep0_out_odd)
+#define EP0OUT_LAST     USB_BD(0, 0, USB_ep0_out_odd^1)
+#define EP0IN_NEXT      USB_BD(0, 1, USB_ep0_in_odd)
+#define EP0IN_LAST      USB_BD(0, 1, USB_ep0_in_odd^1)
+
+// Keeps the USB interrupt from running between the two, for code that hands
+// buffers to the SIE from the background as well as from USB callbacks
+#ifdef USB_INTERRUPT
+#define USB_DISABLE_INTERRUPT()     (IEC5bits.USB1IE = 0)
+#define USB_ENABLE_INTERRUPT()      (IEC5bits.USB1IE = 1)
+#else
+#define USB_DISABLE_INTERRUPT()
+#define USB_ENABLE_INTERRUPT()
+#endif
+
+extern BYTE USB_ep0_out_odd;
+extern BYTE USB_ep0_in_odd;
+extern BYTE String3[];          // serial number, in RAM since each board's is read out of flash
+
+void InitSerialNumber(void);    // in descriptors.c, before the device connects
+
+void InitEndpoints(void);
+void EndpointInToken(void);
+void EndpointOutToken(void);
+void EndpointHaltCleared(BYTE endpoint);    // number, with 0x80 for IN, as in wIndex
+void EndpointsReset(void);
+
+#endif
@@ -1,30 +1,70 @@
+import struct
 import usb.core
+from vendor_requests import vendor_requests
 
-class usb_comm:
+def list_devices():
+    """Serial numbers of the boards on the bus."""
+    return [dev.serial_number for dev in usb.core.find(find_all = True, idVendor = 0x6666, idProduct = 0x0003)]
 
-    def __init__(self):
-        self.SET_VALS = 1
-        self.GET_VALS = 2
-        self.PRINT_VALS = 3
-        self.PING_ULTRASONIC = 4
-        self.dev = usb.core.find(idVendor = 0x6666, idProduct = 0x0003)
+class usb_comm(vendor_requests):
+    """The vendor requests (vendor_requests.py) over pyusb, with the
+    telemetry stream read one packet per get_samples() call."""
+
+    USBError = usb.core.USBError
+    TELEMETRY_EP = 0x81
+
+    def __init__(self, serial = None):
+        """Claims the board with that serial number, or the first found."""
+        self.sequence = None
+        self.dropped = 0
+        self.missed = 0
+        self.dev = usb.core.find(idVendor = 0x6666, idProduct = 0x0003,
+                                 custom_match = lambda dev: serial is None or dev.serial_number==serial)
         if self.dev is None:
-            raise ValueError('no USB device found matching idVendor = 0x6666 and idProduct = 0x0003')
+            raise ValueError('no USB device found matching idVendor = 0x6666 and idProduct = 0x0003' +
+                             (' and serial number ' + serial if serial else ''))
         self.dev.set_configuration()
 
     def close(self):
         self.dev = None
 
-    def set_vals(self, val1, val2):
-        try:
-            self.dev.ctrl_transfer(0x40, self.SET_VALS, int(val1), int(val2))
-        except usb.core.USBError:
-            print "Could not send SET_VALS vendor request."
+    def ctrl_transfer(self, bmRequestType, bRequest, wValue = 0, wIndex = 0, data = None):
+        """pyusb's, returning what an IN request read as a bytearray."""
+        ret = self.dev.ctrl_transfer(bmRequestType, bRequest, wValue, wIndex, data)
+        return bytearray(ret) if bmRequestType&0x80 else ret
 
-    def get_vals(self):
+    def get_samples(self, timeout = 100):
+        """Read one EP1 IN telemetry packet and return its samples as
+        [time, current_val, emf_val, fb_val, enc_count_val, enc_pos, vel, acc]
+        lists, enc_pos the low 16 bits of the unclamped position and vel and
+        acc the observer's, in counts/s and 16 counts/s^2; channels
+        set_telemetry() left out read 0. Lost packets are counted in
+        self.missed, samples the device could not queue in self.dropped."""
         try:
-            ret = self.dev.ctrl_transfer(0xC0, self.GET_VALS, 0, 0, 8)
+            ret = self.dev.read(self.TELEMETRY_EP, 64, timeout = timeout)
         except usb.core.USBError:
-            print "Could not send GET_VALS vendor request."
-        else:
-            return [int(ret[0])+int(ret[1])*256, int(ret[2])+int(ret[3])*256, int(ret[4])+int(ret[5])*256, int(ret[6])+int(ret[7])*256]
\ No newline at end of file
+            return []
+        if len(ret)<self.TELEMETRY_HEADER or ret[0]!=self.TELEMETRY_VERSION:
+            return []
+        version, sequence, count, mask, time, self.dropped = struct.unpack_from('<BBBBHH', ret)
+        if self.sequence is not None:
+            self.missed += (sequence-self.sequence-1)&0xFF
+        self.sequence = sequence
+        vals = [0]*len(self.TELEMETRY_CHANNELS)
+        samples = []
+        ptr = self.TELEMETRY_HEADER
+        for n in range(count):
+            for c in range(len(vals)):
+                if mask&(1<<c):
+                    val, shift = 0, 0
+                    while True:
+                        if ptr>=len(ret):
+                            return samples
+                        val |= (ret[ptr]&0x7F)<<shift
+                        shift += 7
+                        ptr += 1
+                        if not ret[ptr-1]&0x80:
+                            break
+                    vals[c] = (vals[c]+((val>>1)^-(val&1)))&0xFFFF
+            samples.append([(time+n)&0xFFFF]+vals[:5]+[v-0x10000 if v&0x8000 else v for v in vals[5:7]])
+        return samples
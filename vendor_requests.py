@@ -0,0 +1,241 @@
+import struct
+
+class vendor_requests(object):
+    """The board's vendor requests, for any transport to mix in. A
+    transport supplies ctrl_transfer(bmRequestType, bRequest, wValue,
+    wIndex, data), data being the length to read for IN requests and the
+    bytes to send for OUT ones, returning a bytearray and raising
+    self.USBError on failure; and get_samples(timeout) for the stream.
+    Runs under Python 2 (usb_comm.py) and 3 (host/haptic_host.py)."""
+
+    SET_VALS = 1
+    GET_VALS = 2
+    PRINT_VALS = 3
+    PING_ULTRASONIC = 4
+    SET_GAIN = 5
+    GET_GAINS = 6
+    CLEAR_EFFECTS = 7
+    ADD_EFFECT = 8
+    COMMIT_EFFECTS = 9
+    SET_TRAJECTORY = 10
+    GET_PROF = 11
+    SET_FILTER = 12
+    GET_FILTERS = 13
+    GET_EMF = 14
+    SET_LIMITS = 15
+    GET_LIMITS = 16
+    SET_TELEMETRY = 17
+    GET_TELEMETRY = 18
+    GET_CLOCK = 19
+    GET_STATE = 20
+    AUTOTUNE = 21
+    GET_AUTOTUNE = 22
+    STORE_CALIB = 23
+    ADC_CHANNELS = ['current', 'emf', 'fb']
+    FILTER_NONE = 0
+    FILTER_IIR = 1
+    FILTER_MEAN = 2
+    FILTER_MEDIAN = 3
+    PROF_SECTIONS = ['encoder', 'adc', 'pid', 'control', 'usb', 'period']
+    EFFECT_SPRING = 1
+    EFFECT_DETENTS = 2
+    EFFECT_WALL_LOW = 3
+    EFFECT_WALL_HIGH = 4
+    EFFECT_FRICTION = 5
+    EFFECT_DAMPER = 6
+    TELEMETRY_CHANNELS = ['current', 'emf', 'fb', 'enc', 'pos', 'vel', 'acc', 'edges']
+    TELEMETRY_ALL = 0xFF
+    TELEMETRY_VERSION = 2
+    TELEMETRY_HEADER = 8
+    AUTOTUNE_STATES = ['idle', 'running', 'done', 'failed']
+    CALIB_STATES = ['defaults', 'loaded', 'pending', 'stored', 'failed']
+
+    def set_vals(self, val1, val2):
+        try:
+            self.ctrl_transfer(0x40, self.SET_VALS, int(val1), int(val2))
+        except self.USBError:
+            print('Could not send SET_VALS vendor request.')
+
+    def get_vals(self):
+        try:
+            ret = self.ctrl_transfer(0xC0, self.GET_VALS, 0, 0, 8)
+        except self.USBError:
+            print('Could not send GET_VALS vendor request.')
+        else:
+            return list(struct.unpack('<4H', bytes(ret)))
+
+    def set_gain(self, index, val):
+        """Set gain index (0 kp, 1 ki, 2 kd of the position loop, 3 kp,
+        4 ki of the current loop) to the raw signed value; kp and ki have 6
+        fractional bits (see pid.h)."""
+        try:
+            self.ctrl_transfer(0x40, self.SET_GAIN, int(val)&0xFFFF, int(index))
+        except self.USBError:
+            print('Could not send SET_GAIN vendor request.')
+
+    def get_gains(self):
+        try:
+            ret = self.ctrl_transfer(0xC0, self.GET_GAINS, 0, 0, 10)
+        except self.USBError:
+            print('Could not send GET_GAINS vendor request.')
+        else:
+            return list(struct.unpack('<5h', bytes(ret)))
+
+    def autotune(self, relay = 0, hyst = 0):
+        """Have the device tune the position loop: a relay of current
+        command relay (FB current counts) either way about where the knob
+        is, switching hyst/256 counts either side, 0 for the defaults. Let
+        go of the knob; once get_autotune() says it is done, the gains are
+        in use and stored in flash for the next power-up."""
+        try:
+            self.ctrl_transfer(0x40, self.AUTOTUNE, int(relay), int(hyst))
+        except self.USBError:
+            print('Could not send AUTOTUNE vendor request.')
+
+    def get_autotune(self):
+        """Return [state, cycles, calib, ku, tu, kp, kd]: the autotune's
+        state (index into AUTOTUNE_STATES) and cycles so far, the stored
+        calibration's (CALIB_STATES), the ultimate gain and period (in ms)
+        it measured, and the kp and kd it set from them."""
+        try:
+            ret = self.ctrl_transfer(0xC0, self.GET_AUTOTUNE, 0, 0, 14)
+        except self.USBError:
+            print('Could not send GET_AUTOTUNE vendor request.')
+        else:
+            return list(struct.unpack('<5H2h', bytes(ret)))
+
+    def store_calib(self):
+        """Store the gains in use, set by hand or tuned, with the EMF and
+        observer calibration, for the device to start up with. The drive
+        goes off for the few tens of ms the flash takes."""
+        try:
+            self.ctrl_transfer(0x40, self.STORE_CALIB, 0, 0)
+        except self.USBError:
+            print('Could not send STORE_CALIB vendor request.')
+
+    def set_effects(self, effects):
+        """Replace the effect list with (type, pos, width, strength) tuples
+        and have the device render it (see effects.h for units)."""
+        try:
+            self.ctrl_transfer(0x40, self.CLEAR_EFFECTS, 0, 0)
+            for effect in effects:
+                self.ctrl_transfer(0x40, self.ADD_EFFECT, 0, 0, struct.pack('<HHHh', *effect))
+            self.ctrl_transfer(0x40, self.COMMIT_EFFECTS, 0, 0)
+        except self.USBError:
+            print('Could not send the effect vendor requests.')
+
+    def set_trajectory(self, points, repeat = False):
+        """Upload (time, position) points, times in position-loop ticks
+        (ms) from the start and increasing, in one transfer; the device
+        starts playing them as soon as it completes."""
+        data = b''.join(struct.pack('<HH', t, pos) for t, pos in points)
+        try:
+            self.ctrl_transfer(0x40, self.SET_TRAJECTORY, 1 if repeat else 0, 0, data)
+        except self.USBError:
+            print('Could not send SET_TRAJECTORY vendor request.')
+
+    def set_filter(self, channel, type, param = 0):
+        """Filter ADC channel (index or name from ADC_CHANNELS) with one of
+        the FILTER_ types and its parameter (see filter.h); the device
+        switches over on its next sample set."""
+        if not isinstance(channel, int):
+            channel = self.ADC_CHANNELS.index(channel)
+        try:
+            self.ctrl_transfer(0x40, self.SET_FILTER, int(type)|(int(param)<<8), channel)
+        except self.USBError:
+            print('Could not send SET_FILTER vendor request.')
+
+    def get_filters(self):
+        """Return a (type, param) pair per channel of ADC_CHANNELS."""
+        try:
+            ret = self.ctrl_transfer(0xC0, self.GET_FILTERS, 0, 0, 6)
+        except self.USBError:
+            print('Could not send GET_FILTERS vendor request.')
+        else:
+            return [(ret[2*n], ret[2*n+1]) for n in range(3)]
+
+    def get_emf(self):
+        """Return the calibrated EMF midpoint and the direction thresholds
+        either side of it as [mid, low, high]."""
+        try:
+            ret = self.ctrl_transfer(0xC0, self.GET_EMF, 0, 0, 6)
+        except self.USBError:
+            print('Could not send GET_EMF vendor request.')
+        else:
+            return list(struct.unpack('<3H', bytes(ret)))
+
+    def set_limits(self, low, high):
+        """Hold ENC_COUNT_VAL, the count the loops and effects act on, to
+        [low, high], 0 <= low <= high <= 32767 since the position loop takes
+        it as signed; the device refuses anything else. The unclamped
+        position still counts every edge. The device switches over on its
+        next control tick."""
+        try:
+            self.ctrl_transfer(0x40, self.SET_LIMITS, int(low), int(high))
+        except self.USBError:
+            print('Could not send SET_LIMITS vendor request.')
+
+    def get_limits(self):
+        """Return the soft limits as [low, high]."""
+        try:
+            ret = self.ctrl_transfer(0xC0, self.GET_LIMITS, 0, 0, 4)
+        except self.USBError:
+            print('Could not send GET_LIMITS vendor request.')
+        else:
+            return list(struct.unpack('<2H', bytes(ret)))
+
+    def set_telemetry(self, channels = None, hold = 0):
+        """Choose the channels the telemetry stream carries, a mask of
+        1<<TELEMETRY_CHANNELS.index(name) bits or a list of names (None for
+        all), and the most samples a packet holds back, 0 for the device's
+        default. Fewer channels pack more samples into each packet; the
+        ones left out read 0."""
+        if channels is None:
+            channels = self.TELEMETRY_ALL
+        elif not isinstance(channels, int):
+            channels = sum(1<<self.TELEMETRY_CHANNELS.index(name) for name in channels)
+        try:
+            self.ctrl_transfer(0x40, self.SET_TELEMETRY, channels, int(hold))
+        except self.USBError:
+            print('Could not send SET_TELEMETRY vendor request.')
+
+    def get_telemetry(self):
+        """Return the stream format as [version, channel mask, hold]."""
+        try:
+            ret = self.ctrl_transfer(0xC0, self.GET_TELEMETRY, 0, 0, 3)
+        except self.USBError:
+            print('Could not send GET_TELEMETRY vendor request.')
+        else:
+            return list(struct.unpack('<BBB', bytes(ret)))
+
+    def get_clock(self):
+        """Return the device's clock report as a dict: the frame number of
+        the last USB SOF and the device time it came in at, the device time
+        the request was handled at, and the last other vendor request with
+        the device time it was handled at and a count of them. Device times
+        are (tick, phase), phase in 1/phase_per_tick of a tick."""
+        try:
+            ret = self.ctrl_transfer(0xC0, self.GET_CLOCK, 0, 0, 20)
+        except self.USBError:
+            print('Could not send GET_CLOCK vendor request.')
+        else:
+            vals = struct.unpack('<7HBB2H', bytes(ret))
+            return {'frame': vals[0], 'sof': (vals[1], vals[2]), 'now': (vals[3], vals[4]),
+                    'request': vals[7], 'request_time': (vals[5], vals[6]), 'request_count': vals[8],
+                    'phase_per_tick': vals[9], 'rate': vals[10]}
+
+    def get_prof(self, section, clear = False):
+        """Return the cycle timing of one instrumented section (index or
+        name from PROF_SECTIONS) as a dict of min, max, count, mean and
+        histogram, a list of (lowest cycles, count) per bucket."""
+        if not isinstance(section, int):
+            section = self.PROF_SECTIONS.index(section)
+        try:
+            ret = self.ctrl_transfer(0xC0, self.GET_PROF, section, 1 if clear else 0, 48)
+        except self.USBError:
+            print('Could not send GET_PROF vendor request.')
+        else:
+            vals = struct.unpack('<HHIIHH16H', bytes(ret))
+            return {'min': vals[0], 'max': vals[1], 'count': vals[2],
+                    'mean': float(vals[3])/vals[2] if vals[2] else 0.,
+                    'histogram': [(vals[4]+(n<<vals[5]), vals[6+n]) for n in range(16)]}